@@ -7,6 +7,7 @@ sudo apt-get -y -q install \
 	qt5-default \
 	libqt5svg5-dev \
 	qt5-qmake \
-	libavahi-compat-libdnssd-dev
+	libavahi-compat-libdnssd-dev \
+	libxxhash-dev
 
 set +xue
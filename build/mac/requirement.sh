@@ -4,6 +4,9 @@ set -xue
 # Install qt5 from brew
 brew install qt5
 
+# Faster checksum (found by pkg-config)
+brew install pkg-config xxhash
+
 # Add path to find qmake (that will handle all other paths)
 export PATH="$(brew --prefix qt5)/bin:${PATH}"
 
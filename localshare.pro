@@ -1,5 +1,12 @@
 # Comment this to only compile the command line interface
 CONFIG += localshare_gui
+# XXH3 checksum support, if the xxHash library is found by pkg-config (comment this to disable)
+CONFIG += localshare_xxhash
+# Uncomment these to support chunk compression (requires the zstd / lz4 libraries)
+#CONFIG += localshare_zstd
+#CONFIG += localshare_lz4
+# Uncomment this to use io_uring for file I/O (Linux, requires the liburing library)
+#CONFIG += localshare_io_uring
 
 ### Compilation ###
 
@@ -15,13 +22,24 @@ HEADERS += \
 	src/compatibility.h \
 	src/portability.h \
 	\
+	src/core_async_io.h \
+	src/core_compression.h \
+	src/core_delta.h \
 	src/core_discovery.h \
+	src/core_file_hashing.h \
+	src/core_file_table.h \
+	src/core_hash.h \
+	src/core_hash_cache.h \
 	src/core_localshare.h \
 	src/core_payload.h \
+	src/core_scanner.h \
+	src/core_scheduler.h \
 	src/core_server.h \
 	src/core_settings.h \
 	src/core_transfer.h \
+	src/core_workers.h \
 	\
+	src/cli_benchmark.h \
 	src/cli_indicator.h \
 	src/cli_main.h \
 	src/cli_misc.h \
@@ -49,6 +67,30 @@ win32: { # Win
 	SOURCES += src/DLLStub.cpp
 }
 
+### Optional libraries ###
+
+localshare_xxhash {
+	packagesExist(libxxhash) {
+		DEFINES += LOCALSHARE_HAS_XXHASH
+		CONFIG += link_pkgconfig
+		PKGCONFIG += libxxhash
+	} else {
+		warning("xxHash library not found by pkg-config: only MD5 checksums are supported")
+	}
+}
+localshare_zstd {
+	DEFINES += LOCALSHARE_HAS_ZSTD
+	LIBS += -lzstd
+}
+localshare_lz4 {
+	DEFINES += LOCALSHARE_HAS_LZ4
+	LIBS += -llz4
+}
+localshare_io_uring {
+	DEFINES += LOCALSHARE_HAS_IO_URING
+	LIBS += -luring
+}
+
 # Misc information
 
 VERSION = 1.0
@@ -0,0 +1,304 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CLI_BENCHMARK_H
+#define CLI_BENCHMARK_H
+
+#include <QByteArray>
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QIODevice>
+#include <QStringList>
+#include <QTemporaryFile>
+#include <QTextStream>
+#include <cstdio>
+
+#include "cli_main.h"
+#include "core_hash.h"
+#include "core_payload.h"
+#include "core_transfer.h"
+
+namespace Cli {
+/* Micro-benchmarks of core components, for performance tuning.
+ * They do not use the network, and run synchronously (before the event loop).
+ *
+ * Errors are printed on stderr.
+ *
+ * hash: throughput of Payload::File::read_data () and its block checksums, for each supported
+ * algorithm (blocks are hashed in parallel by the Hasher threads).
+ * A temporary file is read through the same path as an upload, to a stream that discards data.
+ *
+ * files: memory used by the file list of a large synthetic payload (Payload::FileTable), and time
+ * to serialize and parse it as in an offer.
+ *
+ * offer: time to send the offer of the same payload, with the size prefix measured by a first
+ * serialization, or in one pass with Transfer::MessageWriter.
+ *
+ * mapping: throughput of read_data () on a very large file, with the whole file mapped or a
+ * sliding window (Const::mapping_window_size). The file is sparse (holes are read as zeros from
+ * memory), so that it does not need disk space.
+ */
+class Benchmark {
+	Q_DECLARE_TR_FUNCTIONS (Benchmark);
+
+private:
+	// QIODevice that discards written data
+	class NullDevice : public QIODevice {
+	protected:
+		qint64 readData (char *, qint64) Q_DECL_OVERRIDE { return -1; }
+		qint64 writeData (const char *, qint64 len) Q_DECL_OVERRIDE { return len; }
+	};
+
+	static constexpr qint64 hash_file_size = qint64 (256 << 20);
+	static constexpr quint32 nb_table_files = 1000000;
+	static constexpr qint64 mapping_file_size = qint64 (16) << 30;
+
+	static void error (const QString & msg) { QTextStream (stderr) << msg; }
+	static QString throughput (qint64 bytes, qint64 msec) {
+		return tr ("%1/s").arg (size_to_string (bytes * 1000 / qMax (msec, qint64 (1))));
+	}
+
+	static bool hash (void) {
+		QTemporaryFile tmp_file;
+		if (!tmp_file.open ()) {
+			error (tr ("Error: unable to create temporary file: %1\n").arg (tmp_file.errorString ()));
+			return false;
+		}
+		QByteArray block (int(Const::write_behind_size), Qt::Uninitialized);
+		for (int i = 0; i < block.size (); ++i)
+			block[i] = char(i * 7 + (i >> 8)); // Not uniform, not random
+		for (qint64 written = 0; written < hash_file_size; written += block.size ()) {
+			if (tmp_file.write (block) != block.size ()) {
+				error (tr ("Error: unable to write temporary file: %1\n").arg (tmp_file.errorString ()));
+				return false;
+			}
+		}
+		tmp_file.close ();
+
+		QFileInfo info (tmp_file.fileName ());
+		auto dir = info.dir ();
+		always_print (tr ("Hashing %1 file with chunks of %2\n")
+		                  .arg (size_to_string (hash_file_size), size_to_string (Const::chunk_size)));
+		for (auto algorithm : Payload::hash_algorithm_preference) {
+			if (!(Payload::supported_hash_algorithms () & Payload::hash_algorithm_bit (algorithm)))
+				continue;
+			NullDevice sink;
+			sink.open (QIODevice::WriteOnly);
+			QDataStream stream (&sink);
+			Payload::File file (info.fileName (), info.size (), info.lastModified ());
+
+			QElapsedTimer timer;
+			timer.start ();
+			if (!file.open (dir, QIODevice::ReadOnly, algorithm)) {
+				error (tr ("Error: %1\n").arg (file.get_last_error ()));
+				return false;
+			}
+			while (!file.at_end ()) {
+				if (file.read_data (stream, Const::chunk_size) == -1) {
+					error (tr ("Error: %1\n").arg (file.get_last_error ()));
+					return false;
+				}
+			}
+			file.wait_checksums ();
+			auto msec = timer.elapsed ();
+			auto checksum = file.get_block_checksum (0);
+			file.close ();
+
+			always_print (tr ("%1: %2 (%3 msec, %4 blocks, first checksum %5)\n")
+			                  .arg (Payload::hash_algorithm_name (algorithm))
+			                  .arg (throughput (hash_file_size, msec))
+			                  .arg (msec)
+			                  .arg (file.get_nb_blocks ())
+			                  .arg (QString::fromLatin1 (checksum.toHex ())));
+		}
+		return true;
+	}
+
+	static Payload::FileTable synthetic_file_table (void) {
+		Payload::FileTable table;
+		for (quint32 i = 0; i < nb_table_files; ++i) {
+			// 100 files per dir, 100 dirs per parent: similar to a source tree
+			auto path = QStringLiteral ("directory_%1/subdirectory_%2/file_name_%3.ext")
+			                .arg (i / 10000)
+			                .arg (i / 100 % 100)
+			                .arg (i % 100);
+			table.append (path, qint64 (i) * 4096, 0);
+		}
+		table.shrink_to_fit ();
+		return table;
+	}
+
+	static bool files (void) {
+		QElapsedTimer timer;
+		timer.start ();
+		auto table = synthetic_file_table ();
+		auto build_msec = timer.elapsed ();
+		qint64 path_bytes = 0;
+		for (quint32 i = 0; i < table.size (); ++i)
+			path_bytes += table.get_path_utf8 (i).size ();
+		always_print (tr ("%1 files (%2 of paths): table of %3 (%4 bytes/file) in %5 msec\n")
+		                  .arg (table.size ())
+		                  .arg (size_to_string (path_bytes))
+		                  .arg (size_to_string (table.memory_usage ()))
+		                  .arg (table.memory_usage () / table.size ())
+		                  .arg (build_msec));
+
+		QByteArray offer;
+		timer.start ();
+		{
+			QDataStream stream (&offer, QIODevice::WriteOnly);
+			stream.setVersion (Const::serializer_version);
+			table.to_stream (stream, 0, table.size ());
+		}
+		auto serialize_msec = timer.elapsed ();
+		Payload::FileTable parsed;
+		timer.start ();
+		{
+			QDataStream stream (offer);
+			stream.setVersion (Const::serializer_version);
+			if (!parsed.from_stream (stream, table.size ()) || parsed.size () != table.size ()) {
+				error (tr ("Error: unable to parse the file list\n"));
+				return false;
+			}
+		}
+		auto parse_msec = timer.elapsed ();
+		always_print (tr ("Offer: %1 (%2 bytes/file), serialized in %3 msec, parsed in %4 msec\n")
+		                  .arg (size_to_string (offer.size ()))
+		                  .arg (offer.size () / table.size ())
+		                  .arg (serialize_msec)
+		                  .arg (parse_msec));
+		return true;
+	}
+
+	static bool offer (void) {
+		Payload::Manager payload;
+		payload.set_files (QDir (QDir::tempPath ()), "payload", synthetic_file_table ());
+		QString username ("benchmark");
+		auto message = std::tie (username, payload);
+		NullDevice sink;
+		sink.open (QIODevice::WriteOnly);
+		QDataStream stream (&sink);
+		stream.setVersion (Const::serializer_version);
+		QElapsedTimer timer;
+
+		// Size measured by a first serialization, then written to the stream
+		timer.start ();
+		auto size = Transfer::serialized_info.compute_size (message);
+		stream << Transfer::Message::CodeType (Transfer::Message::Offer)
+		       << Transfer::Message::SizePrefixType (size) << message;
+		auto measured_msec = timer.elapsed ();
+
+		// Single pass, as sent by Transfer::Base
+		Transfer::MessageWriter writer;
+		timer.start ();
+		if (!writer.serialize (Transfer::Message::Offer, message)) {
+			error (tr ("Error: offer is too large\n"));
+			return false;
+		}
+		writer.write_to (stream);
+		auto single_pass_msec = timer.elapsed ();
+
+		always_print (tr ("Offer of %1 files (%2): measured then written in %3 msec, written in "
+		                  "one pass in %4 msec\n")
+		                  .arg (payload.get_nb_files ())
+		                  .arg (size_to_string (writer.get_size ()))
+		                  .arg (measured_msec)
+		                  .arg (single_pass_msec));
+		return true;
+	}
+
+	static bool mapping (void) {
+		QTemporaryFile tmp_file;
+		if (!tmp_file.open () || !tmp_file.resize (mapping_file_size)) {
+			error (tr ("Error: unable to create temporary file: %1\n").arg (tmp_file.errorString ()));
+			return false;
+		}
+		tmp_file.close ();
+
+		QFileInfo info (tmp_file.fileName ());
+		auto dir = info.dir ();
+		auto algorithm = Payload::HashAlgorithm::Md5;
+		for (auto a : Payload::hash_algorithm_preference) {
+			if (Payload::supported_hash_algorithms () & Payload::hash_algorithm_bit (a)) {
+				algorithm = a;
+				break;
+			}
+		}
+		always_print (tr ("Reading %1 sparse file with chunks of %2 (%3 checksums)\n")
+		                  .arg (size_to_string (mapping_file_size))
+		                  .arg (size_to_string (Const::max_chunk_size))
+		                  .arg (Payload::hash_algorithm_name (algorithm)));
+		for (auto whole : {true, false}) {
+			auto name = whole ? tr ("Whole file") : tr ("Window");
+			NullDevice sink;
+			sink.open (QIODevice::WriteOnly);
+			QDataStream stream (&sink);
+			Payload::File file (info.fileName (), info.size (), info.lastModified ());
+			file.set_whole_mapping (whole);
+
+			QElapsedTimer timer;
+			timer.start ();
+			if (!file.open (dir, QIODevice::ReadOnly, algorithm)) {
+				error (tr ("%1: %2\n").arg (name, file.get_last_error ())); // 32 bits address space
+				continue;
+			}
+			while (!file.at_end ()) {
+				if (file.read_data (stream, Const::max_chunk_size) == -1) {
+					error (tr ("%1: %2\n").arg (name, file.get_last_error ()));
+					return false;
+				}
+			}
+			file.wait_checksums ();
+			auto msec = timer.elapsed ();
+			file.close ();
+
+			auto mapped = whole ? mapping_file_size : Const::mapping_window_size;
+			always_print (tr ("%1: %2 (%3 msec, %4 mapped at once)\n")
+			                  .arg (name)
+			                  .arg (throughput (mapping_file_size, msec))
+			                  .arg (msec)
+			                  .arg (size_to_string (mapped)));
+		}
+		return true;
+	}
+
+public:
+	// Returns the list of benchmark names, for help
+	static QStringList names (void) {
+		return QStringList () << "hash" << "files" << "offer" << "mapping";
+	}
+
+	// Run the named benchmark, returns false if unknown or failed
+	static bool run (const QString & name) {
+		if (name == "hash")
+			return hash ();
+		if (name == "files")
+			return files ();
+		if (name == "offer")
+			return offer ();
+		if (name == "mapping")
+			return mapping ();
+		error (tr ("Error: unknown benchmark: %1 (available: %2)\n").arg (name, names ().join (", ")));
+		return false;
+	}
+};
+}
+
+#endif
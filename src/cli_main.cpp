@@ -21,6 +21,7 @@
 #include <QtGlobal>
 #include <cstdio>
 
+#include "cli_benchmark.h"
 #include "cli_indicator.h"
 #include "cli_main.h"
 #include "cli_transfer.h"
@@ -102,8 +103,9 @@ int start (int & argc, char **& argv) {
 	    tr ("Small file sharing application for the local network.\n"
 	        "\n"
 	        "No options: use graphical mode.\n"
-	        "Command line mode is enabled when you specify either Upload, Download, or List mode.\n"
-	        "The three CLI modes are exclusive.\n"
+	        "Command line mode is enabled when you specify either Upload, Download, List, or "
+	        "Benchmark mode.\n"
+	        "The four CLI modes are exclusive.\n"
 	        "Returns 0 if the transfer completed correctly, 1 otherwise.\n"
 	        "\n"
 	        "Usage example:\n"
@@ -111,7 +113,8 @@ int start (int & argc, char **& argv) {
 	        "$ %1 -d   # Download from anyone\n"
 	        "$ %1 -d -p <peer>   # Download from <peer> only\n"
 	        "$ %1 -d -n <username>   # Download as destination <username>\n"
-	        "$ %1 -l   # List connected peers")
+	        "$ %1 -l   # List connected peers\n"
+	        "$ %1 -b hash   # Measure checksum throughput")
 	        .arg (Const::app_name));
 	auto help_opt = parser.addHelpOption ();
 	QCommandLineOption version_opt (QStringList () << "V"
@@ -130,6 +133,11 @@ int start (int & argc, char **& argv) {
 	                                                 << "list",
 	                                  tr ("List peers mode"));
 	parser.addOption (list_peer_opt);
+	QCommandLineOption benchmark_opt (
+	    QStringList () << "b"
+	                   << "benchmark",
+	    tr ("Run a benchmark: %1.").arg (Benchmark::names ().join (", ")), tr ("name"));
+	parser.addOption (benchmark_opt);
 	QCommandLineOption username_opt (QStringList () << "n"
 	                                                << "name",
 	                                 tr ("Local Zeroconf username"), tr ("username"),
@@ -159,6 +167,29 @@ int start (int & argc, char **& argv) {
 	QCommandLineOption hidden_files_opt (QStringList () << "hidden",
 	                                     tr ("Send hidden files when sending directories."));
 	parser.addOption (hidden_files_opt);
+	QCommandLineOption skip_present_opt (QStringList () << "skip-present",
+	                                     tr ("Do not send files the peer already has."));
+	parser.addOption (skip_present_opt);
+	QCommandLineOption no_compression_opt (QStringList () << "no-compression",
+	                                       tr ("Do not compress uploaded data."));
+	parser.addOption (no_compression_opt);
+	QCommandLineOption connections_opt (QStringList () << "c"
+	                                                   << "connections",
+	                                    tr ("Number of parallel connections for uploads."),
+	                                    tr ("n"), QStringLiteral ("1"));
+	parser.addOption (connections_opt);
+	QCommandLineOption buffer_opt (
+	    QStringList () << "buffer",
+	    tr ("Maximum memory for upload send buffers in MiB (0 for small fixed buffers)."), tr ("MiB"),
+	    QString::number (Settings::UploadBufferBudget ().get ()));
+	parser.addOption (buffer_opt);
+	QCommandLineOption delta_opt (QStringList () << "delta",
+	                              tr ("Only download differences with existing files."));
+	parser.addOption (delta_opt);
+	QCommandLineOption drop_cache_opt (
+	    QStringList () << "drop-cache",
+	    tr ("Drop transferred data from the system file cache (for shared machines)."));
+	parser.addOption (drop_cache_opt);
 
 	parser.process (app);
 	if (parser.isSet (version_opt)) {
@@ -176,6 +207,7 @@ int start (int & argc, char **& argv) {
 	const auto list_mode = parser.isSet (list_peer_opt);
 	const auto download_mode = parser.isSet (download_opt);
 	const auto upload_mode = parser.isSet (upload_opt);
+	const auto benchmark_mode = parser.isSet (benchmark_opt);
 
 	int nb_mode_requested = 0;
 	if (list_mode)
@@ -184,6 +216,8 @@ int start (int & argc, char **& argv) {
 		nb_mode_requested++;
 	if (upload_mode)
 		nb_mode_requested++;
+	if (benchmark_mode)
+		nb_mode_requested++;
 	if (nb_mode_requested > 1) {
 		QTextStream (stderr) << tr (
 		    "Error: modes are exclusive, only one must be set (see -h for help).\n");
@@ -199,14 +233,33 @@ int start (int & argc, char **& argv) {
 		PeerBrowser browser;
 		return app.exec ();
 	}
+	if (benchmark_mode) {
+		// Run synchronously, no event loop needed
+		return Benchmark::run (parser.value (benchmark_opt)) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
 	if (upload_mode) {
 		// Upload
 		if (!parser.isSet (peer_opt)) {
 			QTextStream (stderr) << tr ("Error: target peer of upload is not set (see -h for help).\n");
 			return EXIT_FAILURE;
 		}
+		bool connections_ok = false;
+		auto nb_connections = parser.value (connections_opt).toInt (&connections_ok);
+		if (!connections_ok || nb_connections < 1 || nb_connections > Const::max_connections) {
+			QTextStream (stderr) << tr ("Error: number of connections must be in [1, %1].\n")
+			                            .arg (Const::max_connections);
+			return EXIT_FAILURE;
+		}
+		bool buffer_ok = false;
+		auto buffer_mib = parser.value (buffer_opt).toInt (&buffer_ok);
+		if (!buffer_ok || buffer_mib < 0) {
+			QTextStream (stderr) << tr ("Error: invalid send buffer size.\n");
+			return EXIT_FAILURE;
+		}
 		Upload upload (parser.value (upload_opt), parser.value (peer_opt), parser.value (username_opt),
-		               parser.isSet (hidden_files_opt));
+		               parser.isSet (hidden_files_opt), parser.isSet (skip_present_opt),
+		               !parser.isSet (no_compression_opt), nb_connections, qint64 (buffer_mib) << 20,
+		               parser.isSet (drop_cache_opt));
 		QTimer::singleShot (0, &upload, SLOT (start ()));
 		return app.exec ();
 	}
@@ -218,7 +271,8 @@ int start (int & argc, char **& argv) {
 			return EXIT_FAILURE;
 		}
 		Download download (parser.value (username_opt), parser.value (target_dir_opt),
-		                   parser.value (peer_opt), parser.isSet (yes_opt));
+		                   parser.value (peer_opt), parser.isSet (yes_opt), parser.isSet (delta_opt),
+		                   parser.isSet (drop_cache_opt));
 		QTimer::singleShot (0, &download, SLOT (start ()));
 		return app.exec ();
 	}
@@ -20,11 +20,11 @@
 
 #include <QString>
 
+namespace Cli {
 namespace Indicator {
-class Item;
+	struct Item;
 }
 
-namespace Cli {
 void draw_progress_indicator (const Indicator::Item &);
 
 void verbose_print (const QString & msg);
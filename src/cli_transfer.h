@@ -91,13 +91,26 @@ void status_changed_helper (Status new_status, const Transfer::Notifier * notifi
 	auto tr = [](const char * str) { return qApp->translate ("status_changed_helper", str); };
 	switch (new_status) {
 	case Status::Transfering: {
-		verbose_print (tr ("Transfer started.\n"));
+		auto resumed_size = notifier->payload.get_resumed_size ();
+		if (resumed_size > 0)
+			verbose_print (tr ("Transfer resumed after %1.\n").arg (size_to_string (resumed_size)));
+		else
+			verbose_print (tr ("Transfer started.\n"));
+		auto skipped_size = notifier->payload.get_skipped_size ();
+		if (skipped_size > 0)
+			verbose_print (tr ("Skipped %1 already present.\n").arg (size_to_string (skipped_size)));
 	} break;
 	case Status::Completed: {
 		verbose_print (tr ("Transfer complete (%1 at %2/s in %3).\n")
 		                   .arg (size_to_string (notifier->payload.get_total_size ()),
 		                         size_to_string (notifier->get_average_rate ()),
 		                         msec_to_string (notifier->get_transfer_time ())));
+		verbose_print (tr ("Time spent working on the transfer: %1.\n")
+		                   .arg (msec_to_string (notifier->work.get_cpu_time ())));
+		auto buffered_peak = notifier->get_buffered_memory_peak ();
+		if (buffered_peak > 0)
+			verbose_print (tr ("Received data buffered in memory: %1 at most.\n")
+			                   .arg (size_to_string (buffered_peak)));
 		exit_nicely ();
 	} break;
 	case Status::Rejected: {
@@ -125,6 +138,11 @@ class Upload : public QObject {
 private:
 	const QString file_path;
 	const bool send_hidden_files;
+	const bool skip_present_files;
+	const bool use_compression;
+	const int nb_connections;
+	const qint64 buffer_budget;
+	const bool drop_cache;
 
 	Discovery::LocalDnsPeer local_peer; // dummy
 	Discovery::Browser * browser{nullptr};
@@ -135,9 +153,15 @@ private:
 
 public:
 	Upload (const QString & file_path, const QString & peer_username, const QString & local_username,
-	        bool send_hidden_files)
+	        bool send_hidden_files, bool skip_present_files, bool use_compression, int nb_connections,
+	        qint64 buffer_budget, bool drop_cache)
 	    : file_path (file_path),
 	      send_hidden_files (send_hidden_files),
+	      skip_present_files (skip_present_files),
+	      use_compression (use_compression),
+	      nb_connections (nb_connections),
+	      buffer_budget (buffer_budget),
+	      drop_cache (drop_cache),
 	      upload (peer_username, local_username) {}
 
 public slots:
@@ -145,15 +169,14 @@ public slots:
 		connect (&upload, &Transfer::Upload::failed, this, &Upload::upload_failed);
 		connect (&upload, &Transfer::Upload::status_changed, this, &Upload::upload_status_changed);
 
-		if (!upload.set_payload (file_path, send_hidden_files))
+		if (!upload.set_payload (file_path, send_hidden_files, skip_present_files))
 			return;
+		upload.set_compression (use_compression);
+		upload.set_connections (nb_connections);
+		upload.set_buffer_budget (buffer_budget);
+		upload.set_drop_cache (drop_cache);
 		new ProgressIndicator (upload.get_notifier ());
-
-		auto & payload = upload.get_payload ();
-		verbose_print (tr ("Upload payload: %1 (%2 files, total size=%3).\n")
-		                   .arg (payload.get_payload_dir_display (),
-		                         QString::number (payload.get_nb_files ()),
-		                         size_to_string (payload.get_total_size ())));
+		connect (&upload, &Transfer::Upload::payload_ready, this, &Upload::payload_ready);
 
 		browser = new Discovery::Browser (&local_peer);
 		connect (browser, &Discovery::Browser::added, this, &Upload::peer_discovered);
@@ -168,6 +191,13 @@ private slots:
 			error_print (tr ("Zeroconf browsing failed: %1\n").arg (error));
 	}
 	void upload_failed (void) { error_print (tr ("Upload failed: %1\n").arg (upload.get_error ())); }
+	void payload_ready (void) {
+		auto & payload = upload.get_payload ();
+		verbose_print (tr ("Upload payload: %1 (%2 files, total size=%3).\n")
+		                   .arg (payload.get_payload_dir_display (),
+		                         QString::number (payload.get_nb_files ()),
+		                         size_to_string (payload.get_total_size ())));
+	}
 
 	void peer_discovered (Discovery::DnsPeer * peer) {
 		if (!peer_found && peer->get_username () == upload.get_peer_username ()) {
@@ -212,6 +242,8 @@ private:
 	const QString target_dir;
 	const QString peer_filter;
 	const bool auto_accept;
+	const bool delta;
+	const bool drop_cache;
 
 	Discovery::LocalDnsPeer local_peer;
 	Transfer::Server * server{nullptr};
@@ -220,8 +252,12 @@ private:
 
 public:
 	Download (const QString & local_username, const QString & target_dir, const QString & peer_filter,
-	          bool auto_accept)
-	    : target_dir (target_dir), peer_filter (peer_filter), auto_accept (auto_accept) {
+	          bool auto_accept, bool delta, bool drop_cache)
+	    : target_dir (target_dir),
+	      peer_filter (peer_filter),
+	      auto_accept (auto_accept),
+	      delta (delta),
+	      drop_cache (drop_cache) {
 		local_peer.set_requested_username (local_username);
 	}
 
@@ -265,6 +301,8 @@ private slots:
 			         &Download::download_status_changed);
 			new ProgressIndicator (download->get_notifier ());
 			download->set_target_dir (target_dir);
+			download->set_delta (delta);
+			download->set_drop_cache (drop_cache);
 
 			// Prompt user
 			if (auto_accept || prompt_user ()) {
@@ -318,6 +356,8 @@ private:
 		                        payload.get_payload_dir_display (),
 		                        QString::number (payload.get_nb_files ()),
 		                        size_to_string (payload.get_total_size ())));
+		if (!payload.is_file_list_complete ())
+			normal_print (tr ("The sender is still listing files: more will be added.\n"));
 		normal_print (tr ("Accept ? y(es)/n(o)/i(nspect files) "));
 		QString line = QTextStream (stdin).readLine ().trimmed ().toLower ();
 		if (line.startsWith ('i')) {
@@ -0,0 +1,200 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_ASYNC_IO_H
+#define CORE_ASYNC_IO_H
+
+#include <QObject>
+#include <QSocketNotifier>
+#include <cstdint>
+#include <functional>
+#include <map>
+
+#ifdef LOCALSHARE_HAS_IO_URING
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+#include "core_localshare.h"
+
+namespace Payload {
+/* Asynchronous positional reads and writes of files, completed on the event loop thread.
+ *
+ * Only implemented with io_uring (Linux, if compiled with LOCALSHARE_HAS_IO_URING).
+ * Requests are queued in the submission ring, and the kernel signals completions on an eventfd.
+ * The eventfd is watched by a QSocketNotifier (like Discovery::DnsSocket), so that completions
+ * are handled by the event loop, without a thread.
+ * If io_uring is not available at runtime (old kernel, seccomp), is_enabled () is false and
+ * files use synchronous I/O.
+ *
+ * Each request has a callback, called with the result (bytes, or -errno) when it completes.
+ * Short reads and writes are legal (network file systems, signals): the rest of the request is
+ * submitted again, and the callback gets the total. It is only short at the end of a file.
+ * Callbacks run from the event loop, or from wait_one () when a File needs a result now.
+ * Buffers must stay valid until the callback is called: a File waits for its requests to close.
+ * completed () is emitted after the callbacks of an event loop notification.
+ */
+class AsyncIo : public QObject {
+	Q_OBJECT
+
+public:
+	using Callback = std::function<void(qint64 result)>;
+
+private:
+#ifdef LOCALSHARE_HAS_IO_URING
+	struct io_uring ring;
+	int event_fd{-1};
+	QSocketNotifier * notifier{nullptr};
+#endif
+	bool enabled{false};
+	quint64 next_id{1};
+	struct Request {
+		bool is_write;
+		int fd;
+		char * buffer;
+		qint64 bytes;
+		qint64 offset;
+		Callback callback;
+	};
+	std::map<quint64, Request> pending; // By request id (ring user data)
+
+signals:
+	void completed (void);
+
+public:
+	AsyncIo (QObject * parent = nullptr) : QObject (parent) {
+#ifdef LOCALSHARE_HAS_IO_URING
+		if (io_uring_queue_init (Const::async_io_ring_size, &ring, 0) < 0)
+			return;
+		event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (event_fd == -1 || io_uring_register_eventfd (&ring, event_fd) < 0) {
+			if (event_fd != -1)
+				::close (event_fd);
+			io_uring_queue_exit (&ring);
+			return;
+		}
+		notifier = new QSocketNotifier (event_fd, QSocketNotifier::Read, this);
+		connect (notifier, &QSocketNotifier::activated, this, &AsyncIo::on_event);
+		enabled = true;
+#endif
+	}
+	~AsyncIo () {
+		while (wait_one ())
+			; // Callbacks may still refer to buffers
+#ifdef LOCALSHARE_HAS_IO_URING
+		if (enabled) {
+			delete notifier;
+			::close (event_fd);
+			io_uring_queue_exit (&ring);
+		}
+#endif
+	}
+
+	bool is_enabled (void) const { return enabled; }
+	int get_nb_pending (void) const { return int(pending.size ()); }
+
+	// Queue a request (only if enabled)
+	void read (int fd, char * buffer, qint64 bytes, qint64 offset, Callback callback) {
+		submit (false, fd, buffer, bytes, offset, std::move (callback));
+	}
+	void write (int fd, const char * data, qint64 bytes, qint64 offset, Callback callback) {
+		submit (true, fd, const_cast<char *> (data), bytes, offset, std::move (callback));
+	}
+
+	bool wait_one (void) {
+		// Blocks until a request completes and calls its callback, false if none is pending
+		if (pending.empty ())
+			return false;
+#ifdef LOCALSHARE_HAS_IO_URING
+		struct io_uring_cqe * cqe = nullptr;
+		if (io_uring_wait_cqe (&ring, &cqe) < 0 || cqe == nullptr)
+			return false;
+		complete (cqe);
+		return true;
+#else
+		return false;
+#endif
+	}
+
+private:
+	void submit (bool is_write, int fd, char * buffer, qint64 bytes, qint64 offset,
+	             Callback callback) {
+		Q_ASSERT (enabled);
+		Q_ASSERT (0 < bytes && bytes <= Const::async_io_size);
+#ifdef LOCALSHARE_HAS_IO_URING
+		struct io_uring_sqe * sqe;
+		while ((sqe = io_uring_get_sqe (&ring)) == nullptr) {
+			// Submission ring full: make room
+			io_uring_submit (&ring);
+			wait_one ();
+		}
+		if (is_write)
+			io_uring_prep_write (sqe, fd, buffer, unsigned(bytes), quint64 (offset));
+		else
+			io_uring_prep_read (sqe, fd, buffer, unsigned(bytes), quint64 (offset));
+		auto id = next_id++;
+		io_uring_sqe_set_data (sqe, reinterpret_cast<void *> (std::uintptr_t (id)));
+		pending.emplace (id, Request{is_write, fd, buffer, bytes, offset, std::move (callback)});
+		io_uring_submit (&ring);
+#else
+		Q_UNUSED (is_write);
+		Q_UNUSED (fd);
+		Q_UNUSED (buffer);
+		Q_UNUSED (offset);
+		Q_UNUSED (callback);
+#endif
+	}
+
+#ifdef LOCALSHARE_HAS_IO_URING
+	void complete (struct io_uring_cqe * cqe) {
+		auto id = quint64 (reinterpret_cast<std::uintptr_t> (io_uring_cqe_get_data (cqe)));
+		auto result = qint64 (cqe->res);
+		io_uring_cqe_seen (&ring, cqe);
+		auto it = pending.find (id);
+		if (it == pending.end ())
+			return;
+		auto request = std::move (it->second);
+		pending.erase (it);
+		if (0 < result && result < request.bytes) {
+			// Short transfer: the rest is a new request
+			auto done = result;
+			auto callback = std::move (request.callback);
+			submit (request.is_write, request.fd, request.buffer + done, request.bytes - done,
+			        request.offset + done,
+			        [done, callback](qint64 r) { callback (r < 0 ? r : done + r); });
+			return;
+		}
+		request.callback (result);
+	}
+#endif
+
+private slots:
+	void on_event (void) {
+#ifdef LOCALSHARE_HAS_IO_URING
+		eventfd_t count;
+		eventfd_read (event_fd, &count);
+		struct io_uring_cqe * cqe = nullptr;
+		while (io_uring_peek_cqe (&ring, &cqe) == 0 && cqe != nullptr)
+			complete (cqe);
+#endif
+		emit completed ();
+	}
+};
+}
+
+#endif
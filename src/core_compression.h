@@ -0,0 +1,216 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_COMPRESSION_H
+#define CORE_COMPRESSION_H
+
+#include <QByteArray>
+
+#ifdef LOCALSHARE_HAS_ZSTD
+#include <zstd.h>
+#endif
+#ifdef LOCALSHARE_HAS_LZ4
+#include <lz4.h>
+#endif
+
+#include "core_localshare.h"
+
+namespace Payload {
+/* Chunk compression algorithms.
+ *
+ * Negotiated during the handshake like checksums (see HashAlgorithm).
+ * None is always supported, and means no compression.
+ * Zstd and Lz4 are only supported if compiled with LOCALSHARE_HAS_ZSTD / LOCALSHARE_HAS_LZ4.
+ * Zstd (fast level) compresses better, Lz4 is faster.
+ */
+enum class CompressionAlgorithm : quint8 { None = 0, Zstd = 1, Lz4 = 2 };
+constexpr CompressionAlgorithm compression_algorithm_preference[] = {
+    CompressionAlgorithm::Zstd, CompressionAlgorithm::Lz4, CompressionAlgorithm::None};
+
+inline quint32 compression_algorithm_bit (CompressionAlgorithm algorithm) {
+	return quint32 (1) << static_cast<quint8> (algorithm);
+}
+inline quint32 supported_compression_algorithms (void) {
+	quint32 mask = compression_algorithm_bit (CompressionAlgorithm::None);
+#ifdef LOCALSHARE_HAS_ZSTD
+	mask |= compression_algorithm_bit (CompressionAlgorithm::Zstd);
+#endif
+#ifdef LOCALSHARE_HAS_LZ4
+	mask |= compression_algorithm_bit (CompressionAlgorithm::Lz4);
+#endif
+	return mask;
+}
+inline CompressionAlgorithm select_compression_algorithm (quint32 peer_supported_algorithms) {
+	auto common = supported_compression_algorithms () & peer_supported_algorithms;
+	for (auto algorithm : compression_algorithm_preference)
+		if (common & compression_algorithm_bit (algorithm))
+			return algorithm;
+	return CompressionAlgorithm::None;
+}
+inline const char * compression_algorithm_name (CompressionAlgorithm algorithm) {
+	switch (algorithm) {
+	case CompressionAlgorithm::None:
+		return "none";
+	case CompressionAlgorithm::Zstd:
+		return "zstd";
+	case CompressionAlgorithm::Lz4:
+		return "lz4";
+	}
+	return "unknown";
+}
+
+/* Compression of chunk data for a negotiated algorithm.
+ * Keeps library contexts and the output buffer between chunks.
+ */
+class Codec {
+private:
+	CompressionAlgorithm algorithm{CompressionAlgorithm::None};
+	QByteArray output;
+#ifdef LOCALSHARE_HAS_ZSTD
+	ZSTD_CCtx * zstd_cctx{nullptr};
+	ZSTD_DCtx * zstd_dctx{nullptr};
+#endif
+
+public:
+	Codec () = default;
+	~Codec () {
+#ifdef LOCALSHARE_HAS_ZSTD
+		ZSTD_freeCCtx (zstd_cctx);
+		ZSTD_freeDCtx (zstd_dctx);
+#endif
+	}
+	Codec (const Codec &) = delete;
+	Codec & operator= (const Codec &) = delete;
+
+	CompressionAlgorithm get_algorithm (void) const { return algorithm; }
+	void set_algorithm (CompressionAlgorithm new_algorithm) { algorithm = new_algorithm; }
+
+	qint64 compress (const char * data, qint64 size) {
+		// Returns the compressed size (data in get_output ()), or -1 if not smaller than size
+		qint64 compressed = -1;
+		switch (algorithm) {
+		case CompressionAlgorithm::None:
+			break;
+		case CompressionAlgorithm::Zstd:
+#ifdef LOCALSHARE_HAS_ZSTD
+			if (zstd_cctx == nullptr)
+				zstd_cctx = ZSTD_createCCtx ();
+			Q_CHECK_PTR (zstd_cctx);
+			output.resize (int(size));
+			{
+				auto r = ZSTD_compressCCtx (zstd_cctx, output.data (), size_t (size), data,
+				                            size_t (size), Const::zstd_level);
+				if (!ZSTD_isError (r))
+					compressed = qint64 (r);
+			}
+#endif
+			break;
+		case CompressionAlgorithm::Lz4:
+#ifdef LOCALSHARE_HAS_LZ4
+			output.resize (int(size));
+			{
+				auto r = LZ4_compress_default (data, output.data (), int(size), int(size));
+				if (r > 0)
+					compressed = r;
+			}
+#endif
+			break;
+		}
+		if (compressed >= size)
+			compressed = -1;
+		return compressed;
+	}
+	const char * get_output (void) const { return output.constData (); }
+
+	bool decompress (const char * data, qint64 size, char * target, qint64 target_size) {
+		// Decompress data to exactly target_size bytes at target
+		switch (algorithm) {
+		case CompressionAlgorithm::None:
+			break;
+		case CompressionAlgorithm::Zstd:
+#ifdef LOCALSHARE_HAS_ZSTD
+			if (zstd_dctx == nullptr)
+				zstd_dctx = ZSTD_createDCtx ();
+			Q_CHECK_PTR (zstd_dctx);
+			{
+				auto r = ZSTD_decompressDCtx (zstd_dctx, target, size_t (target_size), data,
+				                              size_t (size));
+				return !ZSTD_isError (r) && qint64 (r) == target_size;
+			}
+#endif
+			break;
+		case CompressionAlgorithm::Lz4:
+#ifdef LOCALSHARE_HAS_LZ4
+			return LZ4_decompress_safe (data, target, int(size), int(target_size)) == target_size;
+#endif
+			break;
+		}
+		return false;
+	}
+};
+
+/* Sender side: decides if chunks should be compressed.
+ *
+ * Statistics are gathered over samples of Const::compression_sample_size bytes.
+ * Compression is bypassed for Const::compression_bypass_size bytes if, during a sample:
+ * - data did not compress well (ratio above Const::compression_max_ratio)
+ * - the link was faster than the compressor: send buffers were empty when refilled
+ * It is then tried again, as the data or link may have changed.
+ */
+class CompressionPolicy {
+private:
+	bool enabled{false};
+	qint64 bypass_remaining{0};
+
+	qint64 sample_input{0};
+	qint64 sample_output{0};
+	int sample_refills{0};
+	int sample_starved_refills{0};
+
+public:
+	void set_enabled (bool e) { enabled = e; }
+	bool should_compress (void) const { return enabled && bypass_remaining <= 0; }
+
+	void refilled (bool starved) {
+		// Sender is about to fill its send buffers
+		if (!should_compress ())
+			return;
+		++sample_refills;
+		if (starved)
+			++sample_starved_refills;
+	}
+	void compressed (qint64 input, qint64 output) {
+		sample_input += input;
+		sample_output += output;
+		if (sample_input >= Const::compression_sample_size)
+			end_of_sample ();
+	}
+	void bypassed (qint64 size) { bypass_remaining -= size; }
+
+private:
+	void end_of_sample (void) {
+		bool poor_ratio = double(sample_output) > double(sample_input) * Const::compression_max_ratio;
+		bool compressor_too_slow = sample_starved_refills * 2 > sample_refills;
+		if (poor_ratio || compressor_too_slow)
+			bypass_remaining = Const::compression_bypass_size;
+		sample_input = sample_output = 0;
+		sample_refills = sample_starved_refills = 0;
+	}
+};
+}
+
+#endif
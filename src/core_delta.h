@@ -0,0 +1,269 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_DELTA_H
+#define CORE_DELTA_H
+
+#include <QByteArray>
+#include <QDataStream>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "core_hash.h"
+#include "core_localshare.h"
+
+namespace Payload {
+/* Delta transfers (rsync algorithm).
+ *
+ * The receiver may already have an older version of a file (the basis).
+ * It sends the signatures of the basis blocks (Const::delta_block_size bytes each):
+ * - a weak checksum (RollingChecksum), cheap to update when moving the window by one byte
+ * - a strong checksum (negotiated HashAlgorithm)
+ * The last partial block of the basis is ignored.
+ *
+ * The sender scans its file with the rolling checksum to find basis blocks at any offset.
+ * Found blocks are sent as Copy instructions, and other data as literal data.
+ * A wrong match is unlikely, and would be detected and repaired as a bad block (see Manager).
+ */
+
+/* Adler-like checksum of a window of data (from rsync).
+ * a = sum of bytes, b = sum of bytes weighted by their distance to the window end.
+ */
+class RollingChecksum {
+private:
+	quint32 a{0};
+	quint32 b{0};
+	quint32 length{0};
+
+public:
+	void reset (const char * data, qint64 size) {
+		a = b = 0;
+		length = quint32 (size);
+		for (qint64 i = 0; i < size; ++i) {
+			auto x = quint32 (uchar (data[i]));
+			a += x;
+			b += quint32 (size - i) * x;
+		}
+	}
+	void roll (char out, char in) {
+		// Move the window by one byte: remove out at the start, add in at the end
+		auto x_out = quint32 (uchar (out));
+		a += quint32 (uchar (in)) - x_out;
+		b += a - length * x_out;
+	}
+	quint32 value (void) const { return (a & 0xFFFF) | (b << 16); }
+};
+
+/* Signatures of the basis of one file of the payload.
+ * strong contains the strong checksums of all blocks, concatenated.
+ */
+struct Signatures : public Streamable {
+	quint32 file_index{0};
+	std::vector<quint32> weak;
+	QByteArray strong;
+
+	quint32 get_nb_blocks (void) const { return quint32 (weak.size ()); }
+	int get_strong_size (void) const {
+		return weak.empty () ? 0 : strong.size () / int(weak.size ());
+	}
+	const char * get_strong (quint32 block) const {
+		return strong.constData () + block * get_strong_size ();
+	}
+
+	void to_stream (QDataStream & stream) const {
+		stream << file_index << quint32 (weak.size ());
+		for (auto w : weak)
+			stream << w;
+		stream << strong;
+	}
+	void from_stream (QDataStream & stream) {
+		quint32 nb_blocks;
+		stream >> file_index >> nb_blocks;
+		weak.clear ();
+		for (quint32 i = 0; i < nb_blocks && stream.status () == QDataStream::Ok; ++i) {
+			quint32 w;
+			stream >> w;
+			weak.push_back (w);
+		}
+		stream >> strong;
+	}
+	bool validate (HashAlgorithm algorithm) const {
+		return !weak.empty () &&
+		       strong.size () == int(weak.size ()) * Hash (algorithm).result ().size ();
+	}
+
+	void add_blocks (const char * data, qint64 size, HashAlgorithm algorithm) {
+		// Next blocks of the basis: data starts at a block boundary, a partial block is ignored
+		RollingChecksum rolling;
+		Hash hash (algorithm);
+		for (qint64 offset = 0; offset + Const::delta_block_size <= size;
+		     offset += Const::delta_block_size) {
+			rolling.reset (data + offset, Const::delta_block_size);
+			weak.push_back (rolling.value ());
+			hash.reset ();
+			hash.add_data (data + offset, Const::delta_block_size);
+			strong.append (hash.result ());
+		}
+	}
+};
+
+// Signatures of all files with a basis, sent with the Accept message
+struct SignatureList : public Streamable {
+	std::vector<Signatures> files;
+
+	void to_stream (QDataStream & stream) const {
+		stream << quint32 (files.size ());
+		for (const auto & s : files)
+			stream << s;
+	}
+	void from_stream (QDataStream & stream) {
+		quint32 nb_files;
+		stream >> nb_files;
+		files.clear ();
+		for (quint32 i = 0; i < nb_files && stream.status () == QDataStream::Ok; ++i) {
+			files.emplace_back ();
+			stream >> files.back ();
+		}
+	}
+};
+
+// Copy instruction: the next size bytes of the current file are at basis_offset in the basis
+struct Copy : public Streamable {
+	qint64 basis_offset{0};
+	qint64 size{0};
+
+	void to_stream (QDataStream & stream) const { stream << basis_offset << size; }
+	void from_stream (QDataStream & stream) { stream >> basis_offset >> size; }
+};
+
+/* Sender side: finds basis blocks in the data of a file.
+ * The data (file mapping) and signatures must outlive the encoder.
+ * It keeps the rolling window between calls, as data is scanned in order.
+ */
+class DeltaEncoder {
+private:
+	const Signatures & signatures;
+	const char * data;
+	qint64 size;
+	Hash hash;
+
+	// Weak checksum lookup, with a 16 bit tag filter to quickly reject most windows
+	std::unordered_multimap<quint32, quint32> blocks_by_weak;
+	std::vector<bool> tags;
+
+	RollingChecksum rolling;
+	qint64 window_pos{-1};
+
+	// Match found after a literal
+	qint64 match_pos{-1};
+	quint32 match_block{0};
+
+public:
+	DeltaEncoder (const Signatures & signatures, HashAlgorithm algorithm, const char * data,
+	              qint64 size)
+	    : signatures (signatures), data (data), size (size), hash (algorithm), tags (1 << 16, false) {
+		blocks_by_weak.reserve (signatures.weak.size ());
+		for (quint32 block = 0; block < signatures.get_nb_blocks (); ++block) {
+			auto weak = signatures.weak[block];
+			blocks_by_weak.emplace (weak, block);
+			tags[tag (weak)] = true;
+		}
+	}
+	DeltaEncoder (const DeltaEncoder &) = delete;
+	DeltaEncoder & operator= (const DeltaEncoder &) = delete;
+
+	/* Look for a basis block in data at positions [pos, pos + max_literal).
+	 * Returns the size of literal data to send before the next match (at most max_literal).
+	 * If 0, the data at pos matches and copy is set (it may cover several contiguous blocks).
+	 */
+	qint64 find (qint64 pos, qint64 max_literal, Copy & copy) {
+		max_literal = qMin (max_literal, size - pos);
+		const auto block_size = Const::delta_block_size;
+		if (match_pos != pos) {
+			match_pos = -1;
+			for (auto p = pos; p < pos + max_literal && p + block_size <= size; ++p) {
+				move_window (p);
+				quint32 block;
+				if (find_block (p, rolling.value (), block)) {
+					match_pos = p;
+					match_block = block;
+					break;
+				}
+			}
+			if (match_pos == -1)
+				return max_literal;
+			if (match_pos > pos)
+				return match_pos - pos;
+		}
+		// Copy the matching block, and following basis blocks if they still match
+		copy.basis_offset = qint64 (match_block) * block_size;
+		copy.size = block_size;
+		for (auto next_block = match_block + 1;
+		     next_block < signatures.get_nb_blocks () && copy.size < Const::delta_max_copy_size &&
+		     pos + copy.size + block_size <= size;
+		     ++next_block) {
+			auto p = pos + copy.size;
+			RollingChecksum next;
+			next.reset (data + p, block_size);
+			if (next.value () != signatures.weak[next_block] || !strong_match (p, next_block))
+				break;
+			copy.size += block_size;
+		}
+		match_pos = -1;
+		return 0;
+	}
+
+private:
+	static quint32 tag (quint32 weak) { return (weak ^ (weak >> 16)) & 0xFFFF; }
+
+	void move_window (qint64 p) {
+		const auto block_size = Const::delta_block_size;
+		if (window_pos < 0 || p < window_pos || p - window_pos >= block_size) {
+			rolling.reset (data + p, block_size);
+		} else {
+			for (; window_pos < p; ++window_pos)
+				rolling.roll (data[window_pos], data[window_pos + block_size]);
+		}
+		window_pos = p;
+	}
+
+	bool find_block (qint64 p, quint32 weak, quint32 & block) {
+		if (!tags[tag (weak)])
+			return false;
+		auto range = blocks_by_weak.equal_range (weak);
+		for (auto it = range.first; it != range.second; ++it) {
+			if (strong_match (p, it->second)) {
+				block = it->second;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool strong_match (qint64 p, quint32 block) {
+		hash.reset ();
+		hash.add_data (data + p, Const::delta_block_size);
+		auto strong = hash.result ();
+		auto expected = signatures.get_strong (block);
+		return strong.size () == signatures.get_strong_size () &&
+		       std::memcmp (strong.constData (), expected, size_t (strong.size ())) == 0;
+	}
+};
+}
+
+#endif
@@ -0,0 +1,173 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_FILE_HASHING_H
+#define CORE_FILE_HASHING_H
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QFile>
+#include <QFileInfo>
+#include <QMetaObject>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QObject>
+#include <QRunnable>
+#include <QString>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <utility>
+#include <vector>
+
+#include "core_delta.h"
+#include "core_hash.h"
+#include "core_hash_cache.h"
+#include "core_localshare.h"
+
+namespace Payload {
+/* Hashing of whole local files before a transfer (see Manager).
+ * Sender: content hashes of the offer (through the ContentHashCache).
+ * Receiver: present files (same size and content hash), then basis signatures of the others.
+ *
+ * Files are hashed by a job of the global QThreadPool, not in the transfer thread: its event loop
+ * and Scheduler keep running, and the caller continues from finished ().
+ * finished () is emitted in the thread of this object, which can be moved with its parent.
+ * Items are given when created, and only used by the job until finished ().
+ * Files are read by Const::hash_block_size pieces, they are never mapped as a whole.
+ * The destructor cancels the job and waits for it.
+ */
+class FileHashing : public QObject {
+	Q_OBJECT
+
+public:
+	struct Item {
+		quint32 file_index{0};
+		QString path; // Absolute
+		bool content_hash_wanted{false};
+		QByteArray content_hash; // Result if wanted, else expected (present file test) or empty
+		qint64 size{-1};         // Expected, for the present file test
+		bool present{false};     // Result
+		bool signatures_wanted{false};
+		Signatures signatures; // Result, without blocks if smaller than Const::delta_block_size
+	};
+
+private:
+	// Shared with the job, protected by mutex
+	struct State {
+		QMutex mutex;
+		QWaitCondition stopped;
+		bool running{false};
+		QAtomicInt cancelled{0};
+	};
+
+	class Job : public QRunnable {
+	private:
+		FileHashing & hashing;
+
+	public:
+		explicit Job (FileHashing & hashing) : hashing (hashing) {}
+
+		void run (void) Q_DECL_OVERRIDE {
+			hashing.hash_items ();
+			QMutexLocker lock (&hashing.state.mutex);
+			if (!hashing.state.cancelled.load ())
+				QMetaObject::invokeMethod (&hashing, "finished", Qt::QueuedConnection);
+			hashing.state.running = false;
+			hashing.state.stopped.wakeAll ();
+		}
+	};
+
+	std::vector<Item> items;
+	const HashAlgorithm content_hash_algorithm;
+	const HashAlgorithm signature_algorithm;
+	State state;
+
+signals:
+	void finished (void);
+
+public:
+	FileHashing (std::vector<Item> && items, HashAlgorithm content_hash_algorithm,
+	             HashAlgorithm signature_algorithm, QObject * parent = nullptr)
+	    : QObject (parent),
+	      items (std::move (items)),
+	      content_hash_algorithm (content_hash_algorithm),
+	      signature_algorithm (signature_algorithm) {}
+	~FileHashing () {
+		state.cancelled.store (1);
+		QMutexLocker lock (&state.mutex);
+		while (state.running)
+			state.stopped.wait (&state.mutex);
+	}
+
+	void start (void) {
+		{
+			QMutexLocker lock (&state.mutex);
+			state.running = true;
+		}
+		QThreadPool::globalInstance ()->start (new Job (*this)); // Deleted after run
+	}
+
+	// Results, valid after finished ()
+	std::vector<Item> & get_items (void) { return items; }
+
+private:
+	void hash_items (void) {
+		// Runs in the job
+		QByteArray buffer (int(Const::hash_block_size), Qt::Uninitialized);
+		ContentHashCache * cache = nullptr; // Shared with other jobs, saved when done if used
+		for (auto & item : items) {
+			if (state.cancelled.load ())
+				break;
+			if (item.content_hash_wanted || !item.content_hash.isEmpty ()) {
+				if (cache == nullptr)
+					cache = &ContentHashCache::instance ();
+				QFileInfo info (item.path);
+				if (item.content_hash_wanted) {
+					item.content_hash = cache->get (info, content_hash_algorithm, state.cancelled);
+				} else {
+					item.present = info.isFile () && info.size () == item.size &&
+					               cache->get (info, content_hash_algorithm, state.cancelled) ==
+					                   item.content_hash;
+				}
+			}
+			if (item.signatures_wanted && !item.present)
+				compute_signatures (item, buffer);
+		}
+		if (cache != nullptr)
+			cache->save_if_modified ();
+	}
+
+	void compute_signatures (Item & item, QByteArray & buffer) {
+		static_assert (Const::hash_block_size % Const::delta_block_size == 0,
+		               "reads must end at delta block boundaries");
+		item.signatures.file_index = item.file_index;
+		QFile file (item.path);
+		if (file.size () < Const::delta_block_size || !file.open (QIODevice::ReadOnly))
+			return;
+		while (!state.cancelled.load ()) {
+			// A read error only ends the basis early
+			auto size = file.read (buffer.data (), buffer.size ());
+			if (size > 0)
+				item.signatures.add_blocks (buffer.constData (), size, signature_algorithm);
+			if (size < buffer.size ())
+				return;
+		}
+	}
+};
+}
+
+#endif
@@ -0,0 +1,272 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_FILE_TABLE_H
+#define CORE_FILE_TABLE_H
+
+#include <QByteArray>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QString>
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+#include "core_localshare.h"
+
+namespace Payload {
+/* Static description of the files of a payload, by index.
+ *
+ * Payloads can have millions of files, so the table is a set of arrays (one per field).
+ * Paths are relative to the payload dir, with '/' separators.
+ * They are stored in UTF-8 in a single buffer, and only converted to QString when used.
+ * Content hashes and basis flags (delta transfers) are only allocated if used.
+ * The state of a file being transferred is in a separate File object (see Manager).
+ *
+ * Per file, this uses the UTF-8 path and 20 bytes (plus 8 if content hashes are used).
+ * Paths buffer is limited to 4GiB (quint32 offsets): append () fails after that.
+ */
+class FileTable {
+private:
+	std::vector<char> path_data;            // UTF-8 paths, not terminated
+	std::vector<quint32> path_ends;         // path of i is [path_ends[i-1], path_ends[i])
+	std::vector<qint64> sizes;              // bytes
+	std::vector<qint64> last_modified;      // msecs since epoch, only used by the sender
+	std::vector<QByteArray> content_hashes; // Empty if none
+	std::vector<bool> basis;                // Empty if none
+
+public:
+	quint32 size (void) const { return quint32 (sizes.size ()); }
+	bool empty (void) const { return sizes.empty (); }
+
+	void reserve (quint32 nb_files) {
+		path_ends.reserve (nb_files);
+		sizes.reserve (nb_files);
+		last_modified.reserve (nb_files);
+	}
+	void shrink_to_fit (void) {
+		path_data.shrink_to_fit ();
+		path_ends.shrink_to_fit ();
+		sizes.shrink_to_fit ();
+		last_modified.shrink_to_fit ();
+	}
+
+	bool append (const char * path_utf8, int path_size, qint64 file_size,
+	             qint64 last_modified_msec = 0) {
+		// Returns false if the paths buffer is full
+		if (path_size < 0 ||
+		    qint64 (path_data.size ()) + path_size > std::numeric_limits<quint32>::max ())
+			return false;
+		path_data.insert (path_data.end (), path_utf8, path_utf8 + path_size);
+		path_ends.push_back (quint32 (path_data.size ()));
+		sizes.push_back (file_size);
+		last_modified.push_back (last_modified_msec);
+		return true;
+	}
+	bool append (const QString & path, qint64 file_size, qint64 last_modified_msec = 0) {
+		auto utf8 = path.toUtf8 ();
+		return append (utf8.constData (), utf8.size (), file_size, last_modified_msec);
+	}
+	bool append (const FileTable & other, quint32 first = 0) {
+		// Appends files of other, starting at first
+		for (auto i = first; i < other.size (); ++i) {
+			auto path = other.get_path_utf8 (i);
+			if (!append (path.constData (), path.size (), other.sizes[i], other.last_modified[i]))
+				return false;
+			if (!other.get_content_hash (i).isEmpty ())
+				set_content_hash (size () - 1, other.get_content_hash (i));
+		}
+		return true;
+	}
+
+	QString get_path (quint32 i) const { return QString::fromUtf8 (get_path_utf8 (i)); }
+	QByteArray get_path_utf8 (quint32 i) const {
+		// Raw view: valid until the table is modified
+		auto start = i == 0 ? 0 : path_ends[i - 1];
+		return QByteArray::fromRawData (path_data.data () + start, int(path_ends[i] - start));
+	}
+	qint64 get_size (quint32 i) const { return sizes[i]; }
+	QDateTime get_last_modified (quint32 i) const {
+		return QDateTime::fromMSecsSinceEpoch (last_modified[i]);
+	}
+
+	const QByteArray & get_content_hash (quint32 i) const {
+		static const QByteArray none;
+		return i < content_hashes.size () ? content_hashes[i] : none;
+	}
+	void set_content_hash (quint32 i, const QByteArray & hash) {
+		if (content_hashes.size () < sizes.size ())
+			content_hashes.resize (sizes.size ());
+		content_hashes[i] = hash;
+	}
+
+	bool has_basis (quint32 i) const { return i < basis.size () && basis[i]; }
+	void set_basis (quint32 i, bool enabled) {
+		if (basis.size () < sizes.size ())
+			basis.resize (sizes.size ());
+		basis[i] = enabled;
+	}
+
+	// Blocks of Const::hash_block_size bytes, the last one may be smaller
+	quint32 get_nb_blocks (quint32 i) const {
+		return quint32 ((sizes[i] + Const::hash_block_size - 1) / Const::hash_block_size);
+	}
+
+	void sort_by_path (void) {
+		// Byte order of UTF-8 paths (code point order)
+		std::vector<quint32> order (sizes.size ());
+		std::iota (order.begin (), order.end (), quint32 (0));
+		std::sort (order.begin (), order.end (), [this](quint32 a, quint32 b) {
+			return get_path_utf8 (a) < get_path_utf8 (b);
+		});
+		FileTable sorted;
+		sorted.reserve (size ());
+		sorted.path_data.reserve (path_data.size ());
+		for (auto i : order) {
+			auto path = get_path_utf8 (i);
+			sorted.append (path.constData (), path.size (), sizes[i], last_modified[i]);
+			if (!get_content_hash (i).isEmpty ())
+				sorted.set_content_hash (sorted.size () - 1, get_content_hash (i));
+		}
+		*this = std::move (sorted);
+	}
+
+	bool validate (void) const {
+		// Check paths are not out of target dir tree, and sizes
+		for (quint32 i = 0; i < size (); ++i) {
+			auto path = get_path (i);
+			if (sizes[i] < 0 || path.isEmpty () || !QDir::isRelativePath (path) ||
+			    path.contains (QLatin1String ("..")))
+				return false;
+		}
+		return true;
+	}
+
+	qint64 memory_usage (void) const {
+		// Bytes allocated by the table
+		qint64 bytes = qint64 (path_data.capacity ()) + qint64 (path_ends.capacity ()) * 4 +
+		               qint64 (sizes.capacity () + last_modified.capacity ()) * 8 +
+		               qint64 (basis.capacity () / 8) +
+		               qint64 (content_hashes.capacity () * sizeof (QByteArray));
+		for (const auto & hash : content_hashes)
+			bytes += hash.capacity ();
+		return bytes;
+	}
+
+	/* Offer format of files [first, first + nb).
+	 * Paths are front-coded: each path is stored as the length of the prefix it shares with the
+	 * previous path (in UTF-8 bytes), then the rest. Integers are varints (7 bits per byte).
+	 * File: varint prefix, varint suffix size, suffix, varint size, varint hash size, hash.
+	 * Files are grouped in segments of about Const::file_list_segment_size bytes, each preceded
+	 * by its size (quint32), so that the receiver reads and decodes a whole segment at once.
+	 * A segment is at most twice that size (a file is much smaller than a segment).
+	 */
+	void to_stream (QDataStream & stream, quint32 first, quint32 nb) const {
+		QByteArray segment;
+		segment.reserve (Const::file_list_segment_size + 1024);
+		QByteArray previous;
+		for (auto i = first; i < first + nb; ++i) {
+			auto path = get_path_utf8 (i);
+			auto prefix = shared_prefix (previous, path);
+			auto & hash = get_content_hash (i);
+			write_varint (segment, quint64 (prefix));
+			write_varint (segment, quint64 (path.size () - prefix));
+			segment.append (path.constData () + prefix, path.size () - prefix);
+			write_varint (segment, quint64 (sizes[i]));
+			write_varint (segment, quint64 (hash.size ()));
+			segment.append (hash);
+			previous = path;
+			if (segment.size () >= Const::file_list_segment_size || i + 1 == first + nb) {
+				stream << quint32 (segment.size ());
+				stream.writeRawData (segment.constData (), segment.size ());
+				segment.resize (0);
+			}
+		}
+	}
+	bool from_stream (QDataStream & stream, quint32 nb) {
+		// Appends nb files, returns false on error (or check the stream status)
+		if (empty ())
+			reserve (qMin (nb, quint32 (1 << 20))); // nb is not trusted
+		QByteArray segment;
+		int pos = 0;
+		std::vector<char> path;
+		QByteArray hash;
+		for (quint32 i = 0; i < nb; ++i) {
+			if (pos == segment.size () && !read_segment (stream, segment, pos))
+				return false;
+			quint64 prefix, suffix, file_size, hash_size;
+			if (!read_varint (segment, pos, prefix) || !read_varint (segment, pos, suffix) ||
+			    prefix > path.size () || suffix > quint64 (segment.size () - pos))
+				return false;
+			path.resize (size_t (prefix));
+			path.insert (path.end (), segment.constData () + pos, segment.constData () + pos + suffix);
+			pos += int(suffix);
+			if (!read_varint (segment, pos, file_size) || !read_varint (segment, pos, hash_size) ||
+			    hash_size > quint64 (segment.size () - pos) ||
+			    !append (path.data (), int(path.size ()), qint64 (file_size)))
+				return false;
+			if (hash_size > 0) {
+				hash = QByteArray (segment.constData () + pos, int(hash_size));
+				set_content_hash (size () - 1, hash);
+				pos += int(hash_size);
+			}
+		}
+		return pos == segment.size (); // Files do not span segments
+	}
+
+private:
+	static int shared_prefix (const QByteArray & a, const QByteArray & b) {
+		auto n = qMin (a.size (), b.size ());
+		int i = 0;
+		while (i < n && a[i] == b[i])
+			++i;
+		return i;
+	}
+	static void write_varint (QByteArray & out, quint64 value) {
+		while (value >= 0x80) {
+			out.append (char(value | 0x80));
+			value >>= 7;
+		}
+		out.append (char(value));
+	}
+	static bool read_varint (const QByteArray & in, int & pos, quint64 & value) {
+		value = 0;
+		for (int shift = 0; shift < 64 && pos < in.size (); shift += 7) {
+			auto byte = quint8 (in[pos++]);
+			value |= quint64 (byte & 0x7F) << shift;
+			if (!(byte & 0x80))
+				return true;
+		}
+		return false;
+	}
+	static bool read_segment (QDataStream & stream, QByteArray & segment, int & pos) {
+		// Segments are bounded by the sender, a larger size is invalid
+		quint32 segment_size;
+		stream >> segment_size;
+		if (stream.status () != QDataStream::Ok || segment_size == 0 ||
+		    segment_size > quint32 (2 * Const::file_list_segment_size))
+			return false;
+		segment.resize (int(segment_size));
+		pos = 0;
+		return stream.readRawData (segment.data (), segment.size ()) == segment.size ();
+	}
+};
+}
+
+#endif
@@ -0,0 +1,420 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_HASH_H
+#define CORE_HASH_H
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QObject>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#ifdef LOCALSHARE_HAS_XXHASH
+#include <xxhash.h>
+#endif
+
+#include "core_localshare.h"
+
+namespace Payload {
+/* Checksum algorithms.
+ *
+ * The algorithm is negotiated during the handshake (see Transfer::Base).
+ * Each peer sends a mask of its supported algorithms.
+ * Both then select the first common algorithm in hash_algorithm_preference.
+ *
+ * Md5 is always supported, and is the fallback.
+ * Xxh3_128 (from the xxHash library) is a fast non-cryptographic hash with SIMD implementations.
+ * It is only supported if compiled with LOCALSHARE_HAS_XXHASH (see localshare.pro).
+ * Checksums only protect against transmission and storage errors, so it is good enough.
+ */
+enum class HashAlgorithm : quint8 { Md5 = 0, Xxh3_128 = 1 };
+constexpr HashAlgorithm hash_algorithm_preference[] = {HashAlgorithm::Xxh3_128, HashAlgorithm::Md5};
+
+inline quint32 hash_algorithm_bit (HashAlgorithm algorithm) {
+	return quint32 (1) << static_cast<quint8> (algorithm);
+}
+inline quint32 supported_hash_algorithms (void) {
+	quint32 mask = hash_algorithm_bit (HashAlgorithm::Md5);
+#ifdef LOCALSHARE_HAS_XXHASH
+	mask |= hash_algorithm_bit (HashAlgorithm::Xxh3_128);
+#endif
+	return mask;
+}
+inline HashAlgorithm select_hash_algorithm (quint32 peer_supported_algorithms) {
+	auto common = supported_hash_algorithms () & peer_supported_algorithms;
+	for (auto algorithm : hash_algorithm_preference)
+		if (common & hash_algorithm_bit (algorithm))
+			return algorithm;
+	return HashAlgorithm::Md5;
+}
+inline const char * hash_algorithm_name (HashAlgorithm algorithm) {
+	switch (algorithm) {
+	case HashAlgorithm::Md5:
+		return "md5";
+	case HashAlgorithm::Xxh3_128:
+		return "xxh3-128";
+	}
+	return "unknown";
+}
+
+/* Hash computation for a negotiated algorithm.
+ * QCryptographicHash-like interface.
+ */
+class Hash {
+private:
+	HashAlgorithm algorithm;
+	std::unique_ptr<QCryptographicHash> qt_hash;
+#ifdef LOCALSHARE_HAS_XXHASH
+	XXH3_state_t * xxh3_state{nullptr};
+#endif
+
+public:
+	Hash (HashAlgorithm algorithm = HashAlgorithm::Md5) { set_algorithm (algorithm); }
+	~Hash () {
+#ifdef LOCALSHARE_HAS_XXHASH
+		XXH3_freeState (xxh3_state);
+#endif
+	}
+	Hash (const Hash &) = delete;
+	Hash & operator= (const Hash &) = delete;
+
+	HashAlgorithm get_algorithm (void) const { return algorithm; }
+	void set_algorithm (HashAlgorithm new_algorithm) {
+		algorithm = new_algorithm;
+		switch (algorithm) {
+		case HashAlgorithm::Md5:
+			qt_hash.reset (new QCryptographicHash (QCryptographicHash::Md5));
+			break;
+		case HashAlgorithm::Xxh3_128:
+#ifdef LOCALSHARE_HAS_XXHASH
+			if (xxh3_state == nullptr)
+				xxh3_state = XXH3_createState ();
+			Q_CHECK_PTR (xxh3_state);
+			XXH3_128bits_reset (xxh3_state);
+#else
+			Q_UNREACHABLE (); // Never selected
+#endif
+			break;
+		}
+	}
+
+	void reset (void) { set_algorithm (algorithm); }
+
+	void add_data (const char * data, qint64 size) {
+		switch (algorithm) {
+		case HashAlgorithm::Md5:
+			qt_hash->addData (data, int(size));
+			break;
+		case HashAlgorithm::Xxh3_128:
+#ifdef LOCALSHARE_HAS_XXHASH
+			XXH3_128bits_update (xxh3_state, data, static_cast<size_t> (size));
+#endif
+			break;
+		}
+	}
+
+	QByteArray result (void) const {
+		switch (algorithm) {
+		case HashAlgorithm::Md5:
+			return qt_hash->result ();
+		case HashAlgorithm::Xxh3_128: {
+#ifdef LOCALSHARE_HAS_XXHASH
+			XXH128_canonical_t canonical;
+			XXH128_canonicalFromHash (&canonical, XXH3_128bits_digest (xxh3_state));
+			return QByteArray (reinterpret_cast<const char *> (canonical.digest),
+			                   int(sizeof (canonical.digest)));
+#else
+			break;
+#endif
+		}
+		}
+		return QByteArray ();
+	}
+};
+
+/* Tells the owner of Hashers that a full hash queue has room again (see Hasher::is_full ()).
+ * drained () is emitted from a hashing thread: connections to other threads are queued.
+ */
+class HashProgress : public QObject {
+	Q_OBJECT
+
+signals:
+	void drained (void);
+};
+
+/* Hashing stage of the transfer pipeline: computes the block checksums of a file.
+ *
+ * File data is cut in blocks of Const::hash_block_size bytes (the last one may be smaller).
+ * Each block gets its own checksum (a leaf of the file hash tree).
+ * They are computed independently by jobs of a pool of hashing threads, so a file uses all cores.
+ * This keeps hashing out of the event loop thread, and away from the global QThreadPool.
+ *
+ * Data is given in order with add_data (), and end_of_data () must be called after the last byte.
+ * Queued data can be owned by the Hasher (QByteArray), or only referenced (pointer + size).
+ * Referenced data must stay valid until hashed (see wait ()).
+ * Contiguous referenced data (from a file mapping) is merged to reduce job overhead.
+ * Giving data never waits: if more than Const::hash_queue_size bytes are queued, is_full () tells
+ * the owner to stop, and the HashProgress (see set_progress ()) signals when there is room again.
+ *
+ * Hashing can start at a block boundary (resumed transfer): previous block checksums are unknown.
+ * Holes of sparse files are given with add_zeros (): whole blocks of zeros are not hashed again
+ * (except in whole file mode).
+ *
+ * Whole file mode (legacy peers): a single checksum of all the data is computed, as leaf 0.
+ * Jobs still hash blocks, but on a one thread pool so that they update the hash in order.
+ * end_of_data () must then be called even without data (empty file), to finish the hash.
+ *
+ * This class is neither copyable nor movable.
+ * The destructor waits for the jobs to finish.
+ */
+class Hasher {
+private:
+	struct Segment {
+		QByteArray owner; // Null for referenced data
+		const char * data;
+		qint64 size;
+	};
+
+	// Shared with the jobs, protected by mutex
+	struct State {
+		QMutex mutex;
+		QWaitCondition progressed;
+		std::vector<QByteArray> leaves; // Null if not computed
+		qint64 queued_bytes{0};
+		int running_jobs{0};
+		bool notify_drained{false}; // is_full () was true
+		HashProgress * progress{nullptr};
+		Hash whole_hash; // Whole file mode, only used by jobs
+	};
+
+	class Job : public QRunnable {
+	private:
+		State & state;
+		quint32 leaf;
+		HashAlgorithm algorithm;
+		std::vector<Segment> segments;
+		qint64 size;
+		bool whole; // Whole file mode: add to state.whole_hash, leaf is set by the last job
+		bool last;
+
+	public:
+		Job (State & state, quint32 leaf, HashAlgorithm algorithm, std::vector<Segment> && segments,
+		     qint64 size, bool whole, bool last)
+		    : state (state),
+		      leaf (leaf),
+		      algorithm (algorithm),
+		      segments (std::move (segments)),
+		      size (size),
+		      whole (whole),
+		      last (last) {}
+
+		void run (void) Q_DECL_OVERRIDE {
+			QByteArray checksum;
+			if (whole) {
+				for (const auto & segment : segments)
+					state.whole_hash.add_data (segment.data, segment.size);
+				if (last)
+					checksum = state.whole_hash.result ();
+			} else {
+				Hash hash (algorithm);
+				for (const auto & segment : segments)
+					hash.add_data (segment.data, segment.size);
+				checksum = hash.result ();
+			}
+			segments.clear (); // Release owned data before waking waiters
+			QMutexLocker lock (&state.mutex);
+			if (!checksum.isNull ())
+				state.leaves[leaf] = checksum;
+			state.queued_bytes -= size;
+			--state.running_jobs;
+			state.progressed.wakeAll ();
+			// Emitted under the mutex: the Hasher (and its owner) are not destroyed meanwhile
+			if (state.notify_drained && state.queued_bytes < Const::hash_queue_size) {
+				state.notify_drained = false;
+				if (state.progress != nullptr)
+					emit state.progress->drained ();
+			}
+		}
+	};
+
+	State state;
+	HashAlgorithm algorithm{HashAlgorithm::Md5};
+	bool whole{false};
+
+	// Block being filled (only used by the owner thread)
+	quint32 next_leaf{0};
+	std::vector<Segment> segments;
+	qint64 segments_size{0};
+
+	QByteArray zero_block_checksum; // Of a whole block of zeros, computed when first needed
+
+public:
+	Hasher () = default;
+	~Hasher () { wait (); }
+
+	void set_progress (HashProgress * progress) {
+		QMutexLocker lock (&state.mutex);
+		state.progress = progress;
+	}
+
+	void reset (HashAlgorithm new_algorithm, quint32 nb_leaves, quint32 first_leaf = 0,
+	            bool whole_file = false) {
+		wait ();
+		Q_ASSERT (!whole_file || (nb_leaves == 1 && first_leaf == 0));
+		if (new_algorithm != algorithm)
+			zero_block_checksum = QByteArray ();
+		algorithm = new_algorithm;
+		whole = whole_file;
+		if (whole)
+			state.whole_hash.set_algorithm (algorithm);
+		state.leaves.assign (nb_leaves, QByteArray ());
+		next_leaf = first_leaf;
+		segments.clear ();
+		segments_size = 0;
+	}
+
+	void add_data (const char * data, qint64 size) { add_segment (QByteArray (), data, size); }
+	void add_data (const QByteArray & data) { add_segment (data, data.constData (), data.size ()); }
+	void add_data (const QByteArray & owner, const char * data, qint64 size) {
+		// data is in owner, which is kept until hashed
+		add_segment (owner, data, size);
+	}
+	void add_zeros (qint64 size) {
+		while (size > 0) {
+			if (segments_size == 0 && size >= Const::hash_block_size && !whole) {
+				add_zero_block ();
+				size -= Const::hash_block_size;
+			} else {
+				auto piece = qMin (size, Const::hash_block_size - segments_size);
+				add_segment (QByteArray (), zero_data (), piece);
+				size -= piece;
+			}
+		}
+	}
+	void end_of_data (void) {
+		if (segments_size > 0 || whole)
+			start_job (true);
+	}
+
+	qint64 get_queued_size (void) {
+		// Data given to the jobs and not hashed yet (owned or referenced)
+		QMutexLocker lock (&state.mutex);
+		return state.queued_bytes;
+	}
+	bool is_full (void) {
+		// If true, HashProgress::drained () will be emitted when the queue has room again
+		QMutexLocker lock (&state.mutex);
+		if (state.queued_bytes < Const::hash_queue_size)
+			return false;
+		state.notify_drained = true;
+		return true;
+	}
+
+	bool is_leaf_ready (quint32 leaf) {
+		QMutexLocker lock (&state.mutex);
+		return leaf < state.leaves.size () && !state.leaves[leaf].isNull ();
+	}
+	QByteArray get_leaf (quint32 leaf) {
+		// Waits for the block checksum, its data must have been given
+		Q_ASSERT (leaf < next_leaf);
+		QMutexLocker lock (&state.mutex);
+		while (state.leaves[leaf].isNull ())
+			state.progressed.wait (&state.mutex);
+		return state.leaves[leaf];
+	}
+	void wait (void) {
+		QMutexLocker lock (&state.mutex);
+		while (state.running_jobs > 0)
+			state.progressed.wait (&state.mutex);
+	}
+
+private:
+	void add_segment (const QByteArray & owner, const char * data, qint64 size) {
+		while (size > 0) {
+			auto piece = qMin (size, Const::hash_block_size - segments_size);
+			if (owner.isNull () && !segments.empty () && segments.back ().owner.isNull () &&
+			    segments.back ().data + segments.back ().size == data) {
+				segments.back ().size += piece;
+			} else {
+				segments.push_back ({owner, data, piece});
+			}
+			segments_size += piece;
+			data += piece;
+			size -= piece;
+			if (segments_size == Const::hash_block_size)
+				start_job (false);
+		}
+	}
+	static const char * zero_data (void) {
+		static const char zeros[Const::hash_block_size] = {}; // Not allocated until read
+		return zeros;
+	}
+	void add_zero_block (void) {
+		Q_ASSERT (next_leaf < state.leaves.size ());
+		if (zero_block_checksum.isNull ()) {
+			Hash hash (algorithm);
+			hash.add_data (zero_data (), Const::hash_block_size);
+			zero_block_checksum = hash.result ();
+		}
+		QMutexLocker lock (&state.mutex);
+		state.leaves[next_leaf++] = zero_block_checksum;
+		state.progressed.wakeAll ();
+	}
+	void start_job (bool last) {
+		Q_ASSERT (next_leaf < state.leaves.size ());
+		auto size = segments_size;
+		auto leaf = next_leaf;
+		if (!whole || last)
+			++next_leaf;
+		auto job = new Job (state, leaf, algorithm, std::move (segments), size, whole, last);
+		segments.clear ();
+		segments_size = 0;
+		{
+			QMutexLocker lock (&state.mutex);
+			state.queued_bytes += size;
+			++state.running_jobs;
+		}
+		if (whole)
+			sequential_pool ().start (job); // Deleted after run
+		else
+			block_pool ().start (job);
+	}
+	static QThreadPool & block_pool (void) {
+		// Block jobs of all Hasher, one thread per core by default (never destroyed)
+		static auto pool = new QThreadPool;
+		return *pool;
+	}
+	static QThreadPool & sequential_pool (void) {
+		// Whole file jobs run in order, one at a time (shared by all Hasher, never destroyed)
+		static QThreadPool * pool = [] {
+			auto p = new QThreadPool;
+			p->setMaxThreadCount (1);
+			return p;
+		}();
+		return *pool;
+	}
+};
+}
+
+#endif
@@ -0,0 +1,204 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_HASH_CACHE_H
+#define CORE_HASH_CACHE_H
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "core_hash.h"
+#include "core_localshare.h"
+
+namespace Payload {
+/* Persistent cache of whole file content hashes (used to skip files the receiver already has).
+ *
+ * Hashing a large file is slow, so its hash is kept with its size and modification time.
+ * An entry is valid while both are unchanged.
+ * The cache is loaded when first used, and saved by save_if_modified ().
+ * It is stored in the application cache directory.
+ * At most Const::content_hash_cache_entries are kept: the least recently used are dropped.
+ *
+ * One instance (see instance ()) is shared by the FileHashing jobs, out of the event loop thread.
+ * Entries are protected by a mutex, which is not held while a file is hashed.
+ * Files are read by Const::hash_block_size pieces, and hashing stops early if cancelled.
+ */
+class ContentHashCache {
+private:
+	struct Entry : public Streamable {
+		qint64 size{-1};
+		QDateTime last_modified;
+		HashAlgorithm algorithm{HashAlgorithm::Md5};
+		QByteArray hash;
+		qint64 last_used{0}; // msecs since epoch
+
+		void to_stream (QDataStream & stream) const {
+			stream << size << last_modified << static_cast<quint8> (algorithm) << hash << last_used;
+		}
+		void from_stream (QDataStream & stream) {
+			quint8 a;
+			stream >> size >> last_modified >> a >> hash >> last_used;
+			algorithm = static_cast<HashAlgorithm> (a);
+		}
+	};
+	QMutex mutex;
+	std::map<QString, Entry> entries; // By absolute file path
+	bool modified{false};
+
+	ContentHashCache () { load (); }
+
+public:
+	ContentHashCache (const ContentHashCache &) = delete;
+	ContentHashCache & operator= (const ContentHashCache &) = delete;
+
+	static ContentHashCache & instance (void) {
+		// Shared by all jobs of the process (never destroyed)
+		static auto cache = new ContentHashCache;
+		return *cache;
+	}
+
+	QByteArray get (const QFileInfo & info, HashAlgorithm algorithm, const QAtomicInt & cancelled) {
+		// Returns the content hash of a file (computed if needed), or an empty array on error
+		auto path = info.absoluteFilePath ();
+		auto now = QDateTime::currentMSecsSinceEpoch ();
+		{
+			QMutexLocker lock (&mutex);
+			auto it = entries.find (path);
+			if (it != entries.end () && it->second.size == info.size () &&
+			    it->second.last_modified == info.lastModified () && it->second.algorithm == algorithm) {
+				it->second.last_used = now;
+				modified = true;
+				return it->second.hash;
+			}
+		}
+		auto hash = compute (path, algorithm, cancelled);
+		if (!hash.isEmpty ()) {
+			QMutexLocker lock (&mutex);
+			Entry & entry = entries[path];
+			entry.size = info.size ();
+			entry.last_modified = info.lastModified ();
+			entry.algorithm = algorithm;
+			entry.hash = hash;
+			entry.last_used = now;
+			modified = true;
+		}
+		return hash;
+	}
+
+	void save_if_modified (void) {
+		QMutexLocker lock (&mutex);
+		if (modified) {
+			save ();
+			modified = false;
+		}
+	}
+
+private:
+	static QString get_path (void) {
+		auto dir = QDir (QStandardPaths::writableLocation (QStandardPaths::CacheLocation));
+		return dir.filePath (QStringLiteral ("content_hashes"));
+	}
+
+	static QByteArray compute (const QString & path, HashAlgorithm algorithm,
+	                           const QAtomicInt & cancelled) {
+		QFile file (path);
+		if (!file.open (QIODevice::ReadOnly))
+			return QByteArray ();
+		Hash hash (algorithm);
+		QByteArray buffer (int(Const::hash_block_size), Qt::Uninitialized);
+		while (true) {
+			if (cancelled.load ())
+				return QByteArray ();
+			auto size = file.read (buffer.data (), buffer.size ());
+			if (size < 0)
+				return QByteArray ();
+			if (size == 0)
+				break;
+			hash.add_data (buffer.constData (), size);
+		}
+		return hash.result ();
+	}
+
+	void load (void) {
+		QFile file (get_path ());
+		if (!file.open (QIODevice::ReadOnly))
+			return;
+		QDataStream stream (&file);
+		stream.setVersion (Const::serializer_version);
+		quint16 magic;
+		quint32 nb_entries;
+		stream >> magic >> nb_entries;
+		if (stream.status () != QDataStream::Ok || magic != Const::protocol_magic)
+			return;
+		for (quint32 i = 0; i < nb_entries; ++i) {
+			QString path;
+			Entry entry;
+			stream >> path >> entry;
+			if (stream.status () != QDataStream::Ok) {
+				entries.clear (); // Corrupted
+				return;
+			}
+			entries[path] = entry;
+		}
+	}
+
+	void save (void) {
+		if (entries.size () > size_t (Const::content_hash_cache_entries)) {
+			// Drop least recently used entries
+			std::vector<qint64> last_used;
+			for (const auto & e : entries)
+				last_used.push_back (e.second.last_used);
+			auto limit = last_used.end () - Const::content_hash_cache_entries;
+			std::nth_element (last_used.begin (), limit, last_used.end ());
+			for (auto it = entries.begin (); it != entries.end ();) {
+				if (it->second.last_used < *limit)
+					it = entries.erase (it);
+				else
+					++it;
+			}
+		}
+		auto path = get_path ();
+		QDir ().mkpath (QFileInfo (path).path ());
+		QSaveFile file (path);
+		if (!file.open (QIODevice::WriteOnly)) {
+			qWarning ("Unable to save content hash cache: %s", qUtf8Printable (file.errorString ()));
+			return;
+		}
+		QDataStream stream (&file);
+		stream.setVersion (Const::serializer_version);
+		stream << Const::protocol_magic << quint32 (entries.size ());
+		for (const auto & e : entries)
+			stream << e.first << e.second;
+		if (stream.status () != QDataStream::Ok || !file.commit ())
+			qWarning ("Unable to save content hash cache: %s", qUtf8Printable (file.errorString ()));
+	}
+};
+}
+
+#endif
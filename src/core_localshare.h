@@ -50,13 +50,47 @@ constexpr auto service_type = "_localshare._tcp.";
 // Protocol
 constexpr quint16 protocol_magic = 0x0CAA;
 constexpr auto serializer_version = QDataStream::Qt_5_0; // We are only compatible with Qt5 anyway
-constexpr auto hash_algorithm = QCryptographicHash::Md5;
-constexpr quint16 protocol_version = 0x2;
+constexpr quint16 protocol_version = 0x3;
+constexpr quint16 legacy_protocol_version = 0x2; // Still accepted (see Transfer::Message)
 
 // Performance parameters
-constexpr auto chunk_size = qint64 (10000);
-constexpr auto write_buffer_size = qint64 (100000);
+constexpr auto chunk_size = qint64 (10000);        // initial and minimum size
+constexpr auto write_buffer_size = qint64 (100000); // initial and minimum size, per connection
+constexpr auto max_chunk_size = qint64 (1 << 20);   // adaptive chunks (fits in a stripe buffer)
+constexpr auto send_tuning_interval_msec = qint64 (250); // adaptive buffer update period
+constexpr auto default_rtt_usec = qint64 (1000);         // if not given by the system
 constexpr auto max_work_msec = qint64 (100); // maximum time spent out of the event loop
+constexpr auto work_quantum_usec = qint64 (2000); // transfer work before switching (scheduler)
+constexpr auto write_behind_size = qint64 (1 << 20); // receiver buffer before a positional write
+constexpr auto writeback_window = qint64 (8 << 20);  // receiver writeback sync period (0: none)
+constexpr auto hash_block_size = qint64 (1 << 20);  // data covered by one block checksum
+constexpr auto hash_queue_size = qint64 (16 << 20); // max data waiting to be hashed, per file
+constexpr auto mapping_window_size = qint64 (64 << 20); // mapped part of a file (hash blocks)
+constexpr auto cache_drop_interval = qint64 (8 << 20);  // page cache dropped behind, if enabled
+constexpr auto max_block_retransmissions = 3;       // per block, before failing the transfer
+constexpr auto max_pending_hash_files = 32;         // max finished files waiting for their hash
+constexpr auto resume_journal_interval_msec = qint64 (1000); // receiver resume journal update
+constexpr auto delta_block_size = qint64 (64 << 10);    // basis block of delta transfers
+constexpr auto delta_max_copy_size = qint64 (8 << 20); // max data covered by one copy instruction
+constexpr auto content_hash_cache_entries = 100000;     // persistent whole file hash cache size
+constexpr auto scanner_threads = 8;                     // parallel directory listing
+constexpr auto file_batch_size = quint32 (1000);        // files per message of a streamed offer
+constexpr auto file_list_segment_size = 1 << 16;       // encoded file list bytes per segment
+constexpr auto message_buffer_size = 1 << 20;          // serialization buffer kept between messages
+constexpr auto max_connections = 16;                    // per transfer, including the main one
+constexpr auto max_transfer_threads = 4;                // worker threads running transfers (gui)
+constexpr auto local_copy_step_size = qint64 (8 << 20); // same host copy per message
+constexpr auto local_challenge_size = 16;               // same host proof (random bytes)
+constexpr auto async_io_size = qint64 (1 << 20);  // asynchronous read or write request size
+constexpr auto async_io_queue_depth = 8;         // asynchronous requests in flight, per file
+constexpr auto async_io_ring_size = 64;          // io_uring submission queue entries
+constexpr auto receive_buffer_size = qint64 (1 << 20);         // receiver main socket buffer
+constexpr auto stripe_read_buffer_size = qint64 (4 << 20);     // receiver socket buffer, per stripe
+constexpr auto stripe_reorder_buffer_size = qint64 (64 << 20); // receiver out of order data
+constexpr auto zstd_level = 1;                                  // fast compression
+constexpr auto compression_max_ratio = 0.9;                    // worse: stop compressing
+constexpr auto compression_sample_size = qint64 (8 << 20);     // data used to decide
+constexpr auto compression_bypass_size = qint64 (64 << 20);    // data sent before trying again
 
 // Transfer notifier parameters
 constexpr auto rate_update_interval_msec = qint64 (1000 / 3); // should be bigger than progress
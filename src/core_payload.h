@@ -18,31 +18,49 @@
 #ifndef CORE_PAYLOAD_H
 #define CORE_PAYLOAD_H
 
+#include <QBitArray>
 #include <QCoreApplication>
 #include <QCryptographicHash>
 #include <QDataStream>
 #include <QDateTime>
 #include <QElapsedTimer>
 #include <QDir>
-#include <QDirIterator>
 #include <QFile>
 #include <QFileInfo>
 #include <QObject>
-#include <list>
+#include <QSaveFile>
+#include <QtEndian>
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <map>
 #include <memory>
+#include <vector>
 
+#include "core_compression.h"
+#include "core_delta.h"
+#include "core_async_io.h"
+#include "core_file_hashing.h"
+#include "core_file_table.h"
+#include "core_hash.h"
+#include "core_hash_cache.h"
 #include "core_localshare.h"
+#include "core_scanner.h"
+#include "portability.h"
 
 namespace Payload {
-/* Represent a File in a payload.
+/* State of a File of a payload while it is transferred (see FileTable for the file list).
  * file_path is relative to the payload root_dir and contains the file name.
  * It caches info from QFileInfo to check if it changed later.
- * It also acts as a kind a QIODevice for reading/writing data to the file.
- * In either mode it builds an hash of the file to allow a check later.
+ * It acts as a kind a QIODevice for reading/writing data to the file.
+ * In either mode it builds the block checksums of the file to allow a check later.
+ * Hashing is done by worker threads (see Hasher), so data may still be hashed after the end.
+ * The file must stay open (mapped) until the checksums are ready: see is_block_checksum_ready ().
+ * The receiver tests each block checksum from the sender, and repairs bad blocks (repair_block ()).
  *
  * Supported modes:
  * - ReadOnly: for the sender, will check the file has not changed
- * - ReadWrite: for the receiver, will create the path and file
+ * - ReadWrite: for the receiver, will create the path and a partial file (see commit ())
  *
  * Note that WriteOnly for the received would not work:
  * - We need to read data to compare to checksums
@@ -55,7 +73,7 @@ namespace Payload {
  * This class is neither copyable nor movable (due to QFile).
  * It is not a QObject as signals/slots of QFile are not useful.
  */
-class File : public Streamable {
+class File {
 	Q_DECLARE_TR_FUNCTIONS (File);
 
 private:
@@ -67,46 +85,246 @@ private:
 
 	// QFile destructor will close file and mappings
 	QFile file;
-	char * mapping{nullptr};
+	char * mapping{nullptr}; // Data of [mapping_offset, mapping_offset + mapping_size)
+	qint64 mapping_offset{0};
+	qint64 mapping_size{0};
+	bool whole_mapping{false};
 	qint64 pos;
-	QCryptographicHash hash{Const::hash_algorithm};
+	Hasher hasher;
+	HashAlgorithm hash_algorithm;
+	bool whole_checksum{false};
+
+	// Sender sparse file extent: [pos, extent_end) is a hole or data
+	bool sparse{false};
+	bool extent_is_hole{false};
+	qint64 extent_end{0};
+
+	// Receiver blocks that did not match the sender checksum
+	struct BadBlock {
+		QByteArray expected_checksum;
+		int retransmissions;
+	};
+	std::map<quint32, BadBlock> bad_blocks;
+
+	// Receiver positional write backend
+	QByteArray write_buffer;    // Data from pos - write_buffer.size () to pos
+	qint64 writeback_start{0};  // Start of range not yet submitted for writeback
+	qint64 writeback_waited{0}; // Start of range submitted but not waited for
+
+	// Asynchronous I/O
+	AsyncIo * async_io{nullptr};
+	struct ReadAhead {
+		qint64 offset;
+		QByteArray data;
+		bool pending;
+	};
+	std::deque<ReadAhead> read_ahead; // Sender: buffers of [pos, read_ahead_end), in order
+	qint64 read_ahead_end{0};
+	int nb_pending_writes{0};
+	qint64 pending_write_size{0};
+	QString async_error; // From a completion
+
+	// Receiver local copy: data from kernel_copy_start was copied by the kernel, and not hashed
+	bool kernel_copy_tried{false};
+	bool kernel_copy{false};
+	qint64 kernel_copy_start{0};
+	qint64 kernel_copied{0}; // End of the copied data (a clone copies the whole file at once)
+
+	// Page cache hygiene: data before cache_dropped has been dropped
+	bool drop_cache{false};
+	qint64 cache_dropped{0};
+
+	// Receiver basis for delta transfers: the previous version of the target
+	bool use_basis{false};
+	QFile basis;
+	const char * basis_mapping{nullptr};
+	qint64 basis_size{0};
 
 public:
-	File () = default;
-	File (const QFileInfo & file_info, const QDir & payload_dir)
-	    : file_path (payload_dir.relativeFilePath (file_info.filePath ())),
-	      size (file_info.size ()),
-	      last_modified (file_info.lastModified ()) {}
+	File (const QString & relative_path, qint64 size, const QDateTime & last_modified,
+	      bool use_basis = false)
+	    : file_path (relative_path),
+	      size (size),
+	      last_modified (last_modified),
+	      use_basis (use_basis) {}
+	~File () { wait_async_io (); }
+
+	/* Asynchronous I/O (before open (), ignored if the AsyncIo is not enabled):
+	 * - the receiver submits the write of a full buffer instead of waiting for it, with at most
+	 *   Const::async_io_queue_depth writes in flight. Write errors are reported by the next write.
+	 * - the sender reads ahead of pos into buffers, Const::async_io_queue_depth of them in flight.
+	 *   read_data () sends and hashes their data instead of faulting on the mapping.
+	 *   is_data_ready () tells if the data at pos was read (else wait for AsyncIo::completed ()).
+	 *   Other sender paths still use the mapping, which is then mostly in the page cache.
+	 *   Sparse files are not read ahead (holes would be read).
+	 * The file waits for its requests before writeback, resizing and closing.
+	 */
+	void set_async_io (AsyncIo * io) {
+		Q_ASSERT (!file.isOpen ());
+		async_io = io != nullptr && io->is_enabled () ? io : nullptr;
+	}
+	void set_hash_progress (HashProgress * progress) { hasher.set_progress (progress); }
+
+	void set_drop_cache (bool enabled) {
+		// Drop transferred data from the page cache, before open () (see drop_cache_behind ())
+		Q_ASSERT (!file.isOpen ());
+		drop_cache = enabled;
+	}
 
 	QString get_last_error (void) const { return last_error; }
 	bool at_end (void) const { return pos == size; }
 
+	void set_whole_checksum (bool enabled) {
+		// Legacy peers: a single checksum as block 0, and holes are not looked for (no Hole message)
+		Q_ASSERT (!file.isOpen ());
+		whole_checksum = enabled;
+	}
+
 	QString get_relative_path (void) const { return file_path; }
 	qint64 get_size (void) const { return size; }
+	qint64 get_pos (void) const { return pos; }
+	void set_whole_mapping (bool enabled) {
+		// Map the whole file instead of a window (before open ())
+		Q_ASSERT (!file.isOpen ());
+		whole_mapping = enabled;
+	}
+	const char * get_whole_mapping (void) const {
+		Q_ASSERT (whole_mapping);
+		return mapping;
+	}
+	const char * get_data_at_pos (void) {
+		// Sender: mapped data of the hash block at pos, or nullptr on error
+		return map_window (pos) ? mapped (pos) : nullptr;
+	}
+	qint64 get_mapped_size (void) const {
+		// Sender: mapped data from pos (after get_data_at_pos ())
+		return mapping != nullptr ? mapping_end () - pos : 0;
+	}
+	qint64 get_buffered_size (void) {
+		// Receiver: data not yet written, or not yet hashed
+		return write_buffer.size () + pending_write_size + hasher.get_queued_size ();
+	}
+	bool is_hashing_behind (void) {
+		// If true, stop giving data until HashProgress::drained () (see Hasher::is_full ())
+		return hasher.is_full ();
+	}
 
-	// Only export/import filename and size
-	void to_stream (QDataStream & stream) const { stream << file_path << size; }
-	void from_stream (QDataStream & stream) { stream >> file_path >> size; }
-	bool validate_path (void) const {
-		// Check path is not out of target dir tree
-		return QDir::isRelativePath (file_path) && !file_path.contains ("..");
+	static QString get_partial_path (const QDir & payload_dir, const QString & relative_path) {
+		// Receiver: data is written there, then moved to the target path by commit ()
+		QFileInfo info (payload_dir.filePath (relative_path));
+		auto name = QStringLiteral (".%1.%2-part").arg (info.fileName (), Const::app_name);
+		return info.dir ().filePath (name);
+	}
+	QString get_partial_path (const QDir & payload_dir) const {
+		return get_partial_path (payload_dir, file_path);
 	}
 
-	// Hash export / import-check
-	QByteArray get_checksum (void) const { return hash.result (); }
-	bool test_checksum (const QByteArray & cs) {
-		if (cs != hash.result ()) {
-			last_error = tr ("Checksum does not match for file %1").arg (file_path);
+	// Blocks of Const::hash_block_size bytes, the last one may be smaller
+	quint32 get_nb_blocks (void) const {
+		return quint32 ((size + Const::hash_block_size - 1) / Const::hash_block_size);
+	}
+	qint64 get_block_offset (quint32 block) const {
+		return qMin (qint64 (block) * Const::hash_block_size, size);
+	}
+	qint64 get_block_size (quint32 block) const {
+		return get_block_offset (block + 1) - get_block_offset (block);
+	}
+	bool is_block_received (quint32 block) const {
+		return block < get_nb_blocks () && get_block_offset (block + 1) <= pos;
+	}
+
+	// Block checksum export / import-check (wait for the hashing of the block)
+	bool is_block_checksum_ready (quint32 block) { return hasher.is_leaf_ready (block); }
+	void wait_checksums (void) { hasher.wait (); }
+	QByteArray get_block_checksum (quint32 block) { return hasher.get_leaf (block); }
+	bool test_block_checksum (quint32 block, const QByteArray & cs) {
+		// A bad block is recorded to be repaired
+		if (is_block_trusted (block))
+			return true;
+		if (cs != hasher.get_leaf (block)) {
+			bad_blocks[block] = BadBlock{cs, 0};
 			return false;
-		} else {
+		}
+		return true;
+	}
+
+	bool is_block_trusted (quint32 block) const {
+		// Copied by the kernel from the sender file, which the local challenge proved is on this host
+		return kernel_copy && get_block_offset (block) >= kernel_copy_start;
+	}
+
+	// Bad blocks of the receiver
+	bool has_bad_blocks (void) const { return !bad_blocks.empty (); }
+	bool has_bad_block (quint32 block) const { return bad_blocks.count (block) > 0; }
+	quint32 get_first_bad_block (void) const {
+		Q_ASSERT (has_bad_blocks ());
+		return bad_blocks.begin ()->first;
+	}
+	bool repair_block (quint32 block, const QByteArray & data) {
+		// Rewrite a bad block, which stays bad if data does not match the expected checksum
+		Q_ASSERT (file.isOpen ());
+		auto it = bad_blocks.find (block);
+		if (it == bad_blocks.end () || data.size () != get_block_size (block)) {
+			last_error = tr ("Unexpected block %1 for file %2").arg (block).arg (file_path);
+			return false;
+		}
+		auto offset = get_block_offset (block);
+		if (!wait_async_io ())
+			return false;
+		if (mapping != nullptr) {
+			if (!map_window (offset))
+				return false;
+			std::memcpy (mapped (offset), data.constData (), size_t (data.size ()));
+		} else if (!positional_write (file.handle (), data.constData (), data.size (), offset)) {
+			last_error = tr ("Unable to write file %1: %2").arg (file_path, qt_error_string ());
+			return false;
+		}
+		Hash hash (hash_algorithm);
+		hash.add_data (data.constData (), data.size ());
+		if (hash.result () == it->second.expected_checksum) {
+			bad_blocks.erase (it);
 			return true;
 		}
+		if (++it->second.retransmissions > Const::max_block_retransmissions) {
+			last_error = tr ("Checksum does not match for file %1").arg (file_path);
+			return false;
+		}
+		return true;
+	}
+
+	// Sender retransmission: read a block independently of the transfer state
+	bool read_block (const QDir & payload_dir, quint32 block, QByteArray & data) {
+		Q_ASSERT (block < get_nb_blocks ());
+		QFileInfo info (payload_dir.filePath (file_path));
+		if (info.size () != size || info.lastModified () != last_modified) {
+			last_error = tr ("File %1 has changed").arg (file_path);
+			return false;
+		}
+		QFile block_file (info.filePath ());
+		if (!block_file.open (QIODevice::ReadOnly) || !block_file.seek (get_block_offset (block))) {
+			last_error =
+			    tr ("Unable to read file %1: %2").arg (info.filePath (), block_file.errorString ());
+			return false;
+		}
+		data = block_file.read (get_block_size (block));
+		if (data.size () != get_block_size (block)) {
+			last_error =
+			    tr ("Unable to read file %1: %2").arg (info.filePath (), block_file.errorString ());
+			return false;
+		}
+		return true;
 	}
 
 	// QIODevice similar open & close
 
-	bool open (const QDir & payload_dir, QIODevice::OpenMode mode) {
+	/* offset resumes a transfer at a block boundary: previous blocks were already transferred and
+	 * their checksums tested, so they are not computed again (nor truncated by the receiver).
+	 */
+	bool open (const QDir & payload_dir, QIODevice::OpenMode mode, HashAlgorithm algorithm,
+	           qint64 offset = 0) {
 		Q_ASSERT (mode == QIODevice::ReadOnly || mode == QIODevice::ReadWrite);
+		Q_ASSERT (0 <= offset && offset <= size);
+		Q_ASSERT (offset % Const::hash_block_size == 0 || offset == size);
 		QFileInfo info (payload_dir.filePath (file_path));
 		if (mode == QIODevice::ReadOnly) {
 			// Check file didn't change
@@ -121,6 +339,44 @@ public:
 				last_error = tr ("Unable to create path: %1").arg (dir.path ());
 				return false;
 			}
+			if (use_basis && !open_basis (info.filePath ()))
+				return false;
+			info.setFile (get_partial_path (payload_dir));
+		}
+		pos = 0;
+		sparse = false;
+		extent_end = 0;
+		kernel_copy_tried = kernel_copy = false;
+		async_error.clear ();
+		hash_algorithm = algorithm;
+		if (whole_checksum) {
+			Q_ASSERT (offset == 0);
+			hasher.reset (algorithm, 1, 0, true);
+			if (size == 0)
+				hasher.end_of_data (); // No data will come
+		} else {
+			hasher.reset (algorithm, get_nb_blocks (),
+			              quint32 ((offset + Const::hash_block_size - 1) / Const::hash_block_size));
+		}
+		bad_blocks.clear ();
+		if (mode == QIODevice::ReadWrite && has_positional_write ()) {
+			// Open without mapping
+			file.setFileName (info.filePath ());
+			auto open_mode = QIODevice::ReadWrite | QIODevice::Truncate;
+			if (offset > 0)
+				open_mode = QIODevice::ReadWrite; // Keep data before offset
+			if (!file.open (open_mode)) {
+				last_error = tr ("Unable to open file %1: %2").arg (info.filePath (), file.errorString ());
+				return false;
+			}
+			if (offset > 0 && !file.resize (offset)) {
+				last_error =
+				    tr ("Unable to resume file %1: %2").arg (info.filePath (), file.errorString ());
+				return false;
+			}
+			pos = writeback_start = writeback_waited = cache_dropped = offset;
+			write_buffer.reserve (int(qMin (size - pos, Const::write_behind_size)));
+			return true;
 		}
 		// Open and map memory
 		file.setFileName (info.filePath ());
@@ -136,60 +392,670 @@ public:
 				return false;
 			}
 		}
-		if (size > 0) {
-			auto addr = file.map (0, size);
-			if (addr == nullptr) {
-				last_error = tr ("Unable to map file %1: %2").arg (info.filePath (), file.errorString ());
-				return false;
-			}
-			mapping = reinterpret_cast<char *> (addr);
+		if (size > 0 && !map_window (qMin (offset, size - 1)))
+			return false;
+		if (mode == QIODevice::ReadOnly) {
+			auto allocated = file_allocated_size (file.handle ());
+			sparse = !whole_checksum && 0 <= allocated && allocated < size;
 		}
-		pos = 0;
-		hash.reset ();
+		pos = read_ahead_end = cache_dropped = offset;
+		if (mode == QIODevice::ReadOnly && async_io != nullptr && !sparse)
+			fill_read_ahead ();
 		return true;
 	}
 
 	bool is_open (void) const { return file.isOpen (); }
 
 	void close (void) {
-		if (mapping != nullptr) {
-			file.unmap (reinterpret_cast<uchar *> (mapping));
-			mapping = nullptr;
+		wait_async_io ();
+		read_ahead.clear ();
+		hasher.wait (); // Mapped data may still be used
+		unmap_window ();
+		write_buffer = QByteArray ();
+		if (drop_cache && file.isOpen ()) {
+			auto fd = file.handle ();
+			if (file.openMode () != QIODevice::ReadOnly)
+				wait_writeback (fd, writeback_waited, pos - writeback_waited);
+			drop_cached_data (fd, cache_dropped, pos - cache_dropped);
 		}
 		file.close ();
+		if (basis_mapping != nullptr) {
+			basis.unmap (reinterpret_cast<uchar *> (const_cast<char *> (basis_mapping)));
+			basis_mapping = nullptr;
+		}
+		basis.close ();
+	}
+
+	bool commit (const QDir & payload_dir) {
+		// Receiver: replace the target with the complete partial file
+		if (!wait_async_io ())
+			return false;
+		close ();
+		auto target = payload_dir.filePath (file_path);
+		auto partial = get_partial_path (payload_dir);
+		if ((QFile::exists (target) && !QFile::remove (target)) ||
+		    !QFile::rename (partial, target)) {
+			last_error = tr ("Unable to replace file %1").arg (target);
+			return false;
+		}
+		return true;
 	}
 
 	/* Read or write data to the file, to or from a QDataStream.
 	 * bytes is the maximum amount of data to transfer.
 	 * Both return bytes read/written, or -1 on error.
-	 * Any error will come from the stream itself, so get_last_error() is not useful.
+	 * Errors usually come from the stream itself.
+	 * Only write errors of the positional write backend are reported by get_last_error ().
 	 */
 
 	qint64 read_data (QDataStream & target, qint64 bytes) {
 		if (size == 0)
 			return 0;
-		Q_ASSERT (mapping);
-		auto p = &mapping[pos];
-		auto bytes_read = target.writeRawData (p, qMin (bytes, size - pos));
+		if (!read_ahead.empty ())
+			return read_ahead_data (target, bytes);
+		if (!map_window (pos))
+			return -1;
+		auto p = mapped (pos);
+		auto bytes_read = target.writeRawData (p, int(qMin (bytes, mapping_end () - pos)));
 		if (bytes_read > 0) {
-			hash.addData (p, bytes_read);
 			pos += bytes_read;
+			hash_data (p, bytes_read);
 		}
 		return bytes_read;
 	}
 
+	/* Zero-copy variant of read_data: send data from the file directly to a socket.
+	 * Returns bytes sent, 0 if the socket would block, -1 on a send error (errno is set),
+	 * or -2 if the file cannot be mapped (see get_last_error ()).
+	 * The hash is still built from the mapping, which only reads from the page cache.
+	 */
+	qint64 send_data (int socket_fd, qint64 bytes) {
+		if (size == 0)
+			return 0;
+		if (!map_window (pos))
+			return -2;
+		auto bytes_sent =
+		    zero_copy_send (socket_fd, file.handle (), pos, qMin (bytes, mapping_end () - pos));
+		if (bytes_sent > 0) {
+			auto p = mapped (pos);
+			pos += bytes_sent;
+			hash_data (p, bytes_sent);
+			release_read_ahead ();
+		}
+		return bytes_sent;
+	}
+
 	qint64 write_data (QDataStream & source, qint64 bytes) {
 		if (size == 0)
 			return 0;
+		if (mapping == nullptr)
+			return buffered_write_data (source, bytes);
+		if (!map_window (pos))
+			return -1;
+		auto p = mapped (pos);
+		auto bytes_read = source.readRawData (p, int(qMin (bytes, mapping_end () - pos)));
+		if (bytes_read > 0) {
+			pos += bytes_read;
+			hash_data (p, bytes_read);
+		}
+		return bytes_read;
+	}
+
+	/* Direct variant of write_data: receive data from a socket fd to the mapping or write buffer.
+	 * Returns bytes received, 0 if no data is available, or -1 on error (see get_last_error ()).
+	 */
+	qint64 receive_data (int socket_fd, qint64 bytes) {
+		if (size == 0)
+			return 0;
+		qint64 bytes_read;
+		if (mapping == nullptr) {
+			bytes_read = buffered_write (bytes, [socket_fd](char * p, qint64 to_read) {
+				return socket_receive (socket_fd, p, to_read);
+			});
+		} else {
+			if (!map_window (pos))
+				return -1;
+			auto p = mapped (pos);
+			bytes_read = socket_receive (socket_fd, p, qMin (bytes, mapping_end () - pos));
+			if (bytes_read > 0) {
+				pos += bytes_read;
+				hash_data (p, bytes_read);
+			}
+		}
+		if (bytes_read == -1 && last_error.isEmpty ())
+			last_error = tr ("Unable to receive data from socket: %1").arg (qt_error_string ());
+		return bytes_read;
+	}
+
+	/* Compressed chunk: the next bytes are written by decompress (target, bytes).
+	 * They must be in the current hash block, so that they fit in the write buffer.
+	 */
+	template <typename Decompressor> bool write_decompressed (qint64 bytes, Decompressor decompress) {
+		Q_ASSERT (file.isOpen ());
+		auto block_end = get_block_offset (quint32 (pos / Const::hash_block_size) + 1);
+		if (bytes > block_end - pos) {
+			last_error = tr ("Compressed chunk crosses a block of file %1").arg (file_path);
+			return false;
+		}
+		bool ok = true;
+		if (mapping != nullptr) {
+			ok = map_window (pos) && decompress (mapped (pos), bytes);
+			if (ok) {
+				pos += bytes;
+				hash_data (mapped (pos - bytes), bytes);
+			}
+		} else {
+			auto written = buffered_write (bytes, [&](char * p, qint64 to_read) -> qint64 {
+				// Whole chunk fits: the buffer is flushed at block ends
+				return to_read == bytes && decompress (p, bytes) ? bytes : -1;
+			});
+			ok = written == bytes;
+		}
+		if (!ok && last_error.isEmpty ())
+			last_error = tr ("Unable to decompress data of file %1").arg (file_path);
+		return ok;
+	}
+
+	/* Delta transfer: the next bytes are a copy of the basis.
+	 * The sender skips them (they are still hashed), the receiver copies them from its basis.
+	 */
+	void skip_data (qint64 bytes) {
+		// The data must be mapped (see get_data_at_pos ())
 		Q_ASSERT (mapping);
-		auto p = &mapping[pos];
-		auto bytes_read = source.readRawData (p, qMin (bytes, size - pos));
+		Q_ASSERT (mapping_offset <= pos && bytes <= mapping_end () - pos);
+		auto p = mapped (pos);
+		pos += bytes;
+		hash_data (p, bytes);
+		release_read_ahead ();
+	}
+
+	bool is_data_ready (void) const {
+		// Sender: false while the data at pos is being read ahead
+		return read_ahead.empty () || !read_ahead.front ().pending;
+	}
+
+	/* Sparse files: the sender looks for holes (find_data () / find_hole ()) if the file uses less
+	 * disk space than its size. get_hole_size () and get_data_size () give the extent at pos.
+	 * Holes are skipped with skip_hole () on both sides, their zeros are hashed without reading them.
+	 * The receiver with positional writes just leaves them unwritten (the file was truncated).
+	 * With a mapping, the receiver writes zeros instead.
+	 */
+	qint64 get_hole_size (void) {
+		update_extent ();
+		return extent_is_hole ? extent_end - pos : 0;
+	}
+	qint64 get_data_size (void) {
+		update_extent ();
+		return extent_is_hole ? 0 : extent_end - pos;
+	}
+	bool is_sparse (void) const { return sparse; }
+
+	bool skip_hole (qint64 bytes) {
+		// Both sides: the next bytes are zeros
+		Q_ASSERT (file.isOpen ());
+		if (bytes <= 0 || bytes > size - pos) {
+			last_error = tr ("Hole goes past the end of file %1").arg (file_path);
+			return false;
+		}
+		auto receiver = file.openMode () != QIODevice::ReadOnly;
+		for (auto zeroed = pos; receiver && mapping != nullptr && zeroed < pos + bytes;) {
+			// May be resumed data
+			if (!map_window (zeroed))
+				return false;
+			auto piece = qMin (pos + bytes, mapping_end ()) - zeroed;
+			std::memset (mapped (zeroed), 0, size_t (piece));
+			zeroed += piece;
+		}
+		if (receiver && mapping == nullptr && !write_buffer.isEmpty () && !flush_write_buffer ())
+			return false;
+		pos += bytes;
+		hasher.add_zeros (bytes);
+		if (at_end ()) {
+			hasher.end_of_data ();
+			// Positional writes: extend the file if it ends with a hole
+			if (receiver && mapping == nullptr && !wait_async_io ())
+				return false;
+			if (receiver && mapping == nullptr && !file.resize (size)) {
+				last_error = tr ("Unable to resize file %1: %2").arg (file_path, file.errorString ());
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool copy_from_basis (const Copy & copy) {
+		// Delta transfer: the basis (previous target) is mapped read-only while writing
+		Q_ASSERT (file.isOpen ());
+		if (basis_mapping == nullptr || copy.size <= 0 || copy.size > size - pos ||
+		    copy.basis_offset < 0 || copy.basis_offset > basis_size - copy.size) {
+			last_error = tr ("Invalid copy instruction for file %1").arg (file_path);
+			return false;
+		}
+		auto data = basis_mapping + copy.basis_offset;
+		for (qint64 copied = 0; mapping != nullptr && copied < copy.size;) {
+			if (!map_window (pos))
+				return false;
+			auto piece = qMin (copy.size - copied, mapping_end () - pos);
+			std::memcpy (mapped (pos), data + copied, size_t (piece));
+			pos += piece;
+			hash_data (mapped (pos - piece), piece);
+			copied += piece;
+		}
+		if (mapping != nullptr)
+			return true;
+		for (qint64 copied = 0; copied < copy.size;) {
+			auto written = buffered_write (copy.size - copied, [&](char * p, qint64 bytes) {
+				std::memcpy (p, data + copied, size_t (bytes));
+				return bytes;
+			});
+			if (written == -1)
+				return false;
+			copied += written;
+		}
+		return true;
+	}
+
+	/* Local copy: the next bytes are copied from the sender file on this host (same offset).
+	 * The kernel copies them if it can (see copy_by_kernel ()), else they are read and hashed.
+	 * Returns false if the sender file cannot be read (or has changed).
+	 */
+	bool copy_from_source (QFile & source, qint64 bytes) {
+		Q_ASSERT (file.isOpen ());
+		if (bytes <= 0 || bytes > size - pos) {
+			last_error = tr ("Invalid local copy for file %1").arg (file_path);
+			return false;
+		}
+		if (!kernel_copy_tried)
+			start_kernel_copy (source);
+		if (kernel_copy) {
+			if (!copy_by_kernel (source, bytes))
+				return false;
+			if (kernel_copy)
+				return true;
+		}
+		auto read = [&](char * p, qint64 to_read) {
+			auto bytes_read = source.seek (pos) ? source.read (p, to_read) : qint64 (-1);
+			if (bytes_read == to_read)
+				return bytes_read;
+			if (bytes_read < 0)
+				last_error =
+				    tr ("Unable to read file %1: %2").arg (source.fileName (), source.errorString ());
+			else
+				last_error = tr ("File %1 has changed").arg (source.fileName ());
+			return qint64 (-1);
+		};
+		for (qint64 copied = 0; mapping != nullptr && copied < bytes;) {
+			if (!map_window (pos))
+				return false;
+			auto piece = qMin (bytes - copied, mapping_end () - pos);
+			if (read (mapped (pos), piece) == -1)
+				return false;
+			pos += piece;
+			hash_data (mapped (pos - piece), piece);
+			copied += piece;
+		}
+		for (qint64 copied = 0; mapping == nullptr && copied < bytes;) {
+			auto written = buffered_write (bytes - copied, read);
+			if (written == -1)
+				return false;
+			copied += written;
+		}
+		return true;
+	}
+
+private:
+	bool open_basis (const QString & path) {
+		basis.setFileName (path);
+		basis_size = QFileInfo (path).size ();
+		if (basis_size <= 0 || !basis.open (QIODevice::ReadOnly)) {
+			last_error = tr ("Unable to open file %1: %2").arg (path, basis.errorString ());
+			return false;
+		}
+		basis_mapping = reinterpret_cast<const char *> (basis.map (0, basis_size));
+		if (basis_mapping == nullptr) {
+			last_error = tr ("Unable to map file %1: %2").arg (path, basis.errorString ());
+			return false;
+		}
+		return true;
+	}
+
+	char * mapped (qint64 offset) const { return mapping + (offset - mapping_offset); }
+	qint64 mapping_end (void) const { return mapping_offset + mapping_size; }
+
+	static_assert (Const::mapping_window_size % Const::hash_block_size == 0,
+	               "mapping windows must contain whole hash blocks");
+	/* Only a window of Const::mapping_window_size bytes around pos is mapped, so that very large
+	 * files do not use as much address space (32 bits), nor pin as much page cache.
+	 * Data of a block is always mapped at once. Before moving the window, the hasher must be done
+	 * with the previous one (hashing stalls once per window). Windows are accessed sequentially.
+	 * The delta encoder needs random access to the whole file: see set_whole_mapping ().
+	 */
+	bool map_window (qint64 offset) {
+		// Maps the window containing offset, if not already mapped
+		Q_ASSERT (0 <= offset && offset < size);
+		if (mapping != nullptr && mapping_offset <= offset && offset < mapping_end ())
+			return true;
+		unmap_window ();
+		auto window = whole_mapping ? size : Const::mapping_window_size;
+		mapping_offset = offset - offset % window;
+		mapping_size = qMin (window, size - mapping_offset);
+		auto addr = file.map (mapping_offset, mapping_size);
+		if (addr == nullptr) {
+			last_error = tr ("Unable to map file %1: %2").arg (file_path, file.errorString ());
+			return false;
+		}
+		mapping = reinterpret_cast<char *> (addr);
+		advise_sequential (mapping, mapping_size);
+		return true;
+	}
+	void unmap_window (void) {
+		if (mapping == nullptr)
+			return;
+		hasher.wait (); // Mapped data may still be used
+		file.unmap (reinterpret_cast<uchar *> (mapping));
+		mapping = nullptr;
+		drop_cache_behind ();
+	}
+
+	void update_extent (void) {
+		if (pos < extent_end || at_end ())
+			return;
+		extent_is_hole = false;
+		extent_end = size;
+		if (!sparse)
+			return;
+		auto fd = file.handle ();
+		auto data = find_data (fd, pos);
+		if (data == -1 || data > pos) {
+			extent_is_hole = true;
+			extent_end = data == -1 ? size : qMin (data, size);
+		} else {
+			auto hole = find_hole (fd, pos);
+			if (hole > pos)
+				extent_end = qMin (hole, size);
+		}
+	}
+
+	void start_kernel_copy (QFile & source) {
+		// At the first local copy of the file: from a block boundary, so that trusted blocks are
+		// whole, and with positional writes (the kernel writes to the file, not to a mapping)
+		kernel_copy_tried = true;
+		kernel_copy = mapping == nullptr && write_buffer.isEmpty () && nb_pending_writes == 0 &&
+		              pos % Const::hash_block_size == 0;
+		kernel_copy_start = kernel_copied = pos;
+		if (kernel_copy && pos == 0 && size > 0 && clone_file (source.handle (), file.handle ()))
+			kernel_copied = size; // Shares the data
+	}
+	bool copy_by_kernel (QFile & source, qint64 bytes) {
+		// Falls back to user space copies (clears kernel_copy) if not supported for these files
+		auto end = pos + bytes;
+		while (kernel_copied < end) {
+			auto copied = copy_file_data (source.handle (), file.handle (), kernel_copied,
+			                              end - kernel_copied);
+			if (copied > 0) {
+				kernel_copied += copied;
+			} else if (copied == -1 && kernel_copied == kernel_copy_start &&
+			           copy_file_unsupported ()) {
+				kernel_copy = false;
+				return true;
+			} else {
+				if (copied == 0)
+					last_error = tr ("File %1 has changed").arg (source.fileName ());
+				else
+					last_error = tr ("Unable to copy file %1: %2").arg (file_path, qt_error_string ());
+				return false;
+			}
+		}
+		pos = end;
+		if (at_end () && drop_cache) {
+			// Written back first, so that the pages are clean and actually freed
+			auto fd = file.handle ();
+			wait_writeback (fd, kernel_copy_start, size - kernel_copy_start);
+			drop_cached_data (fd, kernel_copy_start, size - kernel_copy_start);
+		}
+		return true;
+	}
+
+	void hash_data (const char * data, qint64 bytes) {
+		// Data is before pos
+		hasher.add_data (data, bytes);
+		if (at_end ())
+			hasher.end_of_data ();
+		drop_cache_behind ();
+	}
+
+	void drop_cache_behind (void) {
+		/* Drops data behind pos every Const::cache_drop_interval bytes, so that a large transfer
+		 * does not evict the rest of the page cache. Only data that is not used anymore is dropped:
+		 * sent and unmapped (sender), or written back to disk (receiver).
+		 * The sender also asks the system to read the next interval ahead of pos.
+		 */
+		if (!drop_cache)
+			return;
+		qint64 limit;
+		if (file.openMode () == QIODevice::ReadOnly)
+			limit = mapping != nullptr && read_ahead.empty () ? qMin (pos, mapping_offset) : pos;
+		else if (mapping != nullptr)
+			limit = qMin (pos, mapping_offset); // Dirty until unmapped
+		else if (Const::writeback_window > 0)
+			limit = writeback_waited; // Clean pages
+		else
+			limit = pos - write_buffer.size () - pending_write_size;
+		if (limit - cache_dropped < Const::cache_drop_interval)
+			return;
+		auto fd = file.handle ();
+		drop_cached_data (fd, cache_dropped, limit - cache_dropped);
+		cache_dropped = limit;
+		if (file.openMode () == QIODevice::ReadOnly && read_ahead.empty ())
+			prefetch_data (fd, pos, qMin (Const::cache_drop_interval, size - pos));
+	}
+
+	/* Receiver backend with positional writes (if has_positional_write ()): the file is truncated
+	 * and not mapped (no zero-filled page faults). Data is accumulated in write_buffer (bounded by
+	 * Const::write_behind_size), written when full (or at end of file or hash block), then hashed.
+	 * Every Const::writeback_window bytes, writeback of the new range is started and the previous
+	 * range is waited for: this bounds the dirty page cache used by a large file.
+	 * Otherwise the receiver uses a shared mapping, like the sender.
+	 */
+	qint64 buffered_write_data (QDataStream & source, qint64 bytes) {
+		return buffered_write (bytes, [&source](char * p, qint64 to_read) {
+			return qint64 (source.readRawData (p, int(to_read)));
+		});
+	}
+
+	template <typename Reader> qint64 buffered_write (qint64 bytes, Reader read) {
+		// read (p, n) fills the buffer at p with up to n bytes, and returns bytes read or -1
+		Q_ASSERT (file.isOpen ());
+		// Buffer does not cross hash blocks: a received block is hashed without waiting for more data
+		auto buffered = write_buffer.size ();
+		auto block_end = get_block_offset (quint32 (pos / Const::hash_block_size) + 1);
+		auto to_read = qMin (qMin (bytes, block_end - pos), Const::write_behind_size - buffered);
+		write_buffer.resize (int(buffered + to_read));
+		auto p = write_buffer.data () + buffered;
+		auto bytes_read = read (p, to_read);
+		write_buffer.resize (int(buffered + qMax (bytes_read, qint64 (0))));
+		if (bytes_read > 0) {
+			pos += bytes_read;
+			if (write_buffer.size () >= Const::write_behind_size || pos == block_end) {
+				if (!flush_write_buffer ())
+					return -1;
+			}
+		}
+		return bytes_read;
+	}
+
+	bool flush_write_buffer (void) {
+		auto fd = file.handle ();
+		if (async_io != nullptr) {
+			if (!async_write_buffer ())
+				return false;
+		} else if (!positional_write (fd, write_buffer.constData (), write_buffer.size (),
+		                              pos - write_buffer.size ())) {
+			last_error = tr ("Unable to write file %1: %2").arg (file_path, qt_error_string ());
+			return false;
+		}
+		// Give the buffer to the hasher, and use a new one
+		hasher.add_data (write_buffer);
+		if (at_end ())
+			hasher.end_of_data ();
+		write_buffer = QByteArray ();
+		if (!at_end ())
+			write_buffer.reserve (int(qMin (size - pos, Const::write_behind_size)));
+		if (Const::writeback_window > 0 &&
+		    (pos - writeback_start >= Const::writeback_window || at_end ())) {
+			if (!wait_async_io ())
+				return false; // Writeback of written data only
+			start_writeback (fd, writeback_start, pos - writeback_start);
+			wait_writeback (fd, writeback_waited, writeback_start - writeback_waited);
+			writeback_waited = writeback_start;
+			writeback_start = pos;
+		}
+		drop_cache_behind ();
+		return true;
+	}
+
+	bool async_write_buffer (void) {
+		// The buffer is shared with the request until it completes
+		while (nb_pending_writes >= Const::async_io_queue_depth && async_io->wait_one ())
+			;
+		if (!async_error.isEmpty ()) {
+			last_error = async_error;
+			return false;
+		}
+		auto buffer = write_buffer;
+		++nb_pending_writes;
+		pending_write_size += buffer.size ();
+		async_io->write (file.handle (), buffer.constData (), buffer.size (), pos - buffer.size (),
+		                 [this, buffer](qint64 result) {
+			                 --nb_pending_writes;
+			                 pending_write_size -= buffer.size ();
+			                 if (result != buffer.size () && async_error.isEmpty ())
+				                 async_error = tr ("Unable to write file %1: %2")
+				                                   .arg (file_path, async_io_error (result));
+		                 });
+		return true;
+	}
+
+	void fill_read_ahead (void) {
+		auto fd = file.handle ();
+		while (read_ahead.size () < size_t (Const::async_io_queue_depth) && read_ahead_end < size) {
+			auto offset = read_ahead_end;
+			auto bytes = qMin (Const::async_io_size, size - offset);
+			read_ahead.push_back ({offset, QByteArray (int(bytes), Qt::Uninitialized), true});
+			read_ahead_end += bytes;
+			async_io->read (fd, read_ahead.back ().data.data (), bytes, offset,
+			                [this, offset, bytes](qint64 result) {
+				                for (auto & buffer : read_ahead)
+					                if (buffer.offset == offset)
+						                buffer.pending = false;
+				                if (result < 0 && async_error.isEmpty ())
+					                async_error = tr ("Unable to read file %1: %2")
+					                                  .arg (file_path, async_io_error (result));
+				                else if (result != bytes && async_error.isEmpty ())
+					                async_error = tr ("File %1 has changed").arg (file_path);
+			                });
+		}
+	}
+	void release_read_ahead (void) {
+		// Drop buffers before pos (data used through the mapping), and read further
+		if (read_ahead.empty ())
+			return;
+		while (!read_ahead.empty ()) {
+			auto & buffer = read_ahead.front ();
+			if (buffer.offset + buffer.data.size () > pos)
+				break;
+			while (buffer.pending && async_io->wait_one ())
+				;
+			read_ahead.pop_front ();
+		}
+		fill_read_ahead ();
+	}
+	qint64 read_ahead_data (QDataStream & target, qint64 bytes) {
+		// Like read_data, from the buffer at pos (waits for it if needed)
+		while (read_ahead.front ().pending && async_io->wait_one ())
+			;
+		if (!async_error.isEmpty ()) {
+			last_error = async_error;
+			return -1;
+		}
+		auto & buffer = read_ahead.front ();
+		auto start = pos - buffer.offset;
+		auto p = buffer.data.constData () + start;
+		auto bytes_read = target.writeRawData (p, int(qMin (bytes, buffer.data.size () - start)));
 		if (bytes_read > 0) {
-			hash.addData (p, bytes_read);
 			pos += bytes_read;
+			hasher.add_data (buffer.data, p, bytes_read);
+			if (at_end ())
+				hasher.end_of_data ();
+			release_read_ahead ();
+			drop_cache_behind ();
 		}
 		return bytes_read;
 	}
+
+	bool wait_async_io (void) {
+		// Returns false if a request failed
+		while ((nb_pending_writes > 0 ||
+		        std::any_of (read_ahead.begin (), read_ahead.end (),
+		                     [](const ReadAhead & buffer) { return buffer.pending; })) &&
+		       async_io->wait_one ())
+			;
+		if (!async_error.isEmpty ()) {
+			last_error = async_error;
+			return false;
+		}
+		return true;
+	}
+	static QString async_io_error (qint64 result) {
+		return result < 0 ? qt_error_string (int(-result)) : tr ("incomplete request");
+	}
+};
+
+/* Position to resume a transfer from (see Manager).
+ * Files before file_index have been received, and their checksums tested.
+ * The first file_offset bytes of the file at file_index have been received and tested.
+ * file_offset is a multiple of Const::hash_block_size, or the file size.
+ */
+struct ResumePoint : public Streamable {
+	quint32 file_index{0};
+	qint64 file_offset{0};
+
+	void to_stream (QDataStream & stream) const { stream << file_index << file_offset; }
+	void from_stream (QDataStream & stream) { stream >> file_index >> file_offset; }
+};
+
+/* Identifies a block of a file in a payload, for retransmissions.
+ */
+struct BlockId : public Streamable {
+	quint32 file_index{0};
+	quint32 block_index{0};
+
+	void to_stream (QDataStream & stream) const { stream << file_index << block_index; }
+	void from_stream (QDataStream & stream) { stream >> file_index >> block_index; }
+};
+
+/* Files appended to a streamed offer (see Manager).
+ * Sender: refers to files of the sender Manager (see take_file_batch ()).
+ * Receiver: files are read into the batch, then moved to the Manager (see append_file_batch ()).
+ */
+struct FileBatch : public Streamable {
+	bool last{false};     // The file list is complete after this batch
+	qint64 total_size{0}; // Of the whole payload, if last
+	quint32 nb_files{0};
+	const FileTable * table{nullptr}; // Sender: files [first, first + nb_files) of the table
+	quint32 first{0};
+	FileTable files; // Receiver
+
+	void to_stream (QDataStream & stream) const {
+		stream << last << total_size << nb_files;
+		table->to_stream (stream, first, nb_files);
+	}
+	void from_stream (QDataStream & stream) {
+		stream >> last >> total_size >> nb_files;
+		files = FileTable ();
+		if (!files.from_stream (stream, nb_files) && stream.status () == QDataStream::Ok)
+			stream.setStatus (QDataStream::ReadCorruptData);
+	}
 };
 
 /* Represent file and dirs.
@@ -215,16 +1081,19 @@ public:
  *
  * The sender will user next_chunk_size () and send_next_chunk () until there are no more.
  * Call receive chunk with chunk size until total_transfered==total_size.
+ * The file list is a FileTable, files are referred to by index.
  *
  * Chunks are not cut by file boundaries: they operate on the concantenated data of all files.
  * Multiple files may be sent in one chunk; data is dispatched according to file limits.
- * When a file has been completely sent, its checksum is available and can be sent.
- * Upload is complete if all data then checksums have been sent.
- * Download is complete if all data then checksums have been received (and checkums valid).
+ * When a block of a file has been completely sent, its checksum will be available and can be sent.
+ * Bad blocks are sent again (see Block retransmission).
+ * Upload is complete if all data then checksums have been sent (retransmissions come after).
+ * Download is complete if all data then checksums have been received (and all blocks valid).
  *
- * Note: This class never checks the status of the stream object.
+ * Optional features are described with their functions: resuming, delta transfers, skipping of
+ * present files, sparse files, compression, streamed offers, local copies and zero-copy sending.
  *
- * TODO ability to set a position (for restarts) ?
+ * Note: This class never checks the status of the stream object.
  */
 class Manager : public Streamable {
 	Q_DECLARE_TR_FUNCTIONS (Manager);
@@ -236,8 +1105,6 @@ public:
 	using ChecksumList = QList<Checksum>;
 
 private:
-	using FileList = std::list<File>; // std::list can handle File (non copyable/movable)
-
 	QString last_error;
 
 	// Transfer display information
@@ -246,14 +1113,63 @@ private:
 
 	QDir root_dir;        // Should always store an absolute path
 	QString payload_root; // '.' for SingleFile, '<dir>' for Directory
-	FileList files;
+	FileTable files;
+
+	// Streamed offer
+	bool file_list_complete{true};
+	quint32 nb_files_announced{0}; // Sender: files sent in the offer or batches
+	bool end_of_list_announced{false};
 
 	// Progress
 	Mode transfer_status{Closed};
-	FileList::iterator current_file{files.end ()};
-	FileList::iterator next_file_to_checksum{files.end ()};
+	quint32 current_file_index{0};
+	quint32 next_file_to_checksum_index{0};
+	quint32 next_block_to_checksum{0};
 	qint64 total_transfered{0};
 	int nb_files_transfered{0};
+	qint64 resumed_size{0};
+	bool zero_copy_enabled{false};
+	bool drop_cache{false};
+	HashAlgorithm hash_algorithm{HashAlgorithm::Md5};
+	bool legacy_peer{false}; // Whole file checksums
+
+	// Created by start_transfer (), destroyed after the files (they wait for their requests)
+	std::unique_ptr<AsyncIo> async_io;
+	HashProgress hash_progress; // Of the hashers of all files
+
+	// Files from next_file_to_checksum_index to current_file_index (if opened), null if skipped
+	std::deque<std::unique_ptr<File>> open_files;
+
+	// Skipping of files already present on the receiver
+	HashAlgorithm content_hash_algorithm{HashAlgorithm::Md5};
+	QBitArray skipped_files; // By index, empty if none
+	qint64 skipped_size{0};
+
+	// Block repair (receiver), by index. Null while the file is in open_files.
+	std::map<quint32, std::unique_ptr<File>> files_with_bad_blocks;
+	std::vector<BlockId> retransmission_requests;
+
+	// Resume journal (receiver)
+	bool resumable{false};
+	QElapsedTimer journal_timer;
+	mutable QCryptographicHash journal_files_hash{QCryptographicHash::Md5}; // See get_journal_id ()
+	mutable quint32 journal_files_hashed{0};
+
+	// Delta transfer (sender)
+	std::map<quint32, Signatures> delta_signatures; // By file index
+	std::unique_ptr<DeltaEncoder> delta_encoder;     // For current file
+	qint64 chunk_limit{0};
+
+	qint64 target_chunk_size{Const::chunk_size}; // Sender, may be tuned during transfer
+
+	Codec codec; // Negotiated chunk compression
+
+	// Local copy (same host)
+	bool local_copy{false}; // Chunk data is read by the receiver from the sender files
+	QDir local_source_dir;  // Receiver: sender payload dir
+	QFile local_source;     // Receiver: sender file of the current file
+	quint32 local_source_index{0};
+	bool local_source_failed{false};
 
 public:
 	QString get_last_error (void) const { return last_error; }
@@ -261,10 +1177,41 @@ public:
 	qint64 get_total_size (void) const { return total_size; }
 	qint64 get_total_transfered_size (void) const { return total_transfered; }
 	int get_nb_files (void) const { return int(files.size ()); }
+	bool is_file_list_complete (void) const { return file_list_complete; }
 	int get_nb_files_transfered (void) const { return nb_files_transfered; }
+	qint64 get_resumed_size (void) const { return resumed_size; } // Skipped by resuming
+	qint64 get_skipped_size (void) const { return skipped_size; } // Present on the receiver
+	const FileTable & get_files (void) const { return files; }
 
-	const QDir & get_root_dir (void) const { return root_dir; }
-	void set_root_dir (const QString & dir_path) {
+	HashAlgorithm get_hash_algorithm (void) const { return hash_algorithm; }
+	void set_hash_algorithm (HashAlgorithm algorithm) {
+		// Negotiated during handshake
+		Q_ASSERT (transfer_status == Closed);
+		hash_algorithm = algorithm;
+	}
+	CompressionAlgorithm get_compression_algorithm (void) const { return codec.get_algorithm (); }
+	void set_compression_algorithm (CompressionAlgorithm algorithm) {
+		// Negotiated during handshake
+		Q_ASSERT (transfer_status == Closed);
+		codec.set_algorithm (algorithm);
+	}
+
+	bool is_legacy_peer (void) const { return legacy_peer; }
+	void set_legacy_peer (bool enabled) {
+		// Negotiated during handshake. Legacy peers exchange one whole file checksum per file, sent
+		// when the file is complete: a mismatch fails the transfer (no retransmission).
+		Q_ASSERT (transfer_status == Closed);
+		legacy_peer = enabled;
+	}
+	void set_drop_cache (bool enabled) {
+		// Before start_transfer (): files drop their data from the page cache once transferred,
+		// local copies also drop the sender file (see File::set_drop_cache ())
+		Q_ASSERT (transfer_status == Closed);
+		drop_cache = enabled;
+	}
+
+	const QDir & get_root_dir (void) const { return root_dir; }
+	void set_root_dir (const QString & dir_path) {
 		Q_ASSERT (transfer_status == Closed);
 		root_dir.setPath (dir_path);
 	}
@@ -280,7 +1227,7 @@ public:
 	QString get_payload_name (void) const {
 		switch (get_type ()) {
 		case SingleFile:
-			return files.front ().get_relative_path ();
+			return files.get_path (0);
 		case Directory:
 			return payload_root + QDir::separator ();
 		default:
@@ -290,7 +1237,7 @@ public:
 	QString get_payload_dir_display (void) const {
 		switch (get_type ()) {
 		case SingleFile:
-			return QDir::toNativeSeparators (root_dir.filePath (files.front ().get_relative_path ()));
+			return QDir::toNativeSeparators (root_dir.filePath (files.get_path (0)));
 		case Directory:
 			return QDir::toNativeSeparators (get_payload_dir ().path ()) + QDir::separator ();
 		default:
@@ -299,108 +1246,470 @@ public:
 	}
 	QString inspect_files (void) const {
 		QString text;
-		for (auto & f : files)
+		for (quint32 i = 0; i < files.size (); ++i)
 			text += QStringLiteral ("-\t%1 (%2)\n")
-			            .arg (f.get_relative_path (), size_to_string (f.get_size ()));
+			            .arg (files.get_path (i), size_to_string (files.get_size (i)));
 		return text;
 	}
 
 	// File list management
 
-	bool from_source_path (const QString & path, bool ignore_hidden) {
+	bool from_scan (Scanner & scanner) {
+		// Takes the files of a finished Scanner
 		Q_ASSERT (transfer_status == Closed);
 		Q_ASSERT (get_type () == Invalid); // Should only be called once
-		auto cleaned_path = QFileInfo (path).canonicalFilePath ();
-		if (cleaned_path.isEmpty ()) {
-			last_error = tr ("Invalid path: %1").arg (path);
+		if (!scanner.get_error ().isEmpty ()) {
+			last_error = scanner.get_error ();
 			return false;
 		}
-		QFileInfo path_info (cleaned_path);
-		root_dir = path_info.dir ();
-		if (path_info.isFile ()) {
-			payload_root = ".";
-			files.emplace_back (path_info, root_dir);
-			total_size += path_info.size ();
-			return true;
-		} else if (path_info.isDir ()) {
-			payload_root = path_info.fileName ();
-			auto payload_dir = get_payload_dir ();
-			// Recursively search dirs for files
-			auto filter_flags = QDir::Files | QDir::NoSymLinks | QDir::NoDotAndDotDot | QDir::Readable;
-			if (!ignore_hidden)
-				filter_flags |= QDir::Hidden;
-			QDirIterator it (path_info.filePath (), filter_flags, QDirIterator::Subdirectories);
-			QElapsedTimer timer;
-			timer.start();
-			while (it.hasNext ()) {
-				if (timer.elapsed() > Const::max_work_msec) {
-					// Let event loop run (warning! may cause data races)
-					QCoreApplication::processEvents ();
-					timer.start ();
-				}
-				QFileInfo entry (it.next ());
-				files.emplace_back (entry, payload_dir);
-				total_size += entry.size ();
-			}
-			if (files.empty ()) {
-				last_error = tr ("No file found in directory: %1").arg (path);
+		set_files (scanner.get_root_dir (), scanner.get_payload_root (),
+		           std::move (scanner.get_files ()));
+		return true;
+	}
+	void set_files (const QDir & dir, const QString & root, FileTable && table) {
+		// Payload of existing files: root is '.' for SingleFile, '<dir>' for Directory
+		Q_ASSERT (transfer_status == Closed);
+		Q_ASSERT (get_type () == Invalid); // Should only be called once
+		root_dir = dir;
+		payload_root = root;
+		files = std::move (table);
+		for (quint32 i = 0; i < files.size (); ++i)
+			total_size += files.get_size (i);
+	}
+
+	/* Streamed offer (sender):
+	 * A directory can be offered while it is still scanned: the offer then only has the files
+	 * found so far, and is marked incomplete. Files are appended as they are found, and sent in
+	 * FileBatch after the offer, in order with chunks: the receiver knows files before their data.
+	 * total_size grows with the list, and is checked against the sender total in the last batch.
+	 * The transfer only completes after the last batch.
+	 * Files come in path order like a complete offer, so the resume journal still applies to them.
+	 * Present files cannot be skipped (no content hashes), and delta only uses offered files.
+	 */
+
+	bool start_file_list (Scanner & scanner) {
+		// Start a directory payload from a running Scanner, files are added by append_files ()
+		Q_ASSERT (transfer_status == Closed);
+		Q_ASSERT (get_type () == Invalid); // Should only be called once
+		root_dir = scanner.get_root_dir ();
+		payload_root = scanner.get_payload_root ();
+		Q_ASSERT (get_type () == Directory);
+		file_list_complete = false;
+		return append_files (scanner.take_new_files ());
+	}
+	bool append_files (const FileTable & new_files) {
+		Q_ASSERT (!file_list_complete);
+		if (!files.append (new_files)) {
+			last_error = tr ("Too many files in directory: %1").arg (get_payload_dir_display ());
+			return false;
+		}
+		for (quint32 i = 0; i < new_files.size (); ++i)
+			total_size += new_files.get_size (i);
+		return true;
+	}
+	bool complete_file_list (void) {
+		// Returns false if there is no file at all
+		Q_ASSERT (!file_list_complete);
+		if (files.empty ()) {
+			last_error = tr ("No file found in directory: %1").arg (get_payload_dir_display ());
+			return false;
+		}
+		file_list_complete = true;
+		return true;
+	}
+	void offer_sent (void) {
+		nb_files_announced = files.size ();
+		end_of_list_announced = file_list_complete;
+	}
+	bool has_file_batch (void) const {
+		return nb_files_announced < files.size () || (file_list_complete && !end_of_list_announced);
+	}
+	FileBatch take_file_batch (void) {
+		// Next files that the receiver does not know (the batch refers to them)
+		Q_ASSERT (has_file_batch ());
+		FileBatch batch;
+		batch.table = &files;
+		batch.first = nb_files_announced;
+		batch.nb_files = qMin (files.size () - nb_files_announced, Const::file_batch_size);
+		nb_files_announced += batch.nb_files;
+		batch.last = file_list_complete && nb_files_announced == files.size ();
+		batch.total_size = total_size;
+		end_of_list_announced = batch.last;
+		return batch;
+	}
+
+	// Streamed offer (receiver)
+
+	bool append_file_batch (const FileBatch & batch) {
+		if (file_list_complete) {
+			last_error = tr ("File list is already complete");
+			return false;
+		}
+		if (!batch.files.validate ()) {
+			last_error = tr ("Invalid file in file list");
+			return false;
+		}
+		if (!files.append (batch.files)) {
+			last_error = tr ("Too many files in file list");
+			return false;
+		}
+		for (quint32 i = 0; i < batch.files.size (); ++i)
+			total_size += batch.files.get_size (i);
+		if (batch.last) {
+			if (files.empty () || batch.total_size != total_size) {
+				last_error = tr ("Invalid end of file list");
 				return false;
 			}
-			return true;
-		} else {
-			last_error = tr ("Path is neither a file nor a directory: %1").arg (path);
-			return false;
+			file_list_complete = true;
+			if (transfer_status == Receiving)
+				stop_if_complete (); // All data may have been received
 		}
+		return true;
+	}
+
+	// Content hashes of the offer (sender, after from_scan ())
+
+	FileHashing * compute_content_hashes (QObject * parent) {
+		// Started hashing of all files, to skip those already present on the receiver
+		Q_ASSERT (transfer_status == Closed);
+		// Best local algorithm: the receiver can only compare them if it supports it
+		for (auto algorithm : hash_algorithm_preference) {
+			if (supported_hash_algorithms () & hash_algorithm_bit (algorithm)) {
+				content_hash_algorithm = algorithm;
+				break;
+			}
+		}
+		std::vector<FileHashing::Item> items (files.size ());
+		auto payload_dir = get_payload_dir ();
+		for (quint32 i = 0; i < files.size (); ++i) {
+			items[i].file_index = i;
+			items[i].path = payload_dir.absoluteFilePath (files.get_path (i));
+			items[i].content_hash_wanted = true;
+		}
+		auto hashing = new FileHashing (std::move (items), content_hash_algorithm, hash_algorithm,
+		                                parent);
+		hashing->start ();
+		return hashing;
+	}
+	void take_content_hashes (FileHashing & hashing) {
+		// When hashing is finished
+		for (const auto & item : hashing.get_items ())
+			files.set_content_hash (item.file_index, item.content_hash);
 	}
 
-	// Import/export. File class is not movable nor copyable, so extra care is needed.
+	// Import/export
 
 	void to_stream (QDataStream & stream) const {
 		Q_ASSERT (get_type () != Invalid);
-		stream << payload_root << total_size << quint32 (files.size ());
-		for (const auto & f : files)
-			stream << f;
+		stream << payload_root << total_size << file_list_complete
+		       << static_cast<quint8> (content_hash_algorithm) << files.size ();
+		files.to_stream (stream, 0, files.size ());
 	}
 	void from_stream (QDataStream & stream) {
 		Q_ASSERT (transfer_status == Closed);
 		Q_ASSERT (get_type () == Invalid); // Should only be called once
 		quint32 c;
-		stream >> payload_root >> total_size >> c;
-		files.clear ();
-		for (quint32 i = 0; i < c; ++i) {
-			files.emplace_back ();
-			stream >> files.back ();
-		}
+		quint8 algorithm;
+		stream >> payload_root >> total_size >> file_list_complete >> algorithm >> c;
+		content_hash_algorithm = static_cast<HashAlgorithm> (algorithm);
+		files = FileTable ();
+		if (!files.from_stream (stream, c) && stream.status () == QDataStream::Ok)
+			stream.setStatus (QDataStream::ReadCorruptData);
+		files.shrink_to_fit ();
 	}
+
+	// Offer of legacy peers: complete file list, without content hashes
+	class LegacyOffer : public Streamable {
+	private:
+		Manager & manager;
+
+	public:
+		LegacyOffer (Manager & manager) : manager (manager) {}
+		void to_stream (QDataStream & stream) const {
+			Q_ASSERT (manager.get_type () != Invalid && manager.file_list_complete);
+			const auto & files = manager.files;
+			stream << manager.payload_root << manager.total_size << files.size ();
+			for (quint32 i = 0; i < files.size (); ++i)
+				stream << files.get_path (i) << files.get_size (i);
+		}
+		void from_stream (QDataStream & stream) {
+			Q_ASSERT (manager.transfer_status == Closed);
+			Q_ASSERT (manager.get_type () == Invalid); // Should only be called once
+			quint32 c;
+			stream >> manager.payload_root >> manager.total_size >> c;
+			manager.file_list_complete = true;
+			manager.files = FileTable ();
+			for (quint32 i = 0; i < c && stream.status () == QDataStream::Ok; ++i) {
+				QString path;
+				qint64 size;
+				stream >> path >> size;
+				if (stream.status () == QDataStream::Ok && !manager.files.append (path, size))
+					stream.setStatus (QDataStream::ReadCorruptData);
+			}
+			manager.files.shrink_to_fit ();
+		}
+	};
+
 	bool validate (void) const {
 		if (total_size < 0)
 			return false;
 		if (payload_root.contains ("..") || payload_root.contains ('/') || payload_root.contains ('\\'))
 			return false;
-		if (files.empty ())
+		if (files.empty () && file_list_complete)
+			return false;
+		if (!files.validate ())
+			return false;
+		qint64 files_size = 0;
+		for (quint32 i = 0; i < files.size (); ++i)
+			files_size += files.get_size (i);
+		return files_size == total_size;
+	}
+
+	/* Skipping of present files and delta basis (before start_transfer):
+	 * The sender can include content hashes of whole files in the offer (compute_content_hashes ()).
+	 * The receiver compares them to the files already at the target path, and returns the set of
+	 * files to skip with the Accept message. Skipped files are counted as transferred, but are
+	 * never opened nor checksummed.
+	 * For delta transfers, the receiver also computes signatures of the other target files.
+	 */
+
+	FileHashing * hash_local_files (const ResumePoint & resume_point, bool basis_signatures,
+	                                QObject * parent) {
+		// Receiver: started hashing of the target files that have not been received yet
+		Q_ASSERT (transfer_status == Closed);
+		auto compare_hashes =
+		    static_cast<quint8> (content_hash_algorithm) < 32 &&
+		    (supported_hash_algorithms () & hash_algorithm_bit (content_hash_algorithm));
+		std::vector<FileHashing::Item> items;
+		auto payload_dir = get_payload_dir ();
+		for (quint32 index = resume_point.file_index; index < files.size (); ++index) {
+			FileHashing::Item item;
+			item.file_index = index;
+			item.path = payload_dir.absoluteFilePath (files.get_path (index));
+			// A partially received file is not skipped: the resumed part is in the partial file
+			auto resumed = index == resume_point.file_index && resume_point.file_offset > 0;
+			if (compare_hashes && !resumed) {
+				item.content_hash = files.get_content_hash (index);
+				item.size = files.get_size (index);
+			}
+			item.signatures_wanted = basis_signatures;
+			if (!item.content_hash.isEmpty () || item.signatures_wanted)
+				items.push_back (std::move (item));
+		}
+		auto hashing = new FileHashing (std::move (items), content_hash_algorithm, hash_algorithm,
+		                                parent);
+		hashing->start ();
+		return hashing;
+	}
+	QBitArray take_present_files (FileHashing & hashing) {
+		// Receiver: files of the offer that are already at their target path, when hashing is finished
+		skipped_files.clear ();
+		for (const auto & item : hashing.get_items ()) {
+			if (item.present) {
+				if (skipped_files.isEmpty ())
+					skipped_files.resize (get_nb_files ());
+				skipped_files.setBit (int(item.file_index));
+			}
+		}
+		return skipped_files;
+	}
+
+	bool set_skipped_files (const QBitArray & skipped) {
+		// Sender: files present on the receiver
+		Q_ASSERT (transfer_status == Closed);
+		if (!skipped.isEmpty () && skipped.size () != get_nb_files ()) {
+			last_error = tr ("Invalid set of skipped files");
+			return false;
+		}
+		skipped_files = skipped;
+		return true;
+	}
+
+
+	/* Resume support:
+	 * The receiver keeps a journal (hidden file in <root_dir>) with its ResumePoint.
+	 * It is updated periodically (Const::resume_journal_interval_msec) and when the transfer stops.
+	 * It is removed when the transfer completes, or if a block cannot be repaired.
+	 * It is identified by a hash of the root and of the files up to the ResumePoint (Scanner order).
+	 * It is validated against the local files before use: sizes, and modification times not after
+	 * the journal (files are closed before the last update).
+	 * The receiver loads it before accepting, and both sides start the transfer from the ResumePoint.
+	 * Data is only written to the page cache: the journal is not safe against system crashes.
+	 */
+
+	bool is_valid (const ResumePoint & point) const {
+		if (files.empty () && !file_list_complete)
+			return point.file_index == 0 && point.file_offset == 0; // Streamed offer, no file yet
+		if (point.file_index >= files.size ())
 			return false;
-		for (auto & f : files)
-			if (!f.validate_path ())
+		auto size = files.get_size (point.file_index);
+		auto block_aligned = point.file_offset % Const::hash_block_size == 0;
+		return 0 <= point.file_offset && point.file_offset <= size &&
+		       (block_aligned || point.file_offset == size);
+	}
+
+	bool can_load_resume_point (void) const {
+		// False if the journal refers to files of a streamed offer that are not known yet
+		quint32 nb_id_files;
+		QByteArray id;
+		ResumePoint point;
+		QDateTime written;
+		return file_list_complete || !read_resume_journal (nb_id_files, id, point, written) ||
+		       (nb_id_files <= files.size () && point.file_index < files.size ());
+	}
+	ResumePoint load_resume_point (void) const {
+		// Returns the journal resume point if valid, or the start of the payload
+		Q_ASSERT (transfer_status == Closed);
+		quint32 nb_id_files;
+		QByteArray id;
+		ResumePoint point;
+		QDateTime written;
+		if (!read_resume_journal (nb_id_files, id, point, written) || nb_id_files > files.size () ||
+		    id != get_journal_id (nb_id_files) || !is_valid (point))
+			return ResumePoint ();
+		// Check that local files still match the journal, and were not modified since
+		auto payload_dir = get_payload_dir ();
+		for (quint32 i = 0; i < point.file_index; ++i) {
+			QFileInfo info (payload_dir.filePath (files.get_path (i)));
+			if (!info.isFile () || info.size () != files.get_size (i) || info.lastModified () > written)
+				return ResumePoint ();
+		}
+		if (point.file_offset > 0) {
+			QFileInfo partial (File::get_partial_path (payload_dir, files.get_path (point.file_index)));
+			if (partial.size () < point.file_offset)
+				return ResumePoint ();
+			if (partial.lastModified () > written)
+				point.file_offset = 0; // Written after a periodic journal update: receive it again
+		}
+		return point;
+	}
+
+	/* Delta transfer setup (before start_transfer, see core_delta.h):
+	 * The receiver sends signatures of its basis files (see hash_local_files ()).
+	 * The sender then gets Copy instructions from prepare_next_chunk (), and the receiver applies
+	 * them with receive_copy (). Copied data is hashed like chunk data, so block checksums check
+	 * the rebuilt file.
+	 */
+
+	SignatureList take_basis_signatures (FileHashing & hashing) {
+		// Receiver: signatures of the basis files, when hashing is finished
+		SignatureList signatures;
+		for (auto & item : hashing.get_items ()) {
+			if (item.signatures.get_nb_blocks () > 0) {
+				files.set_basis (item.file_index, true);
+				signatures.files.push_back (std::move (item.signatures));
+			}
+		}
+		return signatures;
+	}
+
+	bool set_delta_signatures (const SignatureList & signatures) {
+		// Sender: signatures from the receiver
+		Q_ASSERT (transfer_status == Closed);
+		delta_signatures.clear ();
+		for (const auto & s : signatures.files) {
+			if (s.file_index >= files.size () || !s.validate (hash_algorithm) ||
+			    !delta_signatures.emplace (s.file_index, s).second) {
+				delta_signatures.clear ();
+				last_error = tr ("Invalid delta signatures");
 				return false;
+			}
+		}
 		return true;
 	}
 
+	/* Local copy (same host):
+	 * If the receiver reads the sender files itself, the sender sends local copy instructions
+	 * instead of chunk data. It bounds them with prepare_local_copy (), and moves past them with
+	 * send_local_copy (). receive_local_copy () copies the data in the kernel if possible, without
+	 * hashing it (the local challenge proved the same host). Otherwise it is read and hashed.
+	 * A sender file that cannot be read fails the transfer. On a bad block,
+	 * has_local_source_failed () is set: the rest is sent as chunks, bad blocks are retransmitted.
+	 */
+
+	void set_local_copy (bool enabled) {
+		// Sender: the receiver reads chunk data from our files (after start_transfer ())
+		Q_ASSERT (transfer_status == Sending);
+		local_copy = enabled;
+	}
+	bool is_local_copy (void) const { return local_copy; }
+	void set_local_source (const QString & source_root_dir) {
+		// Receiver: the sender files are readable from here (after start_transfer ())
+		Q_ASSERT (transfer_status == Receiving);
+		local_copy = true;
+		local_source_dir = QDir (QDir (source_root_dir).filePath (payload_root));
+		local_source_failed = !local_source_dir.exists ();
+	}
+	bool has_local_source_failed (void) const { return local_source_failed; }
+
 	// Transfer status (open/close like)
 
-	void start_transfer (Mode mode) {
+	bool start_transfer (Mode mode, const ResumePoint & resume_point = ResumePoint ()) {
 		Q_ASSERT (get_type () != Invalid);
 		Q_ASSERT (transfer_status == Closed);
 		Q_ASSERT (mode != Closed);
+		if (!is_valid (resume_point) ||
+		    (resume_point.file_offset > 0 && is_skipped (resume_point.file_index))) {
+			last_error = tr ("Invalid resume position");
+			return false;
+		}
 		transfer_status = mode;
+		if (async_io == nullptr)
+			async_io.reset (new AsyncIo);
 		total_transfered = 0;
-		nb_files_transfered = 0;
-		current_file = next_file_to_checksum = files.begin ();
+		current_file_index = resume_point.file_index;
+		for (quint32 i = 0; i < resume_point.file_index; ++i)
+			total_transfered += files.get_size (i);
+		total_transfered += resume_point.file_offset;
+		resumed_size = total_transfered;
+		skipped_size = 0;
+		nb_files_transfered = int(resume_point.file_index);
+		next_file_to_checksum_index = resume_point.file_index;
+		next_block_to_checksum = quint32 ((resume_point.file_offset + Const::hash_block_size - 1) /
+		                                  Const::hash_block_size);
+		open_files.clear ();
+		files_with_bad_blocks.clear ();
+		retransmission_requests.clear ();
+		zero_copy_enabled = mode == Sending && has_zero_copy_send () && delta_signatures.empty ();
+		chunk_limit = total_size;
+		resumable = mode == Receiving;
+		journal_timer.start ();
+		if (resume_point.file_offset > 0) {
+			// Open file now, as it may be already complete
+			auto open_mode = mode == Sending ? QIODevice::ReadOnly : QIODevice::ReadWrite;
+			if (open_file (open_mode, resume_point.file_offset) == nullptr)
+				return false;
+			if (get_current_file ().at_end ())
+				end_of_file_data (); // Only checksums of last blocks are missing
+		} else {
+			skip_present_files ();
+		}
+		if (mode == Receiving)
+			stop_if_complete (); // All files may be present
+		return true;
 	}
 
 	void stop_transfer (void) {
-		if (current_file != files.end ())
-			current_file->close ();
-		current_file = next_file_to_checksum = files.end ();
+		auto receiving = transfer_status == Receiving;
+		ResumePoint point;
+		if (receiving)
+			point = get_resume_point (); // Needs the open files
+		// Files waiting for checksums or repairs are still open
+		for (auto & file : open_files)
+			if (file)
+				file->close ();
+		open_files.clear ();
+		for (auto & entry : files_with_bad_blocks)
+			if (entry.second)
+				entry.second->close ();
+		files_with_bad_blocks.clear ();
+		if (receiving)
+			update_resume_journal (point); // After the last writes, to resume it later
+		local_source.close ();
+		local_copy = false;
+		local_source_failed = false;
+		delta_encoder.reset ();
+		delta_signatures.clear ();
 		transfer_status = Closed;
 	}
 
@@ -411,43 +1720,220 @@ public:
 
 	// Send / receive next chunk
 
+	void set_chunk_size (qint64 size) {
+		Q_ASSERT (Const::chunk_size <= size && size <= Const::max_chunk_size);
+		target_chunk_size = size;
+	}
 	qint64 next_chunk_size (void) const {
-		// Chunk are all of size Const::chunk_size, except the last which is truncated
+		// Chunk are all of the chunk size, except the last which is truncated
 		// 0 means no more to transfer
 		Q_ASSERT (total_transfered <= total_size);
-		return qMin (Const::chunk_size, total_size - total_transfered);
+		return qMin (qMin (target_chunk_size, total_size - total_transfered), chunk_limit);
+	}
+
+	bool prepare_next_chunk (Copy & copy, qint64 & hole) {
+		// Sender: sets hole if the next data is a hole of a sparse file (send it, then send_hole ())
+		// For delta transfers: sets copy if the next data can be copied from the basis
+		// Otherwise limits the next chunk to the data before the next hole or copy
+		// Chunks do not cross file boundaries for delta transfers (and zero-copy is disabled)
+		Q_ASSERT (transfer_status == Sending);
+		Q_ASSERT (total_transfered < total_size);
+		copy = Copy ();
+		hole = 0;
+		chunk_limit = total_size;
+		if (!open_current_file (QIODevice::ReadOnly))
+			return false;
+		auto & file = get_current_file ();
+		if (file.is_sparse ()) {
+			hole = file.get_hole_size ();
+			if (hole > 0)
+				return true;
+			chunk_limit = file.get_data_size ();
+		}
+		if (delta_signatures.empty ())
+			return true;
+		auto remaining = file.get_size () - file.get_pos ();
+		chunk_limit = qMin (chunk_limit, remaining); // Do not cross files
+		auto it = delta_signatures.find (current_file_index);
+		if (it == delta_signatures.end ())
+			return true;
+		if (!delta_encoder)
+			delta_encoder.reset (new DeltaEncoder (it->second, hash_algorithm,
+			                                       file.get_whole_mapping (), file.get_size ()));
+		auto literal_size = delta_encoder->find (file.get_pos (), target_chunk_size, copy);
+		chunk_limit = qMin (chunk_limit, literal_size);
+		return true;
+	}
+
+	void send_hole (qint64 size) {
+		Q_ASSERT (transfer_status == Sending);
+		auto & file = get_current_file ();
+		file.skip_hole (size);
+		total_transfered += size;
+		if (file.at_end ())
+			end_of_file_data ();
+	}
+
+	bool prepare_compressed_chunk (void) {
+		// Sender: bounds the next chunk to mapped data of one hash block of the current file
+		// compress_next_chunk () then compresses it (if it does, send_compressed_chunk () moves past
+		// it). The receiver decompresses to the file, checksums are of uncompressed data.
+		Q_ASSERT (transfer_status == Sending);
+		if (!open_current_file (QIODevice::ReadOnly))
+			return false;
+		auto & file = get_current_file ();
+		auto pos = file.get_pos ();
+		auto block_end =
+		    qMin ((pos / Const::hash_block_size + 1) * Const::hash_block_size, file.get_size ());
+		chunk_limit = qMin (chunk_limit, block_end - pos);
+		return true;
+	}
+	qint64 compress_next_chunk (void) {
+		// Returns the compressed size (data in get_compressed_data ()), or -1 if not compressible
+		auto data = get_current_file ().get_data_at_pos ();
+		if (data == nullptr)
+			return -1; // Sent normally, which reports the error
+		return codec.compress (data, next_chunk_size ());
+	}
+	const char * get_compressed_data (void) const { return codec.get_output (); }
+	void send_compressed_chunk (void) {
+		auto size = next_chunk_size ();
+		auto & file = get_current_file ();
+		file.skip_data (size);
+		total_transfered += size;
+		if (file.at_end ())
+			end_of_file_data ();
+	}
+
+	void send_copy (const Copy & copy) {
+		Q_ASSERT (transfer_status == Sending);
+		auto & file = get_current_file ();
+		file.skip_data (copy.size);
+		total_transfered += copy.size;
+		if (file.at_end ())
+			end_of_file_data ();
 	}
 
-	bool send_next_chunk (QDataStream & stream) {
+	qint64 prepare_local_copy (void) {
+		// Sender: returns the size of the next local copy (after prepare_next_chunk ()), or -1
+		Q_ASSERT (transfer_status == Sending);
+		Q_ASSERT (local_copy);
+		auto & file = get_current_file ();
+		if (file.get_data_at_pos () == nullptr) {
+			transfer_error (file.get_last_error ());
+			return -1;
+		}
+		auto size = qMin (Const::local_copy_step_size, file.get_mapped_size ());
+		return qMin (size, qMin (chunk_limit, total_size - total_transfered));
+	}
+	void send_local_copy (qint64 size) {
+		// The data is still hashed, from the mapping
+		Q_ASSERT (transfer_status == Sending);
+		auto & file = get_current_file ();
+		file.skip_data (size);
+		total_transfered += size;
+		if (file.at_end ())
+			end_of_file_data ();
+	}
+
+	bool send_next_chunk (QDataStream & stream) { return send_data (stream, next_chunk_size ()); }
+
+	bool send_data (QDataStream & stream, qint64 bytes_to_send) {
 		Q_ASSERT (transfer_status == Sending);
-		auto bytes_to_send = next_chunk_size ();
 		while (bytes_to_send > 0) {
 			Q_ASSERT (total_transfered <= total_size);
 			Q_ASSERT (nb_files_transfered <= get_nb_files ());
-			Q_ASSERT (current_file != files.end ()); // Should stop due to size test
-			if (!current_file->is_open () &&
-			    !current_file->open (get_payload_dir (), QIODevice::ReadOnly)) {
-				transfer_error (current_file->get_last_error ());
+			if (!open_current_file (QIODevice::ReadOnly))
 				return false;
-			}
-			auto sent = current_file->read_data (stream, bytes_to_send);
+			auto & file = get_current_file ();
+			auto sent = file.read_data (stream, bytes_to_send);
 			if (sent == -1) {
-				transfer_error (
-				    tr ("Unable to send data to socket: %1").arg (stream.device ()->errorString ()));
+				if (!file.get_last_error ().isEmpty ())
+					transfer_error (file.get_last_error ()); // Asynchronous read
+				else
+					transfer_error (tr ("Unable to send data to socket: %1")
+					                    .arg (stream.device ()->errorString ()));
 				return false;
 			}
 			bytes_to_send -= sent;
 			total_transfered += sent;
-			if (current_file->at_end ()) {
-				current_file->close ();
-				current_file++;
-			}
+			if (file.at_end ())
+				end_of_file_data ();
 		}
 		if (total_transfered == total_size)
-			Q_ASSERT (current_file == files.end ());
+			Q_ASSERT (current_file_index == files.size ());
 		return true;
 	}
 
+	bool is_next_data_ready (void) {
+		// Sender: false while the data of the next chunk is read ahead (see File)
+		Q_ASSERT (transfer_status == Sending);
+		// The first read of a file is waited for by the chunk that opens it
+		if (current_file_index >= files.size () || !is_current_file_open ())
+			return true;
+		return get_current_file ().is_data_ready ();
+	}
+	AsyncIo * get_async_io (void) const { return async_io.get (); }
+
+	bool is_hashing_behind (void) {
+		// Stop giving data to the current file until get_hash_progress () emits drained ()
+		return is_current_file_open () && get_current_file ().is_hashing_behind ();
+	}
+	HashProgress * get_hash_progress (void) { return &hash_progress; }
+
+	qint64 get_buffered_size (void) {
+		// Receiver: memory used by received data of the files (see File::get_buffered_size ())
+		qint64 buffered = 0;
+		for (auto & file : open_files)
+			if (file)
+				buffered += file->get_buffered_size ();
+		return buffered;
+	}
+
+	// Zero-copy status, disabled for the whole transfer at the first unsupported file
+	// If enabled, chunk data can be sent with send_data () instead of the stream
+	bool can_send_zero_copy (void) const { return zero_copy_enabled; }
+
+	qint64 send_data (int socket_fd, qint64 bytes) {
+		// Returns bytes sent (may be less than requested if socket is full), or -1 on error
+		Q_ASSERT (transfer_status == Sending);
+		Q_ASSERT (zero_copy_enabled);
+		Q_ASSERT (bytes <= total_size - total_transfered);
+		qint64 bytes_sent = 0;
+		while (bytes_sent < bytes) {
+			if (!open_current_file (QIODevice::ReadOnly))
+				return -1;
+			auto & file = get_current_file ();
+			auto sent = file.send_data (socket_fd, bytes - bytes_sent);
+			if (sent == -2) {
+				transfer_error (file.get_last_error ());
+				return -1;
+			}
+			if (sent == -1) {
+				if (zero_copy_send_file_ended ()) {
+					// sendfile would return 0 forever, like a full socket
+					transfer_error (tr ("File %1 has changed").arg (files.get_path (current_file_index)));
+					return -1;
+				}
+				if (zero_copy_send_unsupported ()) {
+					// Let the caller send the rest through the stream
+					zero_copy_enabled = false;
+					return bytes_sent;
+				}
+				transfer_error (tr ("Unable to send data to socket: %1").arg (qt_error_string ()));
+				return -1;
+			}
+			bytes_sent += sent;
+			total_transfered += sent;
+			if (file.at_end ()) {
+				end_of_file_data ();
+			} else if (sent == 0) {
+				break; // Socket is full
+			}
+		}
+		return bytes_sent;
+	}
+
 	bool receive_chunk (QDataStream & stream, qint64 chunk_size) {
 		Q_ASSERT (transfer_status == Receiving);
 		if (chunk_size > (total_size - total_transfered)) {
@@ -457,40 +1943,182 @@ public:
 		auto bytes_to_receive = chunk_size;
 		while (bytes_to_receive > 0) {
 			Q_ASSERT (total_transfered <= total_size);
-			Q_ASSERT (current_file != files.end ()); // Should stop due to size test
-			if (!current_file->is_open () &&
-			    !current_file->open (get_payload_dir (), QIODevice::ReadWrite)) {
-				transfer_error (current_file->get_last_error ());
+			if (!open_current_file (QIODevice::ReadWrite))
 				return false;
-			}
-			auto received = current_file->write_data (stream, bytes_to_receive);
+			auto & file = get_current_file ();
+			auto received = file.write_data (stream, bytes_to_receive);
 			if (received == -1) {
-				transfer_error (
-				    tr ("Unable to receive data from socket: %1").arg (stream.device ()->errorString ()));
+				if (stream.status () == QDataStream::Ok)
+					transfer_error (file.get_last_error ());
+				else
+					transfer_error (tr ("Unable to receive data from socket: %1")
+					                    .arg (stream.device ()->errorString ()));
 				return false;
 			}
 			bytes_to_receive -= received;
 			total_transfered += received;
-			if (current_file->at_end ()) {
-				current_file->close ();
-				current_file++;
-			}
+			if (file.at_end ())
+				end_of_file_data ();
 		}
 		if (total_transfered == total_size)
-			Q_ASSERT (current_file == files.end ());
+			Q_ASSERT (current_file_index == files.size ());
+		may_update_resume_journal ();
+		return true;
+	}
+
+	qint64 receive_chunk (int socket_fd, qint64 bytes) {
+		// Rest of a chunk, directly from the socket: returns bytes received (may be 0), or -1
+		Q_ASSERT (transfer_status == Receiving);
+		if (bytes > (total_size - total_transfered)) {
+			transfer_error (tr ("Chunk goes past the end of transfer"));
+			return -1;
+		}
+		qint64 bytes_received = 0;
+		while (bytes_received < bytes) {
+			if (!open_current_file (QIODevice::ReadWrite))
+				return -1;
+			auto & file = get_current_file ();
+			auto received = file.receive_data (socket_fd, bytes - bytes_received);
+			if (received == -1) {
+				transfer_error (file.get_last_error ());
+				return -1;
+			}
+			bytes_received += received;
+			total_transfered += received;
+			if (file.at_end ())
+				end_of_file_data ();
+			else if (received == 0)
+				break; // Wait for more data
+		}
+		may_update_resume_journal ();
+		return bytes_received;
+	}
+	bool can_receive_direct (void) const { return transfer_status == Receiving; }
+
+	bool receive_compressed_chunk (const char * data, qint64 size, qint64 chunk_size) {
+		Q_ASSERT (transfer_status == Receiving);
+		if (chunk_size <= 0 || chunk_size > total_size - total_transfered) {
+			transfer_error (tr ("Chunk goes past the end of transfer"));
+			return false;
+		}
+		if (!open_current_file (QIODevice::ReadWrite))
+			return false;
+		auto & file = get_current_file ();
+		if (!file.write_decompressed (chunk_size, [&](char * target, qint64 bytes) {
+			    return codec.decompress (data, size, target, bytes);
+			})) {
+			transfer_error (file.get_last_error ());
+			return false;
+		}
+		total_transfered += chunk_size;
+		if (file.at_end ())
+			end_of_file_data ();
+		return true;
+	}
+
+	bool receive_hole (qint64 size) {
+		Q_ASSERT (transfer_status == Receiving);
+		if (size <= 0 || size > total_size - total_transfered) {
+			transfer_error (tr ("Chunk goes past the end of transfer"));
+			return false;
+		}
+		if (!open_current_file (QIODevice::ReadWrite))
+			return false;
+		auto & file = get_current_file ();
+		if (!file.skip_hole (size)) {
+			transfer_error (file.get_last_error ());
+			return false;
+		}
+		total_transfered += size;
+		if (file.at_end ())
+			end_of_file_data ();
+		return true;
+	}
+
+	bool receive_copy (const Copy & copy) {
+		Q_ASSERT (transfer_status == Receiving);
+		if (copy.size > total_size - total_transfered) {
+			transfer_error (tr ("Chunk goes past the end of transfer"));
+			return false;
+		}
+		if (!open_current_file (QIODevice::ReadWrite))
+			return false;
+		auto & file = get_current_file ();
+		if (!file.copy_from_basis (copy)) {
+			transfer_error (file.get_last_error ());
+			return false;
+		}
+		total_transfered += copy.size;
+		if (file.at_end ())
+			end_of_file_data ();
+		return true;
+	}
+
+	bool receive_local_copy (qint64 size) {
+		// Copies the data from the sender file (see File)
+		Q_ASSERT (transfer_status == Receiving);
+		Q_ASSERT (local_copy);
+		if (size <= 0 || size > total_size - total_transfered) {
+			transfer_error (tr ("Chunk goes past the end of transfer"));
+			return false;
+		}
+		if (!open_current_file (QIODevice::ReadWrite))
+			return false;
+		auto & file = get_current_file ();
+		if (!local_source.isOpen () || local_source_index != current_file_index) {
+			local_source.close ();
+			local_source.setFileName (local_source_dir.filePath (files.get_path (current_file_index)));
+			local_source_index = current_file_index;
+			if (!local_source.open (QIODevice::ReadOnly | QIODevice::Unbuffered)) {
+				transfer_error (tr ("Unable to open file %1: %2")
+				                    .arg (local_source.fileName (), local_source.errorString ()));
+				return false;
+			}
+		}
+		if (!file.copy_from_source (local_source, size)) {
+			transfer_error (file.get_last_error ());
+			return false;
+		}
+		total_transfered += size;
+		if (file.at_end ()) {
+			if (drop_cache && local_source.isOpen ())
+				drop_cached_data (local_source.handle (), 0, file.get_size ());
+			local_source.close ();
+			end_of_file_data ();
+		}
+		may_update_resume_journal ();
 		return true;
 	}
 
 	// Checksums
+	// Sent in payload order (files, then blocks), and tested by the receiver in order.
+	// Files stay open until all their checksums have been sent or tested.
 
 	ChecksumList take_pending_checksums (void) {
 		ChecksumList checksums;
-		// We can only send checksums if files have been processed
-		for (; next_file_to_checksum != current_file; ++next_file_to_checksum) {
-			checksums.append (next_file_to_checksum->get_checksum ());
-			++nb_files_transfered;
+		// We can only send checksums if blocks have been processed and hashed
+		// After the last chunk, wait for the remaining hashes
+		bool wait_for_hash = total_transfered == total_size;
+		while (next_file_to_checksum_index < files.size ()) {
+			if (next_block_to_checksum < get_nb_checksums (next_file_to_checksum_index)) {
+				auto file = open_files.empty () ? nullptr : open_files.front ().get ();
+				if (file == nullptr) {
+					Q_ASSERT (next_file_to_checksum_index == current_file_index);
+					break; // Not opened yet
+				}
+				if (!wait_for_hash && !file->is_block_checksum_ready (next_block_to_checksum))
+					break;
+				checksums.append (file->get_block_checksum (next_block_to_checksum));
+				++next_block_to_checksum;
+			} else if (next_file_to_checksum_index != current_file_index) {
+				open_files.front ()->close ();
+				next_file_checksummed ();
+				++nb_files_transfered;
+			} else {
+				break; // Not completely sent
+			}
 		}
-		if (next_file_to_checksum == files.end ()) {
+		if (next_file_to_checksum_index == files.size () && file_list_complete) {
 			Q_ASSERT (nb_files_transfered == get_nb_files ());
 			Q_ASSERT (total_transfered == total_size);
 			stop_transfer (); // Close the transfer
@@ -499,29 +2127,310 @@ public:
 	}
 
 	bool test_checksums (const ChecksumList & checksums) {
-		// Test checksums against files (must have been processed before)
+		// Test block checksums against files (blocks must have been received before)
 		for (const auto & checksum : checksums) {
-			if (next_file_to_checksum == current_file) {
-				transfer_error (tr ("Received checksum of incomplete file."));
+			if (!skip_checksummed_files ())
 				return false;
-			}
-			if (!next_file_to_checksum->test_checksum (checksum)) {
-				last_error = next_file_to_checksum->get_last_error ();
+			auto file = open_files.empty () ? nullptr : open_files.front ().get ();
+			if (next_file_to_checksum_index == files.size () || file == nullptr ||
+			    (next_file_to_checksum_index == current_file_index &&
+			     (legacy_peer || !file->is_block_received (next_block_to_checksum)))) {
+				transfer_error (tr ("Received checksum of incomplete block."));
 				return false;
 			}
-			++next_file_to_checksum;
+			if (!file->test_block_checksum (next_block_to_checksum, checksum)) {
+				if (legacy_peer) {
+					// Cannot be repaired
+					resumable = false;
+					transfer_error (
+					    tr ("Checksum does not match for file %1").arg (file->get_relative_path ()));
+					return false;
+				}
+				BlockId block;
+				block.file_index = next_file_to_checksum_index;
+				block.block_index = next_block_to_checksum;
+				files_with_bad_blocks[block.file_index]; // File is moved there when checksummed
+				retransmission_requests.push_back (block);
+				if (local_copy)
+					local_source_failed = true; // Our view of the sender file differs
+			}
+			++next_block_to_checksum;
+		}
+		if (!skip_checksummed_files ())
+			return false;
+		stop_if_complete ();
+		return true;
+	}
+
+	// Block retransmission
+	// If a block checksum does not match, the receiver requests the block again: the sender replies
+	// using read_block, and repair_block may ask for it again. Files with bad blocks stay open.
+
+	std::vector<BlockId> take_retransmission_requests (void) {
+		std::vector<BlockId> requests;
+		std::swap (requests, retransmission_requests);
+		return requests;
+	}
+
+	bool read_block (const BlockId & block, QByteArray & data) {
+		// Can be used after the end of the transfer (sender)
+		if (block.file_index >= files.size () ||
+		    block.block_index >= files.get_nb_blocks (block.file_index)) {
+			last_error = tr ("Invalid block");
+			return false;
+		}
+		auto i = block.file_index;
+		File file (files.get_path (i), files.get_size (i), files.get_last_modified (i));
+		if (!file.read_block (get_payload_dir (), block.block_index, data)) {
+			last_error = file.get_last_error ();
+			return false;
+		}
+		return true;
+	}
+
+	bool repair_block (const BlockId & block, const QByteArray & data) {
+		Q_ASSERT (transfer_status == Receiving);
+		auto it = files_with_bad_blocks.find (block.file_index);
+		if (it == files_with_bad_blocks.end ()) {
+			transfer_error (tr ("Received unexpected block"));
+			return false;
+		}
+		auto & file = get_file_with_bad_blocks (block.file_index);
+		if (!file.repair_block (block.block_index, data)) {
+			resumable = false; // Local data is wrong
+			transfer_error (file.get_last_error ());
+			return false;
+		}
+		if (file.has_bad_block (block.block_index)) {
+			retransmission_requests.push_back (block); // Try again
+		} else if (!file.has_bad_blocks ()) {
+			auto checksummed = std::move (it->second); // Null if still in open_files
+			files_with_bad_blocks.erase (it);
+			if (checksummed) {
+				// All checksums of the file have been tested
+				if (!checksummed->commit (get_payload_dir ())) {
+					transfer_error (checksummed->get_last_error ());
+					return false;
+				}
+				++nb_files_transfered;
+				stop_if_complete ();
+			}
+		}
+		return true;
+	}
+
+private:
+	QDir get_payload_dir (void) const { return QDir (root_dir.filePath (payload_root)); }
+
+	QString get_journal_path (void) const {
+		auto name = get_type () == SingleFile ? files.get_path (0) : payload_root;
+		return root_dir.filePath (QStringLiteral (".%1.%2-resume").arg (name, Const::app_name));
+	}
+	QByteArray get_journal_id (quint32 nb_files) const {
+		/* Identifies the payload by its root and its first files (paths and sizes).
+		 * The file order is deterministic (see Scanner), so this works for a streamed offer.
+		 * The hash of the files is extended as the journal progresses.
+		 */
+		if (nb_files < journal_files_hashed) {
+			journal_files_hash.reset ();
+			journal_files_hashed = 0;
+		}
+		for (; journal_files_hashed < nb_files; ++journal_files_hashed) {
+			auto path = files.get_path_utf8 (journal_files_hashed);
+			auto size = qToBigEndian (files.get_size (journal_files_hashed));
+			journal_files_hash.addData (path.constData (), path.size ());
+			journal_files_hash.addData ("", 1); // Separator
+			journal_files_hash.addData (reinterpret_cast<const char *> (&size), sizeof (size));
+		}
+		auto id = payload_root.toUtf8 ();
+		id.append ('\0');
+		id.append (journal_files_hash.result ());
+		return QCryptographicHash::hash (id, QCryptographicHash::Md5);
+	}
+	bool read_resume_journal (quint32 & nb_id_files, QByteArray & id, ResumePoint & point,
+	                          QDateTime & written) const {
+		QFile journal (get_journal_path ());
+		if (!journal.open (QIODevice::ReadOnly))
+			return false;
+		QDataStream stream (&journal);
+		stream.setVersion (Const::serializer_version);
+		quint16 magic;
+		stream >> magic >> nb_id_files >> id >> point >> written;
+		return stream.status () == QDataStream::Ok && magic == Const::protocol_magic &&
+		       written.isValid ();
+	}
+	ResumePoint get_resume_point (void) {
+		// First block not tested or bad
+		ResumePoint point;
+		point.file_index = next_file_to_checksum_index;
+		if (next_file_to_checksum_index < files.size ())
+			point.file_offset = qMin (qint64 (next_block_to_checksum) * Const::hash_block_size,
+			                          files.get_size (next_file_to_checksum_index));
+		if (!files_with_bad_blocks.empty ()) {
+			// Bad blocks are always before the next block to test
+			point.file_index = files_with_bad_blocks.begin ()->first;
+			auto & file = get_file_with_bad_blocks (point.file_index);
+			point.file_offset = file.get_block_offset (file.get_first_bad_block ());
+		}
+		return point;
+	}
+	void update_resume_journal (void) { update_resume_journal (get_resume_point ()); }
+	void update_resume_journal (const ResumePoint & point) {
+		// Save the resume point and the time (see load_resume_point ()), or remove the journal
+		auto path = get_journal_path ();
+		// Streamed offer: all files known yet may be received, the point is before the next ones
+		if (!resumable || (point.file_index >= files.size () && file_list_complete) ||
+		    (point.file_index == 0 && point.file_offset == 0)) {
+			QFile::remove (path);
+			return;
+		}
+		QSaveFile journal (path);
+		if (!journal.open (QIODevice::WriteOnly)) {
+			qWarning ("Unable to save resume journal: %s", qUtf8Printable (journal.errorString ()));
+			return;
+		}
+		QDataStream stream (&journal);
+		stream.setVersion (Const::serializer_version);
+		auto nb_id_files = qMin (point.file_index + 1, files.size ());
+		stream << Const::protocol_magic << nb_id_files << get_journal_id (nb_id_files) << point
+		       << QDateTime::currentDateTimeUtc ();
+		if (stream.status () != QDataStream::Ok || !journal.commit ())
+			qWarning ("Unable to save resume journal: %s", qUtf8Printable (journal.errorString ()));
+	}
+
+	// Open files
+
+	File & get_current_file (void) {
+		// Only if opened
+		Q_ASSERT (open_files.size () == current_file_index - next_file_to_checksum_index + 1);
+		Q_ASSERT (open_files.back ());
+		return *open_files.back ();
+	}
+	bool is_current_file_open (void) const {
+		return open_files.size () > current_file_index - next_file_to_checksum_index;
+	}
+	File & get_file_with_bad_blocks (quint32 index) {
+		// Tested files are in files_with_bad_blocks, others still in open_files
+		auto & file = files_with_bad_blocks.at (index);
+		if (file)
+			return *file;
+		Q_ASSERT (index >= next_file_to_checksum_index);
+		return *open_files[index - next_file_to_checksum_index];
+	}
+
+	File * open_file (QIODevice::OpenMode mode, qint64 offset = 0) {
+		// Creates and opens the File of the current file index
+		Q_ASSERT (!is_current_file_open ());
+		auto i = current_file_index;
+		std::unique_ptr<File> file (new File (files.get_path (i), files.get_size (i),
+		                                      files.get_last_modified (i), files.has_basis (i)));
+		file->set_whole_checksum (legacy_peer);
+		file->set_async_io (async_io.get ());
+		file->set_hash_progress (&hash_progress);
+		file->set_drop_cache (drop_cache);
+		file->set_whole_mapping (mode == QIODevice::ReadOnly && delta_signatures.count (i) > 0);
+		if (!file->open (get_payload_dir (), mode, hash_algorithm, offset)) {
+			transfer_error (file->get_last_error ());
+			return nullptr;
+		}
+		open_files.push_back (std::move (file));
+		return open_files.back ().get ();
+	}
+
+	bool open_current_file (QIODevice::OpenMode mode) {
+		// Open the current file, skipping empty files
+		while (true) {
+			Q_ASSERT (current_file_index < files.size ()); // Caller ensures there is data left
+			if (!is_current_file_open () && open_file (mode) == nullptr)
+				return false;
+			if (!get_current_file ().at_end ())
+				return true;
+			end_of_file_data ();
+		}
+	}
+
+	void next_current_file (void) {
+		if (!is_current_file_open ())
+			open_files.emplace_back (); // Skipped, never opened
+		++current_file_index;
+	}
+
+	void end_of_file_data (void) {
+		// File stays open until its checksums are handled, but bound the number of such files
+		delta_encoder.reset ();
+		next_current_file ();
+		skip_present_files ();
+		auto nb_pending = current_file_index - next_file_to_checksum_index;
+		if (nb_pending > quint32 (Const::max_pending_hash_files) && open_files.front ())
+			open_files.front ()->wait_checksums ();
+	}
+
+	quint32 get_nb_checksums (quint32 index) const {
+		// Block checksums, or the whole file checksum for a legacy peer
+		return legacy_peer ? 1 : files.get_nb_blocks (index);
+	}
+	void next_file_checksummed (void) {
+		auto bad = files_with_bad_blocks.find (next_file_to_checksum_index);
+		if (bad != files_with_bad_blocks.end ())
+			bad->second = std::move (open_files.front ()); // Stays open until repaired
+		open_files.pop_front ();
+		++next_file_to_checksum_index;
+		next_block_to_checksum = 0;
+		skip_present_checksummed_files ();
+	}
+
+	bool is_skipped (quint32 index) const {
+		return index < quint32 (skipped_files.size ()) && skipped_files.testBit (int(index));
+	}
+	void skip_present_files (void) {
+		// Files present on the receiver are counted as transferred
+		while (current_file_index < files.size () && is_skipped (current_file_index)) {
+			total_transfered += files.get_size (current_file_index);
+			skipped_size += files.get_size (current_file_index);
+			next_current_file ();
+		}
+		skip_present_checksummed_files ();
+	}
+	void skip_present_checksummed_files (void) {
+		// Present files have no checksum to send or test
+		while (next_file_to_checksum_index != current_file_index && next_block_to_checksum == 0 &&
+		       is_skipped (next_file_to_checksum_index)) {
+			open_files.pop_front ();
+			++next_file_to_checksum_index;
 			++nb_files_transfered;
 		}
-		if (next_file_to_checksum == files.end ()) {
+	}
+	bool skip_checksummed_files (void) {
+		// Receiver: files are checked when all their block checksums have been tested
+		while (next_file_to_checksum_index != current_file_index &&
+		       next_block_to_checksum == get_nb_checksums (next_file_to_checksum_index)) {
+			if (files_with_bad_blocks.count (next_file_to_checksum_index) == 0) {
+				auto & file = *open_files.front ();
+				if (!file.commit (get_payload_dir ())) {
+					transfer_error (file.get_last_error ());
+					return false;
+				}
+				++nb_files_transfered;
+			}
+			next_file_checksummed ();
+		}
+		return true;
+	}
+	void stop_if_complete (void) {
+		if (next_file_to_checksum_index == files.size () && files_with_bad_blocks.empty () &&
+		    file_list_complete) {
 			Q_ASSERT (nb_files_transfered == get_nb_files ());
 			Q_ASSERT (total_transfered == total_size);
 			stop_transfer (); // Close the transfer
 		}
-		return true;
 	}
 
-private:
-	QDir get_payload_dir (void) const { return QDir (root_dir.filePath (payload_root)); }
+	void may_update_resume_journal (void) {
+		if (journal_timer.elapsed () >= Const::resume_journal_interval_msec) {
+			update_resume_journal ();
+			journal_timer.start ();
+		}
+	}
 
 	void transfer_error (const QString & why) {
 		last_error = why;
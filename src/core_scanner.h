@@ -0,0 +1,272 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_SCANNER_H
+#define CORE_SCANNER_H
+
+#include <QAtomicInt>
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMetaObject>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QObject>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QTimer>
+#include <algorithm>
+#include <set>
+#include <vector>
+
+#include "core_file_table.h"
+#include "core_localshare.h"
+#include "portability.h"
+
+namespace Payload {
+/* Lists the files to send, off the event loop thread (see Manager::from_scan ()).
+ *
+ * Directories are listed in parallel by jobs of a private QThreadPool (Const::scanner_threads).
+ * Each job lists one directory, and starts a job for each of its subdirectories.
+ * If has_directory_listing (), entries are read with list_directory (), else with QDir.
+ * Like the previous QDirIterator scan: symbolic links are ignored, unreadable dirs are skipped,
+ * and hidden files are optionally ignored.
+ *
+ * Files are sorted by path at the end, so that the same tree gives the same offer (resuming).
+ * progressed () is emitted periodically, and finished () once (check get_error ()).
+ * For a streamed offer, take_new_files () gives files while scanning, in the same order.
+ * Files not found yet are in directories still listed, and come after "<dir>/" in path order:
+ * only files before all these prefixes are given, the others wait for the listing to progress.
+ * The destructor cancels the scan and waits for the jobs.
+ */
+class Scanner : public QObject {
+	Q_OBJECT
+
+private:
+	// Shared with the jobs, protected by mutex
+	struct State {
+		QMutex mutex;
+		FileTable files;
+		quint32 nb_taken_files{0};            // Seen by take_new_files ()
+		std::vector<quint32> waiting_files;   // Seen, not given yet
+		std::multiset<QByteArray> listed_dirs; // UTF-8 "<dir>/" prefixes (empty: payload dir)
+		qint64 total_size{0};
+		int pending_jobs{0};
+		QAtomicInt cancelled{0};
+	};
+
+	class Job : public QRunnable {
+	private:
+		Scanner & scanner;
+		QString relative_dir; // Empty for the payload dir
+
+	public:
+		Job (Scanner & scanner, const QString & relative_dir)
+		    : scanner (scanner), relative_dir (relative_dir) {}
+
+		void run (void) Q_DECL_OVERRIDE {
+			if (!scanner.state.cancelled.load ())
+				scanner.list_directory (relative_dir);
+			bool last_job;
+			{
+				QMutexLocker lock (&scanner.state.mutex);
+				last_job = --scanner.state.pending_jobs == 0;
+			}
+			if (last_job)
+				scanner.end_of_scan ();
+		}
+	};
+
+	const QString source_path;
+	const bool ignore_hidden;
+	QString error;
+
+	QDir root_dir;
+	QString payload_root; // "." for a single file
+	QDir payload_dir;
+
+	State state;
+	QThreadPool pool;
+	QTimer progress_timer;
+
+signals:
+	void progressed (int nb_files, qint64 total_size);
+	void finished (void);
+
+public:
+	Scanner (const QString & path, bool ignore_hidden, QObject * parent = nullptr)
+	    : QObject (parent), source_path (path), ignore_hidden (ignore_hidden), progress_timer (this) {
+		pool.setMaxThreadCount (Const::scanner_threads);
+		progress_timer.setInterval (int(Const::progress_update_interval_msec));
+		connect (&progress_timer, &QTimer::timeout, this, &Scanner::emit_progress);
+	}
+	~Scanner () {
+		state.cancelled.store (1);
+		pool.waitForDone ();
+	}
+
+	bool start (void) {
+		// Returns false if the path cannot be scanned (see get_error ())
+		auto cleaned_path = QFileInfo (source_path).canonicalFilePath ();
+		if (cleaned_path.isEmpty ()) {
+			error = tr ("Invalid path: %1").arg (source_path);
+			return false;
+		}
+		QFileInfo path_info (cleaned_path);
+		root_dir = path_info.dir ();
+		if (path_info.isFile ()) {
+			payload_root = ".";
+			state.files.append (path_info.fileName (), path_info.size (),
+			                    path_info.lastModified ().toMSecsSinceEpoch ());
+			state.total_size = path_info.size ();
+			QTimer::singleShot (0, this, SIGNAL (finished ()));
+			return true;
+		} else if (path_info.isDir ()) {
+			payload_root = path_info.fileName ();
+			payload_dir = QDir (path_info.filePath ());
+			state.pending_jobs = 1;
+			state.listed_dirs.insert (QByteArray ());
+			pool.start (new Job (*this, QString ())); // Deleted after run
+			progress_timer.start ();
+			return true;
+		} else {
+			error = tr ("Path is neither a file nor a directory: %1").arg (source_path);
+			return false;
+		}
+	}
+
+	// Results, valid after finished ()
+	QString get_error (void) const { return error; }
+	const QDir & get_root_dir (void) const { return root_dir; }
+	const QString & get_payload_root (void) const { return payload_root; }
+	FileTable & get_files (void) { return state.files; }
+
+	FileTable take_new_files (void) {
+		// Files given since the last call, in path order (see class description)
+		QMutexLocker lock (&state.mutex);
+		auto & waiting = state.waiting_files;
+		for (auto i = state.nb_taken_files; i < state.files.size (); ++i)
+			waiting.push_back (i);
+		state.nb_taken_files = state.files.size ();
+		const auto & files = state.files;
+		std::sort (waiting.begin (), waiting.end (), [&files](quint32 a, quint32 b) {
+			return files.get_path_utf8 (a) < files.get_path_utf8 (b);
+		});
+		auto end = waiting.begin ();
+		if (state.listed_dirs.empty ()) {
+			end = waiting.end ();
+		} else {
+			auto & first_dir = *state.listed_dirs.begin ();
+			while (end != waiting.end () && files.get_path_utf8 (*end) < first_dir)
+				++end;
+		}
+		FileTable taken;
+		for (auto it = waiting.begin (); it != end; ++it) {
+			auto path = files.get_path_utf8 (*it);
+			taken.append (path.constData (), path.size (), files.get_size (*it),
+			              files.get_last_modified (*it).toMSecsSinceEpoch ());
+		}
+		waiting.erase (waiting.begin (), end);
+		return taken;
+	}
+
+private:
+	void list_directory (const QString & relative_dir) {
+		// Runs in a job
+		auto prefix = relative_dir.isEmpty () ? QString () : relative_dir + '/';
+		FileTable files;
+		std::vector<QString> subdirs;
+		qint64 size = 0;
+		if (has_directory_listing ()) {
+			auto dir_path = QFile::encodeName (payload_dir.filePath (relative_dir));
+			::list_directory (dir_path.constData (), [&](const DirectoryEntry & entry) {
+				if (ignore_hidden && entry.name[0] == '.')
+					return;
+				auto path = prefix + QFile::decodeName (entry.name);
+				if (entry.is_dir) {
+					subdirs.push_back (path);
+				} else {
+					files.append (path, entry.size, entry.last_modified_msec);
+					size += entry.size;
+				}
+			});
+		} else {
+			auto filter_flags = QDir::Dirs | QDir::Files | QDir::NoSymLinks | QDir::NoDotAndDotDot |
+			                    QDir::Readable;
+			if (!ignore_hidden)
+				filter_flags |= QDir::Hidden;
+			QDir dir (payload_dir.filePath (relative_dir));
+			for (const auto & info : dir.entryInfoList (filter_flags)) {
+				auto path = prefix + info.fileName ();
+				if (info.isDir ()) {
+					subdirs.push_back (path);
+				} else {
+					files.append (path, info.size (), info.lastModified ().toMSecsSinceEpoch ());
+					size += info.size ();
+				}
+			}
+		}
+		{
+			QMutexLocker lock (&state.mutex);
+			if (!state.files.append (files))
+				error = tr ("Too many files in directory: %1").arg (source_path);
+			state.total_size += size;
+			state.pending_jobs += int(subdirs.size ());
+			for (const auto & subdir : subdirs)
+				state.listed_dirs.insert ((subdir + '/').toUtf8 ());
+			state.listed_dirs.erase (state.listed_dirs.find (prefix.toUtf8 ()));
+		}
+		for (const auto & subdir : subdirs)
+			pool.start (new Job (*this, subdir));
+	}
+
+	void end_of_scan (void) {
+		// Runs in the last job, when no other job is running
+		if (state.cancelled.load ())
+			return;
+		QMutexLocker lock (&state.mutex); // take_new_files () may be running
+		if (state.nb_taken_files == 0) {
+			// Not streamed
+			state.files.sort_by_path ();
+			state.files.shrink_to_fit ();
+		}
+		if (state.files.empty () && error.isEmpty ())
+			error = tr ("No file found in directory: %1").arg (source_path);
+		QMetaObject::invokeMethod (this, "end_of_scan_notify", Qt::QueuedConnection);
+	}
+
+private slots:
+	void end_of_scan_notify (void) {
+		progress_timer.stop ();
+		emit_progress ();
+		emit finished ();
+	}
+	void emit_progress (void) {
+		int nb_files;
+		qint64 total_size;
+		{
+			QMutexLocker lock (&state.mutex);
+			nb_files = int(state.files.size ());
+			total_size = state.total_size;
+		}
+		emit progressed (nb_files, total_size);
+	}
+};
+}
+
+#endif
@@ -0,0 +1,205 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_SCHEDULER_H
+#define CORE_SCHEDULER_H
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QThreadStorage>
+#include <QTimer>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <vector>
+
+#include "core_localshare.h"
+
+namespace Transfer {
+
+/* Fair scheduling of the transfers of a thread (one event loop).
+ *
+ * Transfers do their work (sending chunks, applying received messages, copying files) in steps,
+ * as Tasks. Events (socket readable or writable, file read completed...) only wake the Tasks.
+ * The Scheduler then runs them from the event loop, in turns of at most Const::max_work_msec,
+ * so that the event loop still runs often enough to move data in and out of sockets.
+ *
+ * Tasks are grouped by transfer (Group). A turn visits the Groups with woken Tasks in round-robin
+ * order. Each visit is a quantum of Const::work_quantum_usec, shared by the woken Tasks of the
+ * Group in round-robin order. A Task returns true if it stopped because the quantum expired:
+ * it is run again at the next visit. So a fast transfer cannot starve the others of its thread.
+ * The time spent in the quanta of a Group is its CPU time on the thread.
+ *
+ * There is one Scheduler per thread (see instance ()), used by the Groups woken in this thread.
+ * A Group must be detached before its transfer moves to another thread (see Base).
+ * Groups must outlive the Scheduler, or be destroyed before it; Tasks may outlive their Group.
+ */
+class Scheduler : public QObject {
+	Q_OBJECT
+
+public:
+	class Quantum {
+	private:
+		QElapsedTimer timer;
+		qint64 budget_nsec;
+
+	public:
+		Quantum (qint64 budget_usec) : budget_nsec (1000 * budget_usec) { timer.start (); }
+		bool expired (void) const { return timer.nsecsElapsed () >= budget_nsec; }
+		qint64 elapsed_nsec (void) const { return timer.nsecsElapsed (); }
+	};
+	using Work = std::function<bool(const Quantum & quantum)>; // True if work is left
+
+	class Task;
+	class Group {
+		friend class Scheduler;
+		friend class Task;
+
+	private:
+		std::vector<Task *> tasks;
+		std::deque<Task *> woken_tasks;
+		Scheduler * scheduler{nullptr}; // Queued in this one
+		qint64 cpu_time_nsec{0};
+
+	public:
+		Group () = default;
+		~Group () {
+			detach ();
+			for (auto task : tasks)
+				task->group = nullptr;
+		}
+		Group (const Group &) = delete;
+		Group & operator= (const Group &) = delete;
+
+		qint64 get_cpu_time (void) const { return cpu_time_nsec / 1000000; } // msec
+
+		void detach (void) {
+			// Leave the Scheduler (woken tasks are kept)
+			if (scheduler != nullptr)
+				scheduler->remove (*this);
+		}
+		void attach (void) {
+			// Use the Scheduler of the current thread for woken tasks
+			if (!woken_tasks.empty ())
+				instance ().add (*this);
+		}
+	};
+
+	class Task {
+		friend class Scheduler;
+		friend class Group;
+
+	private:
+		Group * group;
+		Work work;
+		bool woken{false};
+
+	public:
+		Task (Group & group_, Work work) : group (&group_), work (std::move (work)) {
+			group->tasks.push_back (this);
+		}
+		~Task () {
+			if (group == nullptr)
+				return;
+			auto & tasks = group->tasks;
+			tasks.erase (std::find (tasks.begin (), tasks.end (), this));
+			if (woken) {
+				auto & woken_tasks = group->woken_tasks;
+				woken_tasks.erase (std::find (woken_tasks.begin (), woken_tasks.end (), this));
+			}
+		}
+		Task (const Task &) = delete;
+		Task & operator= (const Task &) = delete;
+
+		void wake (void) {
+			// Run the task from the event loop (soon, but not now)
+			if (group == nullptr || woken)
+				return;
+			woken = true;
+			group->woken_tasks.push_back (this);
+			if (group->scheduler == nullptr)
+				instance ().add (*group);
+		}
+	};
+
+private:
+	std::deque<Group *> woken_groups;
+	QTimer turn_timer;
+
+public:
+	static Scheduler & instance (void) {
+		// Of the current thread, deleted when the thread finishes
+		static QThreadStorage<Scheduler *> schedulers;
+		if (!schedulers.hasLocalData ())
+			schedulers.setLocalData (new Scheduler);
+		return *schedulers.localData ();
+	}
+
+	~Scheduler () {
+		for (auto group : woken_groups)
+			group->scheduler = nullptr;
+	}
+
+private:
+	Scheduler () : turn_timer (this) {
+		turn_timer.setSingleShot (true);
+		turn_timer.setInterval (0);
+		connect (&turn_timer, &QTimer::timeout, this, &Scheduler::run_turn);
+	}
+
+	void add (Group & group) {
+		group.scheduler = this;
+		woken_groups.push_back (&group);
+		if (!turn_timer.isActive ())
+			turn_timer.start ();
+	}
+	void remove (Group & group) {
+		woken_groups.erase (std::find (woken_groups.begin (), woken_groups.end (), &group));
+		group.scheduler = nullptr;
+	}
+
+	static void run_quantum (Group & group) {
+		Quantum quantum (Const::work_quantum_usec);
+		while (!group.woken_tasks.empty () && !quantum.expired ()) {
+			auto task = group.woken_tasks.front ();
+			group.woken_tasks.pop_front ();
+			task->woken = false;
+			if (task->work (quantum))
+				task->wake (); // Continued after the tasks of the group woken meanwhile
+		}
+		group.cpu_time_nsec += quantum.elapsed_nsec ();
+	}
+
+private slots:
+	void run_turn (void) {
+		QElapsedTimer timer;
+		timer.start ();
+		while (!woken_groups.empty () && timer.elapsed () < Const::max_work_msec) {
+			auto group = woken_groups.front ();
+			woken_groups.pop_front ();
+			group->scheduler = nullptr; // Tasks woken meanwhile queue it again
+			run_quantum (*group);
+			if (!group->woken_tasks.empty () && group->scheduler == nullptr)
+				add (*group);
+		}
+		if (!woken_groups.empty ())
+			turn_timer.start (); // Return to the event loop
+	}
+};
+}
+
+#endif
@@ -31,6 +31,9 @@ namespace Transfer {
  * A QObject should be tied to download_ready().
  * It should take ownership of the Download object.
  *
+ * Connections starting with a Join message are additional connections of a transfer.
+ * They are given to the Download with the matching token (see Download::join_stripe ()).
+ *
  * Any error in the server object is fatal to the application.
  */
 class Server : public QObject {
@@ -58,6 +61,8 @@ public:
 				connect (download, &Transfer::Download::failed, this, &Server::download_failed);
 				connect (download, &Transfer::Download::status_changed, this,
 				         &Server::download_status_changed);
+				connect (download, &Transfer::Download::join_requested, this,
+				         &Server::download_join_requested);
 			}
 		});
 	}
@@ -82,9 +87,19 @@ private slots:
 			disconnect (download, &Transfer::Download::failed, this, &Server::download_failed);
 			disconnect (download, &Transfer::Download::status_changed, this,
 			            &Server::download_status_changed);
+			disconnect (download, &Transfer::Download::join_requested, this,
+			            &Server::download_join_requested);
 			emit download_ready (download);
 		}
 	}
+	void download_join_requested (quint64 token) {
+		// Give the connection to the target Download, and destroy the joining one
+		auto joining = qobject_cast<Transfer::Download *> (sender ());
+		Q_ASSERT (joining);
+		if (!Transfer::Download::join_stripe (token, *joining))
+			qWarning ("Server: Join request for unknown transfer");
+		joining->deleteLater ();
+	}
 };
 }
 
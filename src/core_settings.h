@@ -24,6 +24,8 @@
 #include <QSettings>
 #include <QStandardPaths>
 
+#include "core_localshare.h"
+
 namespace Settings {
 
 template <typename T> class Element {
@@ -77,6 +79,36 @@ private:
 	bool default_value (void) const { return false; }
 };
 
+class UploadSkipPresent : public Element<bool> {
+	// Offer file hashes, so that the receiver can skip files it already has
+private:
+	const char * key (void) const { return "upload/skip_present_files"; }
+	bool default_value (void) const { return false; }
+};
+
+class UploadCompression : public Element<bool> {
+	// Compress sent data if supported by both peers
+private:
+	const char * key (void) const { return "upload/compression"; }
+	bool default_value (void) const { return true; }
+};
+
+class UploadConnections : public Element<int> {
+	// Number of parallel connections used to send data
+private:
+	const char * key (void) const { return "upload/connections"; }
+	int default_value (void) const { return 1; }
+	int normalize (int value) { return qBound (1, value, Const::max_connections); }
+};
+
+class UploadBufferBudget : public Element<int> {
+	// Memory for send buffers in MiB, tuned to the connection speed (0: small fixed buffers)
+private:
+	const char * key (void) const { return "upload/buffer_budget_mib"; }
+	int default_value (void) const { return 32; }
+	int normalize (int value) { return qBound (0, value, 1024); }
+};
+
 class DownloadPath : public Element<QString> {
 	// Place to store downloaded files
 private:
@@ -98,6 +130,20 @@ private:
 	bool default_value (void) const { return false; }
 };
 
+class DownloadDelta : public Element<bool> {
+	// Only receive differences with existing files of the same name (delta transfer)
+private:
+	const char * key (void) const { return "download/delta"; }
+	bool default_value (void) const { return false; }
+};
+
+class TransferDropCache : public Element<bool> {
+	// Drop transferred file data from the page cache (spares the cache of shared machines)
+private:
+	const char * key (void) const { return "transfer/drop_cache"; }
+	bool default_value (void) const { return false; }
+};
+
 class UseTray : public Element<bool> {
 	// Allow use of system tray icon if supported
 private:
@@ -19,17 +19,34 @@
 #define CORE_TRANSFER_H
 
 #include <QAbstractSocket>
+#include <QBitArray>
+#include <QBuffer>
 #include <QDataStream>
+#include <QDir>
 #include <QElapsedTimer>
+#include <QEvent>
+#include <QFile>
+#include <QFileInfo>
+#include <QMetaObject>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QPointer>
+#include <QSocketNotifier>
 #include <QTcpSocket>
+#include <QTemporaryFile>
 #include <QTimer>
 #include <deque>
+#include <functional>
 #include <limits>
+#include <map>
+#include <memory>
+#include <random>
 #include <tuple>
 #include <type_traits>
 
 #include "core_localshare.h"
 #include "core_payload.h"
+#include "core_scheduler.h"
 
 namespace Transfer {
 
@@ -38,13 +55,30 @@ namespace Message {
 	 *
 	 * Uploader         Downloader
 	 * ---[open connection]--->
-	 * ---[magic+ver]--->
-	 * <---[magic+ver]---
+	 * ---[magic]--->
+	 * <---[magic+ver+capabilities]---
+	 * ---[ver+capabilities]--->
 	 * IF (magic/ver doesn't match) { abort () }
-	 * ---[offer]--->
+	 * (both select the same options from the capabilities: checksum and compression algorithms)
+	 * ---[offer]---> (may only have the first files of a directory still scanned)
+	 * <---[list request]--- (optional: a resume journal needs more files of the list)
+	 * ---[file lists]---> (until the list is complete, or the answer)
 	 * IF (accepted) {
-	 * <---[accepted]---
-	 * ---[chunks/checksums]--->
+	 * <---[accepted+resume point]--- (start of payload, or where an interrupted transfer stopped)
+	 *      (+set of files already present, to skip)
+	 *      (+signatures of existing files, for a delta transfer)
+	 *      (+token to join additional connections)
+	 *      (+path of a challenge file, if the offer has a local source: same host candidate)
+	 * ---[open additional connections, magic+ver, capabilities, join]---> (optional striping)
+	 * ---[local proof]---> (optional: content of the challenge file, the peer reads our files)
+	 * ---[chunks/copies/checksums]---> (copies reuse data of existing files)
+	 *      (local copies instead of chunk data after a local proof)
+	 *      (file lists after an incomplete offer, before chunks of these files)
+	 *      (chunks may be compressed, if it reduces their size)
+	 *      (wrapped in sequenced data messages if striping, chunks spread on all connections)
+	 * <---[local stop]--- (the local source is missing or differs: back to chunks)
+	 * <---[retransmit]--- (if a block checksum does not match)
+	 * ---[block data]--->
 	 * <--[completed]---
 	 * } ELSE  {
 	 * <---[rejected]---
@@ -57,22 +91,72 @@ namespace Message {
 	 * This ensures that stuff will break early if versions mismatch =)
 	 */
 	using CodeType = quint16;
-	constexpr CodeType base_code = Const::protocol_version << 4;
+	constexpr CodeType base_code = Const::protocol_version << 8;
 	enum Code : CodeType {
 		Error = base_code + 0, // +QString(error)
 		Offer = base_code + 1, // +QString(our_username),Payload(file_list)
-		Accept = base_code + 2,
+		Accept = base_code + 2, // +ResumePoint,QBitArray(skipped),SignatureList,quint64(token),
+		                        //  QString(local challenge path)
 		Reject = base_code + 3,
 		Chunk = base_code + 4,     // >Manual transfer...
-		Checksums = base_code + 5, // +Payload::Manager::ChecksumList
-		Completed = base_code + 6
+		Checksums = base_code + 5, // +Payload::Manager::ChecksumList (block checksums)
+		Completed = base_code + 6,
+		Retransmit = base_code + 7, // +Payload::BlockId
+		BlockData = base_code + 8,  // +Payload::BlockId,QByteArray(data)
+		Copy = base_code + 9,       // +Payload::Copy
+		Join = base_code + 10,      // +quint64(token) (first message of a stripe)
+		Data = base_code + 11,      // +quint64(sequence),Code,<content of a payload message>
+		CompressedChunk = base_code + 12, // +quint32(chunk size),QByteArray(compressed data)
+		FileList = base_code + 13,        // +Payload::FileBatch (files added to the offer)
+		Hole = base_code + 14,            // +qint64(size) (zeros of a sparse file, not sent)
+		ListRequest = base_code + 15,     // Streamed offer: send the file list before the answer
+		LocalProof = base_code + 16,      // +QByteArray(content of the local challenge file)
+		LocalCopy = base_code + 17,       // +qint64(size) (read from the sender file, not sent)
+		LocalStop = base_code + 18        // Send chunk data again instead of local copies
 	};
 
+	/* Legacy peers (Const::legacy_protocol_version) send magic+ver at once, and no capabilities.
+	 * The downloader answers a legacy uploader with magic+2, and the uploader answers the magic+2
+	 * of a legacy downloader with 2: see Base::receive_handshake ().
+	 * Messages then use the codes and layouts of version 2, up to Completed: the Accept has no
+	 * content, the Offer is complete without content hashes (Payload::Manager::LegacyOffer), and
+	 * Checksums hold one whole file MD5 per file (see Payload::Manager).
+	 */
+	constexpr CodeType legacy_base_code = Const::legacy_protocol_version << 4;
+	inline CodeType to_legacy_code (Code code) {
+		Q_ASSERT (code <= Completed);
+		return CodeType (code - base_code + legacy_base_code);
+	}
+	inline CodeType from_legacy_code (CodeType code) {
+		// Unknown codes give 0 (invalid)
+		if (code < legacy_base_code || code > to_legacy_code (Completed))
+			return 0;
+		return CodeType (code - legacy_base_code + base_code);
+	}
+
 	/* Messages with variable size content will be prefixed by their size (after code).
 	 * This allow me to check that there are enough bytes buffered before deserializing.
 	 */
 	using SizePrefixType = quint32;
 	constexpr auto max_size = static_cast<qint64> (std::numeric_limits<SizePrefixType>::max ());
+
+	/* Capabilities of a peer, sent after magic+ver (fixed size).
+	 * Options are selected deterministically from both capabilities.
+	 * host_id hints that the peer may be on the same host: the receiver then checks it with a
+	 * challenge file, that only a peer of the same host and user can read (see local copy).
+	 */
+	struct Capabilities : public Streamable {
+		quint32 hash_algorithms{Payload::supported_hash_algorithms ()};
+		quint32 compression_algorithms{Payload::supported_compression_algorithms ()};
+		quint64 host_id{::host_id ()};
+
+		void to_stream (QDataStream & stream) const {
+			stream << hash_algorithms << compression_algorithms << host_id;
+		}
+		void from_stream (QDataStream & stream) {
+			stream >> hash_algorithms >> compression_algorithms >> host_id;
+		}
+	};
 }
 
 // Information on size of serialized structures
@@ -115,15 +199,23 @@ private:
 
 public:
 	// Precomputed sizes
-	const qint64 handshake_size;
+	const qint64 magic_size;
+	const qint64 version_size;
+	const qint64 capabilities_size;
 	const qint64 message_code_size;
 	const qint64 message_size_prefix_size;
+	const qint64 sequence_header_size;
+	const qint64 max_chunk_content_size; // Sequenced content of the largest (compressed) chunk
 
 public:
 	Serialized ()
-	    : handshake_size (compute_size (Const::protocol_magic, Const::protocol_version)),
+	    : magic_size (compute_size (Const::protocol_magic)),
+	      version_size (compute_size (Const::protocol_version)),
+	      capabilities_size (compute_size (Message::Capabilities ())),
 	      message_code_size (compute_size (Message::CodeType ())),
-	      message_size_prefix_size (compute_size (Message::SizePrefixType ())) {}
+	      message_size_prefix_size (compute_size (Message::SizePrefixType ())),
+	      sequence_header_size (compute_size (quint64 (), Message::CodeType ())),
+	      max_chunk_content_size (compute_size (quint32 (), QByteArray ()) + Const::max_chunk_size) {}
 
 	template <typename... Args> qint64 compute_size (const Args &... args) {
 		return device.compute_size (args...);
@@ -131,6 +223,58 @@ public:
 };
 extern Serialized serialized_info; // Global precomputed size info (defined in main.cpp)
 
+/* Serializes messages with a size prefix in a single pass (see Base::send_content_message ()).
+ * The message is written to a buffer with a placeholder size prefix, which is patched once the
+ * content is written. The buffer is then written to the socket at once.
+ * The buffer is reused by the next message, unless it grew over Const::message_buffer_size.
+ * Messages must fit in a QByteArray (2GiB), which is below Message::max_size.
+ */
+class MessageWriter {
+private:
+	QByteArray buffer;
+	QBuffer device;
+	QDataStream stream;
+	qint64 message_size{0};
+
+public:
+	MessageWriter () {
+		device.setBuffer (&buffer);
+		device.open (QIODevice::WriteOnly);
+		stream.setDevice (&device);
+		stream.setVersion (Const::serializer_version);
+	}
+
+	template <typename... Args> bool serialize (Message::CodeType code, const Args &... args) {
+		// Code, size, then args as content. Returns false if too large.
+		if (buffer.size () > Const::message_buffer_size) {
+			device.close ();
+			buffer = QByteArray ();
+			device.open (QIODevice::WriteOnly);
+		}
+		device.seek (0);
+		stream.resetStatus ();
+		stream << code << Message::SizePrefixType (0);
+		auto content_start = device.pos ();
+		to_stream (stream, args...);
+		message_size = device.pos ();
+		auto content_size = message_size - content_start;
+		if (stream.status () != QDataStream::Ok || content_size > Message::max_size)
+			return false;
+		device.seek (content_start - serialized_info.message_size_prefix_size);
+		stream << Message::SizePrefixType (content_size);
+		return true;
+	}
+
+	// Last serialized message
+	const char * get_data (void) const { return buffer.constData (); }
+	qint64 get_size (void) const { return message_size; }
+
+	bool write_to (QDataStream & out) const {
+		// Returns false if the whole message could not be written (check out status)
+		return out.writeRawData (get_data (), int(get_size ())) == get_size ();
+	}
+};
+
 /* Implements the rate and progress notifications.
  * Signals:
  * - signals progress (bytes, files completed)
@@ -149,6 +293,9 @@ extern Serialized serialized_info; // Global precomputed size info (defined in m
  * When progressed() are frequent enough, we emit instant_rate() before each of them with a flag.
  * This lets watching qobject wait for the progressed() signal before redrawing.
  * If progressed() is infrequent, instant_rate is emitted with a slow timer.
+ *
+ * The receiver also records the memory used by received data not yet written to files
+ * (socket buffers, reorder buffer, file buffers): its high watermark shows the backpressure works.
  */
 class Notifier : public QObject {
 	Q_OBJECT
@@ -168,15 +315,22 @@ private:
 	std::deque<Progress> history;
 	QTimer update_rate_timer;
 
+	// Receiver buffered data
+	qint64 buffered_memory{0};
+	qint64 buffered_memory_peak{0};
+
 public:
 	const Payload::Manager & payload;
+	const Scheduler::Group & work; // CPU time
 
 signals:
 	void progressed (void);
 	void instant_rate (qint64 bytes_per_second, bool followed_by_progressed);
 
 public:
-	Notifier (const Payload::Manager & payload) : payload (payload) {
+	Notifier (const Payload::Manager & payload, const Scheduler::Group & work,
+	          QObject * parent = nullptr)
+	    : QObject (parent), update_rate_timer (this), payload (payload), work (work) {
 		connect (&update_rate_timer, &QTimer::timeout, this, &Notifier::update_rate);
 	}
 
@@ -202,6 +356,13 @@ public:
 		}
 	}
 
+	void record_buffered_memory (qint64 bytes) {
+		buffered_memory = bytes;
+		buffered_memory_peak = qMax (buffered_memory_peak, bytes);
+	}
+	qint64 get_buffered_memory (void) const { return buffered_memory; }
+	qint64 get_buffered_memory_peak (void) const { return buffered_memory_peak; }
+
 	// After end only
 
 	qint64 get_transfer_time (void) const {
@@ -209,7 +370,10 @@ public:
 		return qMax (transfer_duration_msec, qint64 (1));
 	}
 	qint64 get_average_rate (void) const {
-		return (payload.get_total_size () * 1000) / get_transfer_time ();
+		// Only count data transfered in this session
+		auto size =
+		    payload.get_total_size () - payload.get_resumed_size () - payload.get_skipped_size ();
+		return (size * 1000) / get_transfer_time ();
 	}
 
 private slots:
@@ -238,30 +402,333 @@ private:
 	}
 };
 
+/* Adaptive send buffer and chunk sizes (sender).
+ *
+ * A fixed send buffer limits the rate to buffer / round trip time.
+ * The rate of data leaving the send buffers is measured periodically.
+ * The buffer target is twice the bandwidth-delay product, within a memory budget.
+ * If the buffer is the bottleneck, the measured rate grows with it, so it keeps growing.
+ * Chunks grow with the buffer, to reduce the per message overhead at high rates.
+ * A budget of at most Const::write_buffer_size disables tuning (fixed sizes).
+ */
+class SendWindow {
+private:
+	qint64 budget{0};
+	qint64 buffer_size{Const::write_buffer_size};
+	qint64 chunk_size{Const::chunk_size};
+
+	QElapsedTimer timer;
+	qint64 last_sent{0};
+
+public:
+	void set_budget (qint64 bytes) { budget = bytes; }
+	qint64 get_buffer_size (void) const { return buffer_size; }
+	qint64 get_chunk_size (void) const { return chunk_size; }
+
+	bool update (qint64 sent, qint64 rtt_usec) {
+		// sent: total bytes out of the send buffers. Returns true if sizes changed.
+		if (budget <= Const::write_buffer_size)
+			return false;
+		if (!timer.isValid ()) {
+			timer.start ();
+			last_sent = sent;
+			return false;
+		}
+		auto elapsed = timer.elapsed ();
+		if (elapsed < Const::send_tuning_interval_msec)
+			return false;
+		auto rate = (1000 * (sent - last_sent)) / elapsed;
+		timer.start ();
+		last_sent = sent;
+
+		if (rtt_usec <= 0)
+			rtt_usec = Const::default_rtt_usec;
+		auto target = 2 * ((rate * rtt_usec) / 1000000);
+		// Shrink slowly: a low rate may just be a pause of the sender
+		target = qMax (target, buffer_size / 2);
+		target = qBound (Const::write_buffer_size, target, budget);
+		auto new_chunk_size = qBound (Const::chunk_size, target / 4, Const::max_chunk_size);
+		if (target == buffer_size && new_chunk_size == chunk_size)
+			return false;
+		buffer_size = target;
+		chunk_size = new_chunk_size;
+		return true;
+	}
+};
+
+/* Additional data connection of a transfer ("stripe", see Base).
+ *
+ * The sender opens it to the receiver server, then sends the handshake and a Join message.
+ * The token of the Join message identifies the Download (see Server).
+ * The server gives the socket to this Download, which wraps it in a receiver Stripe.
+ * A stripe then only carries Data messages, from sender to receiver.
+ *
+ * The receiver handler is called when the content of a Data message is buffered.
+ * It returns false to stop reading (error, or stalled: see resume ()).
+ * Reading is a Task of the transfer (see Scheduler), woken when data is received.
+ * The socket read buffer is bounded, so that a stalled stripe applies TCP backpressure.
+ * Data from the receiver (its handshake) is ignored by the sender.
+ */
+class Stripe : public QObject {
+	Q_OBJECT
+
+public:
+	using Handler = std::function<bool(Stripe & stripe, QDataStream & stream, qint64 size)>;
+
+private:
+	enum Status { Connecting, Sending, WaitingForCode, WaitingForSize, WaitingForContent };
+	Status status;
+	Message::SizePrefixType next_msg_size{0};
+	quint64 token{0};
+	Handler handler;
+
+	QAbstractSocket * socket;
+	QDataStream stream;
+	Scheduler::Task receive_task;
+
+signals:
+	void failed (const QString & reason);
+	void data_written (void);
+
+public:
+	// Sender
+	Stripe (const QHostAddress & address, quint16 port, quint64 token, Scheduler::Group & group,
+	        QObject * parent = nullptr)
+	    : QObject (parent),
+	      status (Connecting),
+	      token (token),
+	      socket (new QTcpSocket (this)),
+	      receive_task (group,
+	                    [this](const Scheduler::Quantum & q) { return receive_messages (q); }) {
+		setup ();
+		connect (socket, &QAbstractSocket::connected, this, &Stripe::on_socket_connected);
+		socket->connectToHost (address, port);
+	}
+	// Receiver, for a socket after the Join message
+	Stripe (QAbstractSocket * socket_, Handler handler, Scheduler::Group & group,
+	        QObject * parent = nullptr)
+	    : QObject (parent),
+	      status (WaitingForCode),
+	      handler (handler),
+	      socket (socket_),
+	      receive_task (group,
+	                    [this](const Scheduler::Quantum & q) { return receive_messages (q); }) {
+		socket->setParent (this);
+		socket->setReadBufferSize (Const::stripe_read_buffer_size);
+		setup ();
+		resume (); // Data may already be buffered
+	}
+
+	bool is_sending (void) const { return status == Sending; }
+	qint64 write_buffer_size (void) const { return socket->bytesToWrite (); }
+	qint64 read_buffer_size (void) const { return socket->bytesAvailable (); }
+	QDataStream & get_stream (void) { return stream; }
+	QString get_error (void) const { return socket->errorString (); }
+
+	void close (void) {
+		socket->flush ();
+		socket->disconnectFromHost ();
+	}
+	void abort (void) { socket->abort (); }
+
+	void resume (void) {
+		// Continue reading after a stall
+		receive_task.wake ();
+	}
+
+private:
+	void setup (void) {
+		stream.setDevice (socket);
+		stream.setVersion (Const::serializer_version);
+		connect (socket, static_cast<void (QAbstractSocket::*) (QAbstractSocket::SocketError)> (
+		                     &QAbstractSocket::error),
+		         this, &Stripe::on_socket_error);
+		connect (socket, &QAbstractSocket::readyRead, this, [this] { receive_task.wake (); });
+		connect (socket, &QAbstractSocket::bytesWritten, this, &Stripe::data_written);
+	}
+
+	bool receive_message (void) {
+		// Returns true if can continue to receive stuff
+		if (status == WaitingForCode) {
+			if (socket->bytesAvailable () < serialized_info.message_code_size)
+				return false;
+			Message::CodeType code;
+			stream >> code;
+			if (!check_stream ())
+				return false;
+			if (code != Message::Data) {
+				emit failed (QStringLiteral ("Unexpected message in stripe: %1").arg (code, 0, 16));
+				return false;
+			}
+			status = WaitingForSize;
+		}
+		if (status == WaitingForSize) {
+			if (socket->bytesAvailable () < serialized_info.message_size_prefix_size)
+				return false;
+			stream >> next_msg_size;
+			if (!check_stream ())
+				return false;
+			// Stripes only carry chunks: do not buffer more (see Const::stripe_read_buffer_size)
+			if (next_msg_size > serialized_info.sequence_header_size +
+			                        serialized_info.max_chunk_content_size) {
+				emit failed (QStringLiteral ("Message too large in stripe: %1").arg (next_msg_size));
+				return false;
+			}
+			status = WaitingForContent;
+		}
+		if (socket->bytesAvailable () < next_msg_size)
+			return false;
+		status = WaitingForCode;
+		return handler (*this, stream, next_msg_size);
+	}
+	bool check_stream (void) {
+		if (stream.status () == QDataStream::Ok)
+			return true;
+		emit failed (QStringLiteral ("Stripe stream error: %1").arg (stream.status ()));
+		return false;
+	}
+	bool receive_messages (const Scheduler::Quantum & quantum) {
+		// Task: returns true if stopped by the quantum
+		if (status == Connecting || status == Sending) {
+			socket->readAll (); // Ignore receiver handshake
+			return false;
+		}
+		while (receive_message ()) {
+			if (quantum.expired ())
+				return true;
+		}
+		return false;
+	}
+
+private slots:
+	void on_socket_connected (void) {
+		stream << std::tie (Const::protocol_magic, Const::protocol_version)
+		       << Message::Capabilities () << Message::CodeType (Message::Join)
+		       << Message::SizePrefixType (serialized_info.compute_size (token)) << token;
+		status = Sending;
+		emit data_written (); // Can be used
+	}
+	void on_socket_error (void) {
+		// The sender closes stripes at the end of the transfer
+		if (socket->error () != QAbstractSocket::RemoteHostClosedError)
+			emit failed (socket->errorString ());
+	}
+};
+
+/* Transfer state shown to users (see Base::get_summary ()).
+ * Fields that only make sense for some transfers or states are left to their default.
+ */
+struct Summary {
+	int status{0}; // Status enum of the Upload or Download
+	QString error;
+	QString peer_username;
+	QString connection_info;
+	QString payload_name;
+	QString payload_dir_display;
+	QString root_dir;
+	qint64 total_size{0};
+	qint64 total_transfered{0};
+	int nb_files{0};
+	int nb_files_transfered{0};
+	int nb_scanned_files{0}; // Upload, while scanning
+	qint64 transfer_time{0}; // Once complete
+	qint64 average_rate{0};  // Once complete
+};
+
 /* Transfer object base class.
  *
  * This class provides the implementation of protocol primitives.
  * It performs pre-protocol magic+ver verification ("handshake").
+ * The sender waits for the version of the receiver, and answers version 2 to a legacy peer.
  * It will then parse the [code] or [code, size, <serialized content>] stream of messages.
  * Message handlers will be called when a message has been received.
  * Functions to send/receive messages are provided.
  * Includes:
  * - error reporting (calling failure/protocol_error)
  * - notifications for gui/cli (see Notifier)
+ *
+ * Zero-copy sending: if the payload supports it, chunk data is written directly to the socket fd.
+ * The chunk header still goes through the QAbstractSocket buffer, which must be flushed first.
+ * If the socket is full, the rest of the chunk stays pending until the socket is writable.
+ * This is detected by zero_copy_notifier (Qt write notifier is disabled when its buffer is empty).
+ * In both cases on_data_written () is called to resume sending.
+ *
+ * Striping: the sender may open additional connections (Stripe) after the Accept message.
+ * Payload messages (Chunk, Copy, Checksums) are then wrapped in sequenced Data messages.
+ * Chunks go to the connection with the least buffered data, others to the main connection.
+ * The receiver applies them in sequence order: early messages wait in a reorder buffer.
+ * A stripe that is ahead stops being read when the reorder buffer is full (bounded memory).
+ * Zero-copy sending is not used with striping.
+ *
+ * Direct receive (receiver, if has_direct_receive ()): once the data of a Chunk already buffered
+ * by the QAbstractSocket is written, the rest of the chunk is read from the socket fd directly to
+ * the file (mapping or write buffer), without the copy to the socket buffer.
+ * Data only goes through the socket buffer when Qt has read it first (readyRead).
+ * Stripes are not read directly, as their Data messages may have to wait in the reorder buffer.
+ *
+ * Receiver backpressure: during the transfer, the socket read buffer is bounded
+ * (Const::receive_buffer_size, raised to the size of a larger message while it is received).
+ * If files are written slower than data arrives, the socket is not read, TCP flow control stops
+ * the sender, and its send buffer fills up: refill_send_buffer () then waits for it to drain.
+ * Stripes and the reorder buffer are bounded the same way, and files bound their write buffers.
+ * The memory used by received data is recorded by the Notifier.
+ *
+ * Work scheduling: sending and receiving are Tasks (see Scheduler), woken by socket signals.
+ * The Scheduler of the thread runs them in quanta, in turn with the Tasks of other transfers.
+ *
+ * Threads: a transfer may run in a worker thread (see Workers), with its socket and files.
+ * Other threads must then only use get_summary (), which is updated (update_summary ()) by the
+ * transfer thread before emitting the signals telling that it changed: status, progress...
+ * Signals reach objects of other threads through queued connections.
  */
 class Base : public QObject {
 	Q_OBJECT
 
 private:
-	enum Status { WaitingForHandshake, WaitingForCode, WaitingForSize, WaitingForContent };
+	enum Status {
+		WaitingForHandshake,
+		WaitingForVersion,
+		WaitingForCapabilities,
+		WaitingForCode,
+		WaitingForSize,
+		WaitingForContent
+	};
 	Status status{WaitingForHandshake};
 	Message::CodeType next_msg_code;
 	Message::SizePrefixType next_msg_size;
 	QString error;
 	QString connection_info;
+	bool accepted{false};     // Receiver: our handshake answers the sender one
+	bool version_sent{false}; // Our version (and capabilities) has been sent
 
 	QAbstractSocket * socket;
 	QDataStream stream;
+	MessageWriter message_writer;
+
+	qint64 zero_copy_pending{0}; // Chunk data bytes not sent yet
+	QSocketNotifier * zero_copy_notifier{nullptr};
+
+	bool direct_receive{false}; // Receiver: chunk data is read from the socket fd
+	qint64 read_buffer_limit{0}; // Receiver: socket read buffer bound, 0 if none
+
+	// Striping
+	std::vector<Stripe *> stripes;
+	bool striping{false}; // Sender: payload messages are sequenced
+	quint64 next_send_sequence{0};
+	quint64 next_receive_sequence{0};
+	struct Sequenced {
+		Message::Code code;
+		QByteArray content;
+	};
+	std::map<quint64, Sequenced> reorder_buffer; // Early messages, by sequence
+	qint64 reorder_buffer_size{0};
+	std::vector<QPointer<Stripe>> stalled_stripes;
+
+	SendWindow send_window;
+	Payload::CompressionPolicy compression;
+
+	mutable QMutex summary_mutex;
+	Summary summary;
 
 protected:
 	enum FailureMode {
@@ -270,8 +737,13 @@ protected:
 		SendNoticeAndCloseMode // Send Error msg and close gracefully
 	};
 	Payload::Manager payload;
+	Scheduler::Group work_group; // Tasks of this transfer
+	Scheduler::Task receive_task;
 	Notifier notifier;
 	QString peer_username;
+	QString peer_local_source; // Receiver: sender root dir, if same_host
+	bool same_host{false}; // Peer may run on the same host (hint, see Message::Capabilities)
+	bool legacy{false}; // Peer uses Const::legacy_protocol_version
 
 signals:
 	void failed (void);
@@ -281,7 +753,9 @@ public:
 	    : QObject (parent),
 	      socket (socket_),
 	      stream (socket),
-	      notifier (payload),
+	      receive_task (work_group,
+	                    [this](const Scheduler::Quantum & q) { return receive_messages (q); }),
+	      notifier (payload, work_group, this),
 	      peer_username (peer_username) {
 		socket->setParent (this);
 		stream.setVersion (Const::serializer_version);
@@ -289,8 +763,11 @@ public:
 		                     &QAbstractSocket::error),
 		         this, &Base::on_socket_error);
 		connect (socket, &QAbstractSocket::connected, this, &Base::on_socket_connected);
-		connect (socket, &QAbstractSocket::readyRead, this, &Base::on_data_received);
+		connect (socket, &QAbstractSocket::readyRead, this, [this] { receive_task.wake (); });
 		connect (socket, &QAbstractSocket::bytesWritten, this, &Base::on_data_written);
+		connect (&notifier, &Notifier::progressed, this, &Base::update_summary);
+		connect (payload.get_hash_progress (), &Payload::HashProgress::drained, this,
+		         &Base::on_hash_queue_drained);
 	}
 	Base (QAbstractSocket * socket, QObject * parent = nullptr) : Base (socket, QString (), parent) {}
 
@@ -303,44 +780,190 @@ public:
 	const Notifier * get_notifier (void) const { return &notifier; }
 	Notifier * get_notifier (void) { return &notifier; }
 
+	Summary get_summary (void) const {
+		// From any thread
+		QMutexLocker lock (&summary_mutex);
+		return summary;
+	}
+
+	void set_drop_cache (bool enabled) {
+		// Drop transferred file data from the page cache (before the transfer starts)
+		payload.set_drop_cache (enabled);
+	}
+
 private slots:
 	void on_socket_error (void) {
 		failure (tr ("Network error: %1").arg (socket->errorString ()), AbortMode);
 	}
-	void on_data_received (void) {
-		if (status == WaitingForHandshake && !receive_handshake ())
-			return;
-		QElapsedTimer timer;
-		timer.start ();
-		while (receive_message ()) {
-			if (timer.elapsed () > Const::max_work_msec) {
-				// Return to event loop (but schedule this handler again)
-				QTimer::singleShot (0, this, SLOT (on_data_received ()));
-				break;
-			}
-		}
+	void on_stripe_failed (const QString & reason) {
+		failure (tr ("Network error on additional connection: %1").arg (reason), AbortMode);
+	}
+	void on_zero_copy_writable (void) {
+		zero_copy_notifier->setEnabled (false);
+		on_data_written ();
+	}
+	void on_hash_queue_drained (void) {
+		// Receiving stopped while the hashers were behind (see Payload::Manager)
+		for (auto & stripe : stalled_stripes)
+			if (stripe)
+				stripe->resume ();
+		stalled_stripes.clear ();
+		receive_task.wake ();
+	}
+	void attach_work (void) {
+		// After a thread change
+		work_group.attach ();
 	}
 
 protected slots:
 	void on_socket_connected (void) {
-		connection_info =
-		    tr ("%1 on port %2").arg (socket->peerAddress ().toString ()).arg (socket->peerPort ());
-		send_handshake ();
+		update_connection_info ();
+		// Sender: our version follows the peer one (see receive_handshake ())
+		stream << Const::protocol_magic;
+		check_stream ();
 	}
 	virtual void on_data_written (void) {}
 
 protected:
+	void on_socket_accepted (void) {
+		// Receiver: our handshake is an answer (see receive_handshake ())
+		accepted = true;
+		update_connection_info ();
+	}
+	void update_connection_info (void) {
+		connection_info =
+		    tr ("%1 on port %2").arg (socket->peerAddress ().toString ()).arg (socket->peerPort ());
+		update_summary ();
+	}
+
+	bool event (QEvent * event) Q_DECL_OVERRIDE {
+		if (event->type () == QEvent::ThreadChange) {
+			// Woken tasks are run by the Scheduler of the new thread (posted events follow us)
+			work_group.detach ();
+			QMetaObject::invokeMethod (this, "attach_work", Qt::QueuedConnection);
+		}
+		return QObject::event (event);
+	}
+
+	// Summary
+	virtual void fill_summary (Summary & s) const = 0; // Fields of the subclass
+	void update_summary (void) {
+		Summary s;
+		fill_summary (s);
+		s.error = error;
+		s.peer_username = peer_username;
+		s.connection_info = connection_info;
+		s.payload_name = payload.get_payload_name ();
+		s.payload_dir_display = payload.get_payload_dir_display ();
+		s.root_dir = payload.get_root_dir ().path ();
+		s.total_size = payload.get_total_size ();
+		s.total_transfered = payload.get_total_transfered_size ();
+		s.nb_files = payload.get_nb_files ();
+		s.nb_files_transfered = payload.get_nb_files_transfered ();
+		if (payload.is_transfer_complete ()) {
+			s.transfer_time = notifier.get_transfer_time ();
+			s.average_rate = notifier.get_average_rate ();
+		}
+		QMutexLocker lock (&summary_mutex);
+		summary = std::move (s);
+	}
+
 	// Socket management
 
 	void open_connection (const QHostAddress & address, quint16 port) {
 		socket->connectToHost (address, port);
 	}
+	QAbstractSocket * take_socket (void) {
+		// Detach the socket (after a Join message), leaving an unconnected one
+		auto taken = socket;
+		taken->disconnect (this);
+		taken->setParent (nullptr);
+		socket = new QTcpSocket (this);
+		stream.setDevice (socket);
+		return taken;
+	}
 	void close_connection (void) {
 		socket->flush ();
 		socket->disconnectFromHost ();
+		for (auto stripe : stripes)
+			stripe->close ();
 	}
 	qint64 write_buffer_size (void) const { return socket->bytesToWrite (); }
 
+	// Striping
+
+	void open_stripes (const QHostAddress & address, quint16 port, quint64 token, int nb_stripes) {
+		// Sender: payload messages are sequenced from now on
+		striping = true;
+		for (int i = 0; i < nb_stripes; ++i) {
+			auto stripe = new Stripe (address, port, token, work_group, this);
+			connect (stripe, &Stripe::failed, this, &Base::on_stripe_failed);
+			connect (stripe, &Stripe::data_written, this, &Base::on_data_written);
+			stripes.push_back (stripe);
+		}
+	}
+	void attach_stripe (QAbstractSocket * stripe_socket) {
+		// Receiver
+		using namespace std::placeholders;
+		auto stripe = new Stripe (stripe_socket,
+		                          std::bind (&Base::receive_stripe_data, this, _1, _2, _3),
+		                          work_group, this);
+		connect (stripe, &Stripe::failed, this, &Base::on_stripe_failed);
+		stripes.push_back (stripe);
+	}
+	int get_nb_stripes (void) const { return int(stripes.size ()); }
+
+	void enable_direct_receive (void) { direct_receive = has_direct_receive (); }
+
+	void limit_read_buffer (qint64 bytes) {
+		read_buffer_limit = bytes;
+		socket->setReadBufferSize (bytes);
+	}
+	qint64 receive_buffered_size (void) {
+		// Receiver: data received and not yet written to files
+		qint64 buffered = socket->bytesAvailable () + reorder_buffer_size;
+		for (auto stripe : stripes)
+			buffered += stripe->read_buffer_size ();
+		return buffered + payload.get_buffered_size ();
+	}
+
+	// Send buffer sizing (sender)
+
+	void set_send_buffer_budget (qint64 bytes) { send_window.set_budget (bytes); }
+	qint64 buffered_size (void) const {
+		// All connections
+		qint64 buffered = write_buffer_size ();
+		for (auto stripe : stripes)
+			buffered += stripe->write_buffer_size ();
+		return buffered;
+	}
+	void tune_send_window (void) {
+		auto sent = payload.get_total_transfered_size () - buffered_size ();
+		if (send_window.update (sent, socket_rtt_usec (int(socket->socketDescriptor ()))))
+			payload.set_chunk_size (send_window.get_chunk_size ());
+	}
+	// Compression (sender)
+
+	void enable_compression (bool enabled) {
+		compression.set_enabled (enabled && payload.get_compression_algorithm () !=
+		                                        Payload::CompressionAlgorithm::None);
+	}
+	void compression_refill (void) {
+		// Empty send buffers when refilled: the link is faster than the sender
+		compression.refilled (buffered_size () == 0);
+	}
+
+	bool can_send_more (void) const {
+		// Sender: true if a connection can take more data
+		auto limit = qMax (Const::write_buffer_size,
+		                   send_window.get_buffer_size () / qint64 (1 + stripes.size ()));
+		if (striping)
+			for (auto stripe : stripes)
+				if (stripe->is_sending () && stripe->write_buffer_size () < limit)
+					return true;
+		return write_buffer_size () < limit;
+	}
+
 	// Error reporting
 
 	void failure (const QString & reason, FailureMode mode = SendNoticeAndCloseMode) {
@@ -353,8 +976,13 @@ protected:
 		} else {
 			close_connection ();
 		}
+		for (auto stripe : stripes)
+			stripe->abort ();
 		payload.stop_transfer ();
 		notifier.transfer_end ();
+		zero_copy_pending = 0;
+		if (zero_copy_notifier != nullptr)
+			zero_copy_notifier->setEnabled (false);
 		emit failed ();
 	}
 	void protocol_error (const char * details) {
@@ -364,8 +992,9 @@ protected:
 	}
 	void protocol_error (const QString & details) { protocol_error (qUtf8Printable (details)); }
 
-	bool check_stream (void) {
-		switch (stream.status ()) {
+	bool check_stream (void) { return check_stream (stream); }
+	bool check_stream (const QDataStream & checked_stream) {
+		switch (checked_stream.status ()) {
 		case QDataStream::Ok:
 			return true;
 		case QDataStream::ReadPastEnd:
@@ -387,28 +1016,117 @@ protected:
 
 	virtual void on_handshake_completed (void) = 0;
 	// Bool event handlers should return false to stop further processing of messages
-	virtual bool on_receive_accept (void) = 0;
 	virtual bool on_receive_reject (void) = 0;
 	virtual bool on_receive_completed (void) = 0;
+	virtual bool on_receive_list_request (void) = 0;
+	virtual bool on_receive_local_stop (void) = 0;
 	// Event handlers of messages with content are called when content is buffered
+	virtual bool on_receive_accept (void) = 0;
 	virtual bool on_receive_offer (void) = 0;
-	virtual bool on_receive_chunk (void) = 0;
+	virtual bool on_receive_chunk (qint64 size) = 0; // Part of the chunk content
 	virtual bool on_receive_checksums (void) = 0;
+	virtual bool on_receive_retransmit (void) = 0;
+	virtual bool on_receive_block_data (void) = 0;
+	virtual bool on_receive_copy (void) = 0;
+	virtual bool on_receive_compressed_chunk (void) = 0;
+	virtual bool on_receive_file_list (void) = 0;
+	virtual bool on_receive_hole (void) = 0;
+	virtual bool on_receive_join (void) = 0;
+	virtual bool on_receive_local_proof (void) = 0;
+	virtual bool on_receive_local_copy (void) = 0;
+	// Payload message of a Data message (striping), in sequence order
+	virtual bool on_receive_sequenced (Message::Code code, QDataStream & in, qint64 size) = 0;
 
 	// Protocol interaction utilities
 
+	Message::CodeType wire_code (Message::Code code) const {
+		return legacy ? Message::to_legacy_code (code) : code;
+	}
 	bool send_code_message (Message::Code code) {
-		stream << Message::CodeType (code);
+		stream << wire_code (code);
+		return check_stream ();
+	}
+
+	bool send_accept (const Payload::ResumePoint & resume_point, const QBitArray & skipped_files,
+	                  const Payload::SignatureList & signatures, quint64 stripe_token,
+	                  const QString & local_challenge) {
+		return send_content_message (Message::Accept, std::tie (resume_point, skipped_files, signatures,
+		                                                        stripe_token, local_challenge));
+	}
+	bool receive_accept (Payload::ResumePoint & resume_point, quint64 & stripe_token,
+	                     QString & local_challenge) {
+		QBitArray skipped_files;
+		Payload::SignatureList signatures;
+		stream >> resume_point >> skipped_files >> signatures >> stripe_token >> local_challenge;
+		if (!check_stream ())
+			return false;
+		if (!payload.set_skipped_files (skipped_files) ||
+		    !payload.set_delta_signatures (signatures)) {
+			protocol_error (payload.get_last_error ());
+			return false;
+		}
+		return true;
+	}
+
+	bool receive_join (quint64 & token) {
+		stream >> token;
+		return check_stream ();
+	}
+
+	// Local copy (same host)
+
+	static QString local_challenge_prefix (void) {
+		return QStringLiteral (".%1-local-").arg (Const::app_name);
+	}
+	static bool read_local_challenge (const QString & path, QByteArray & proof) {
+		// Sender: only reads challenge files of the temporary dir (the path comes from the peer)
+		QFileInfo info (path);
+		if (!info.isFile () || info.isSymLink () || info.size () != Const::local_challenge_size ||
+		    !info.fileName ().startsWith (local_challenge_prefix ()) ||
+		    info.canonicalPath () != QDir (QDir::tempPath ()).canonicalPath ())
+			return false;
+		QFile file (path);
+		if (!file.open (QIODevice::ReadOnly))
+			return false;
+		proof = file.read (Const::local_challenge_size);
+		return proof.size () == Const::local_challenge_size;
+	}
+	bool send_local_proof (const QByteArray & proof) {
+		return send_content_message (Message::LocalProof, proof);
+	}
+	bool receive_local_proof (QByteArray & proof) {
+		stream >> proof;
 		return check_stream ();
 	}
 
 	bool send_offer (const QString & our_username) {
-		return send_content_message (Message::Offer, std::tie (our_username, payload));
+		if (legacy) {
+			Payload::Manager::LegacyOffer offer (payload);
+			if (!send_content_message (Message::Offer, std::tie (our_username, offer)))
+				return false;
+		} else {
+			// On the same host, the peer may read the files directly from the payload root dir
+			QString local_source;
+			if (same_host)
+				local_source = payload.get_root_dir ().absolutePath ();
+			if (!send_content_message (Message::Offer,
+			                           std::tie (our_username, payload, local_source)))
+				return false;
+		}
+		payload.offer_sent ();
+		return true;
 	}
 	bool receive_offer (void) {
-		stream >> std::tie (peer_username, payload);
+		if (legacy) {
+			Payload::Manager::LegacyOffer offer (payload);
+			stream >> std::tie (peer_username, offer);
+		} else {
+			stream >> std::tie (peer_username, payload, peer_local_source);
+		}
 		if (!check_stream ())
 			return false;
+		if (!same_host)
+			peer_local_source.clear ();
 		if (!payload.validate ()) {
 			failure (tr ("Peer offer is invalid: %1").arg (payload.get_last_error ()), AbortMode);
 			return false;
@@ -416,83 +1134,531 @@ protected:
 		return true;
 	}
 
+	bool send_file_lists (void) {
+		// Streamed offer: files found since the last call, before their chunks
+		while (payload.has_file_batch ())
+			if (!send_payload_message (Message::FileList, payload.take_file_batch ()))
+				return false;
+		return true;
+	}
+	bool receive_file_list (void) { return receive_file_list (stream); }
+	bool receive_file_list (QDataStream & in) {
+		Payload::FileBatch batch;
+		in >> batch;
+		if (!check_stream (in))
+			return false;
+		if (!payload.append_file_batch (batch)) {
+			protocol_error (payload.get_last_error ());
+			return false;
+		}
+		notifier.may_progress ();
+		return true;
+	}
+
 	bool send_next_chunk (void) {
-		auto size = payload.next_chunk_size ();
-		Q_ASSERT (size > 0); // Should not be called if no more chunks
-		Q_ASSERT (size <= Message::max_size);
-		stream << Message::CodeType (Message::Chunk) << Message::SizePrefixType (size);
-		if (!payload.send_next_chunk (stream)) {
+		// Also continues a pending zero-copy chunk
+		if (zero_copy_pending == 0) {
+			Payload::Copy copy;
+			qint64 hole;
+			if (!payload.prepare_next_chunk (copy, hole)) {
+				failure (tr ("Send chunk error: %1").arg (payload.get_last_error ()));
+				return false;
+			}
+			if (hole > 0) {
+				if (!send_payload_message (Message::Hole, hole))
+					return false;
+				payload.send_hole (hole);
+				return end_of_chunk ();
+			}
+			if (copy.size > 0) {
+				if (!send_payload_message (Message::Copy, copy))
+					return false;
+				payload.send_copy (copy);
+				return end_of_chunk ();
+			}
+			if (payload.is_local_copy ())
+				return send_local_copy ();
+			auto size = payload.next_chunk_size ();
+			Q_ASSERT (size > 0); // Should not be called if no more chunks
+			Q_ASSERT (size <= Message::max_size);
+			if (compression.should_compress ())
+				return send_compressed_chunk ();
+			compression.bypassed (size);
+			if (striping || !payload.can_send_zero_copy ())
+				return send_stream_chunk (size);
+			stream << wire_code (Message::Chunk) << Message::SizePrefixType (size);
+			if (!check_stream ())
+				return false;
+			zero_copy_pending = size;
+		}
+		return send_zero_copy_chunk_data ();
+	}
+	bool send_local_copy (void) {
+		// The peer reads the data from our file
+		auto size = payload.prepare_local_copy ();
+		if (size == -1) {
 			failure (tr ("Send chunk error: %1").arg (payload.get_last_error ()));
 			return false;
 		}
-		if (!check_stream ())
+		if (!send_payload_message (Message::LocalCopy, size))
 			return false;
+		payload.send_local_copy (size);
+		return end_of_chunk ();
+	}
+	bool send_pending_checksums (void) {
 		// Send checksums if any
 		auto checksums = payload.take_pending_checksums ();
 		if (!checksums.empty ())
-			return send_content_message (Message::Checksums, checksums);
-		notifier.may_progress ();
+			return send_payload_message (Message::Checksums, checksums);
 		return true;
 	}
-	bool receive_next_chunk (void) {
-		Q_ASSERT (next_msg_size > 0);
-		if (!payload.receive_chunk (stream, next_msg_size)) {
+	template <typename Msg>
+	bool send_payload_message (Message::Code code, const Msg & msg, bool any_connection = false) {
+		// Payload messages are sequenced if striping, on the main connection unless any_connection
+		if (!striping)
+			return send_content_message (code, msg);
+		auto & out = any_connection ? least_loaded_stream () : stream;
+		if (!message_writer.serialize (Message::Data, next_send_sequence++, Message::CodeType (code),
+		                               msg)) {
+			failure (tr ("Message is too large to be sent"));
+			return false;
+		}
+		message_writer.write_to (out);
+		return check_stream (out);
+	}
+	bool zero_copy_blocked (void) const {
+		// If true, the socket is full: wait for on_data_written () before sending more
+		return zero_copy_pending > 0;
+	}
+	bool receive_next_chunk (qint64 size) { return receive_next_chunk (stream, size); }
+	bool receive_next_chunk (QDataStream & in, qint64 size) {
+		Q_ASSERT (size > 0);
+		if (!payload.receive_chunk (in, size)) {
 			failure (tr ("Receive chunk error: %1").arg (payload.get_last_error ()));
 			return false;
 		}
-		if (!check_stream ())
+		if (!check_stream (in))
 			return false;
 		notifier.may_progress ();
 		return true;
 	}
-	bool receive_checksums (void) {
-		Payload::Manager::ChecksumList checksums;
-		stream >> checksums;
-		if (!check_stream ())
+	bool receive_copy (void) { return receive_copy (stream); }
+	bool receive_copy (QDataStream & in) {
+		Payload::Copy copy;
+		in >> copy;
+		if (!check_stream (in))
 			return false;
-		if (!payload.test_checksums (checksums)) {
-			failure (payload.get_last_error ());
+		if (!payload.receive_copy (copy)) {
+			failure (tr ("Receive chunk error: %1").arg (payload.get_last_error ()));
 			return false;
 		}
 		notifier.may_progress ();
 		return true;
 	}
+	bool receive_hole (void) { return receive_hole (stream); }
+	bool receive_hole (QDataStream & in) {
+		qint64 size;
+		in >> size;
+		if (!check_stream (in))
+			return false;
+		if (!payload.receive_hole (size)) {
+			failure (tr ("Receive chunk error: %1").arg (payload.get_last_error ()));
+			return false;
+		}
+		notifier.may_progress ();
+		return true;
+	}
+	bool receive_local_copy (void) { return receive_local_copy (stream); }
+	bool receive_local_copy (QDataStream & in) {
+		qint64 size;
+		in >> size;
+		if (!check_stream (in))
+			return false;
+		if (!payload.is_local_copy ()) {
+			protocol_error ("Local copy without a local source");
+			return false;
+		}
+		if (!payload.receive_local_copy (size)) {
+			failure (tr ("Local copy error: %1").arg (payload.get_last_error ()));
+			return false;
+		}
+		notifier.may_progress ();
+		return true;
+	}
+	bool receive_compressed_chunk (void) { return receive_compressed_chunk (stream); }
+	bool receive_compressed_chunk (QDataStream & in) {
+		quint32 chunk_size;
+		QByteArray data;
+		in >> chunk_size >> data;
+		if (!check_stream (in))
+			return false;
+		if (!payload.receive_compressed_chunk (data.constData (), data.size (), chunk_size)) {
+			failure (tr ("Receive chunk error: %1").arg (payload.get_last_error ()));
+			return false;
+		}
+		notifier.may_progress ();
+		return true;
+	}
+	bool receive_checksums (void) { return receive_checksums (stream); }
+	bool receive_checksums (QDataStream & in) {
+		Payload::Manager::ChecksumList checksums;
+		in >> checksums;
+		if (!check_stream (in))
+			return false;
+		if (!payload.test_checksums (checksums)) {
+			failure (payload.get_last_error ());
+			return false;
+		}
+		notifier.may_progress ();
+		return send_retransmission_requests ();
+	}
+
+	// Block retransmission
 
-private:
-	// Basic message primitives
-
-	bool send_handshake (void) {
-		stream << std::tie (Const::protocol_magic, Const::protocol_version);
+	bool send_retransmission_requests (void) {
+		for (const auto & block : payload.take_retransmission_requests ())
+			if (!send_content_message (Message::Retransmit, block))
+				return false;
+		return true;
+	}
+	bool receive_retransmission_request (Payload::BlockId & block) {
+		stream >> block;
 		return check_stream ();
 	}
-	bool receive_handshake (void) {
-		// Returns true if can continue to receive stuff
-		if (socket->bytesAvailable () < serialized_info.handshake_size)
+	bool send_block_data (const Payload::BlockId & block) {
+		QByteArray data;
+		if (!payload.read_block (block, data)) {
+			failure (tr ("Retransmission error: %1").arg (payload.get_last_error ()));
 			return false;
-		std::remove_const<decltype (Const::protocol_magic)>::type magic;
-		std::remove_const<decltype (Const::protocol_version)>::type version;
-		stream >> std::tie (magic, version);
+		}
+		return send_content_message (Message::BlockData, std::tie (block, data));
+	}
+	bool receive_block_data (void) {
+		Payload::BlockId block;
+		QByteArray data;
+		stream >> block >> data;
 		if (!check_stream ())
 			return false;
-		if (magic != Const::protocol_magic) {
-			protocol_error ("Magic check failed");
+		if (!payload.repair_block (block, data)) {
+			failure (tr ("Receive block error: %1").arg (payload.get_last_error ()));
+			return false;
+		}
+		return send_retransmission_requests ();
+	}
+
+	// Striping (receiver)
+
+	bool receive_sequenced (QDataStream & in, qint64 size, Stripe * stripe) {
+		// Apply a Data message if next in sequence, or keep it for later
+		quint64 sequence;
+		Message::CodeType code;
+		in >> sequence >> code;
+		if (!check_stream (in))
+			return false;
+		auto content_size = size - serialized_info.sequence_header_size;
+		// Chunks are bounded by the chunk limit, other payload messages come on the main connection
+		auto chunk = stripe != nullptr || code == Message::Chunk || code == Message::CompressedChunk;
+		auto max_content_size = chunk ? serialized_info.max_chunk_content_size : Message::max_size;
+		if (sequence < next_receive_sequence || reorder_buffer.count (sequence) > 0 ||
+		    content_size <= 0 || content_size > max_content_size) {
+			protocol_error ("Invalid sequenced message");
 			return false;
 		}
-		if (version != Const::protocol_version) {
-			failure (tr ("Protocol version mismatch: %1 vs %2").arg (version, Const::protocol_version));
+		if (sequence > next_receive_sequence) {
+			QByteArray content (int(content_size), Qt::Uninitialized);
+			if (in.readRawData (content.data (), content.size ()) != content.size ()) {
+				protocol_error ("Unable to buffer sequenced message");
+				return false;
+			}
+			reorder_buffer_size += content_size;
+			reorder_buffer.emplace (sequence, Sequenced{Message::Code (code), content});
+			if (stripe != nullptr && reorder_buffer_size > Const::stripe_reorder_buffer_size) {
+				stalled_stripes.emplace_back (stripe);
+				return false; // Stop reading this stripe until the buffer is applied
+			}
+			return true;
+		}
+		if (!on_receive_sequenced (Message::Code (code), in, content_size))
+			return false;
+		++next_receive_sequence;
+		return apply_reorder_buffer ();
+	}
+
+private:
+	bool receive_chunk_part (void) {
+		// Chunk data is written as it arrives, so that large chunks are not buffered
+		auto size = qMin (socket->bytesAvailable (), qint64 (next_msg_size));
+		if (size > 0) {
+			next_msg_size -= Message::SizePrefixType (size);
+			if (next_msg_size == 0)
+				status = WaitingForCode;
+			if (!on_receive_chunk (size))
+				return false;
+		}
+		if (status == WaitingForContent && direct_receive && payload.can_receive_direct () &&
+		    socket->bytesAvailable () == 0)
+			return receive_chunk_direct ();
+		return status == WaitingForCode; // Else wait for more data
+	}
+	bool receive_chunk_direct (void) {
+		// Rest of the chunk from the socket fd to the file (not copied to the socket buffer)
+		auto received = payload.receive_chunk (int(socket->socketDescriptor ()), next_msg_size);
+		if (received == -1) {
+			failure (tr ("Receive chunk error: %1").arg (payload.get_last_error ()));
 			return false;
 		}
+		next_msg_size -= Message::SizePrefixType (received);
+		if (received > 0)
+			notifier.may_progress ();
+		if (next_msg_size > 0)
+			return false; // Wait for more data (readyRead)
+		status = WaitingForCode;
+		return true;
+	}
+	bool receive_stripe_data (Stripe & stripe, QDataStream & in, qint64 size) {
+		if (!receive_sequenced (in, size, &stripe))
+			return false;
+		notifier.record_buffered_memory (receive_buffered_size ());
+		if (payload.is_hashing_behind ()) {
+			stalled_stripes.emplace_back (&stripe);
+			return false; // Resumed by on_hash_queue_drained ()
+		}
+		return true;
+	}
+	void fit_read_buffer (void) {
+		// A message larger than the bounded read buffer must still be buffered whole
+		auto needed = qint64 (next_msg_size);
+		if (read_buffer_limit > 0 && needed > socket->readBufferSize ())
+			socket->setReadBufferSize (needed);
+	}
+	bool apply_reorder_buffer (void) {
+		for (auto it = reorder_buffer.find (next_receive_sequence); it != reorder_buffer.end ();
+		     it = reorder_buffer.find (next_receive_sequence)) {
+			auto message = std::move (it->second);
+			reorder_buffer.erase (it);
+			reorder_buffer_size -= message.content.size ();
+			QDataStream in (message.content);
+			in.setVersion (Const::serializer_version);
+			if (!on_receive_sequenced (message.code, in, message.content.size ()))
+				return false;
+			++next_receive_sequence;
+		}
+		if (reorder_buffer_size <= Const::stripe_reorder_buffer_size) {
+			for (auto & stripe : stalled_stripes)
+				if (stripe)
+					stripe->resume ();
+			stalled_stripes.clear ();
+		}
+		return true;
+	}
+
+	// Striping (sender)
+
+	QDataStream & least_loaded_stream (void) {
+		auto out = &stream;
+		auto buffered = write_buffer_size ();
+		for (auto stripe : stripes) {
+			if (stripe->is_sending () && stripe->write_buffer_size () < buffered) {
+				out = &stripe->get_stream ();
+				buffered = stripe->write_buffer_size ();
+			}
+		}
+		return *out;
+	}
+	bool send_stream_chunk (qint64 size) {
+		// Chunk data copied to a stream (the least loaded connection if striping)
+		auto & out = least_loaded_stream ();
+		if (striping) {
+			out << Message::CodeType (Message::Data)
+			    << Message::SizePrefixType (serialized_info.sequence_header_size + size)
+			    << next_send_sequence++ << Message::CodeType (Message::Chunk);
+		} else {
+			out << wire_code (Message::Chunk) << Message::SizePrefixType (size);
+		}
+		if (!payload.send_next_chunk (out)) {
+			failure (tr ("Send chunk error: %1").arg (payload.get_last_error ()));
+			return false;
+		}
+		if (!check_stream (out))
+			return false;
+		return end_of_chunk ();
+	}
+	bool send_compressed_chunk (void) {
+		// Sent as a normal chunk if the data does not compress
+		if (!payload.prepare_compressed_chunk ()) {
+			failure (tr ("Send chunk error: %1").arg (payload.get_last_error ()));
+			return false;
+		}
+		auto size = payload.next_chunk_size ();
+		auto compressed_size = payload.compress_next_chunk ();
+		compression.compressed (size, compressed_size > 0 ? compressed_size : size);
+		if (compressed_size < 0)
+			return send_stream_chunk (size);
+		auto chunk_size = quint32 (size);
+		auto data = QByteArray::fromRawData (payload.get_compressed_data (), int(compressed_size));
+		if (!send_payload_message (Message::CompressedChunk, std::tie (chunk_size, data), true))
+			return false;
+		payload.send_compressed_chunk ();
+		return end_of_chunk ();
+	}
+
+	bool send_zero_copy_chunk_data (void) {
+		// Chunk header is buffered by the socket, and must be sent before the data
+		if (write_buffer_size () > 0) {
+			socket->flush ();
+			if (write_buffer_size () > 0)
+				return true; // Wait for bytesWritten ()
+		}
+		if (payload.can_send_zero_copy ()) {
+			auto sent = payload.send_data (int(socket->socketDescriptor ()), zero_copy_pending);
+			if (sent == -1) {
+				failure (tr ("Send chunk error: %1").arg (payload.get_last_error ()));
+				return false;
+			}
+			zero_copy_pending -= sent;
+		}
+		if (zero_copy_pending > 0) {
+			if (payload.can_send_zero_copy ()) {
+				// Socket is full, wait until writable
+				if (zero_copy_notifier == nullptr) {
+					zero_copy_notifier =
+					    new QSocketNotifier (socket->socketDescriptor (), QSocketNotifier::Write, this);
+					connect (zero_copy_notifier, &QSocketNotifier::activated, this,
+					         &Base::on_zero_copy_writable);
+				}
+				zero_copy_notifier->setEnabled (true);
+				return true;
+			}
+			// Zero copy has just been disabled, send the rest through the stream
+			if (!payload.send_data (stream, zero_copy_pending)) {
+				failure (tr ("Send chunk error: %1").arg (payload.get_last_error ()));
+				return false;
+			}
+			zero_copy_pending = 0;
+			if (!check_stream ())
+				return false;
+		}
+		return end_of_chunk ();
+	}
+	bool end_of_chunk (void) {
+		if (!send_pending_checksums ())
+			return false;
+		notifier.may_progress ();
+		return true;
+	}
+
+	// Basic message primitives
+
+	bool send_version (void) {
+		// Receiver: magic first. Sender: magic already sent on connection
+		if (accepted)
+			stream << Const::protocol_magic;
+		if (legacy)
+			stream << Const::legacy_protocol_version;
+		else
+			stream << Const::protocol_version << Message::Capabilities ();
+		version_sent = true;
+		return check_stream ();
+	}
+	bool receive_handshake (void) {
+		/* Returns true if can continue to receive stuff.
+		 * The sender (Upload) only sends its magic, then waits for magic+ver of the receiver.
+		 * The receiver (Download) answers the magic with its own magic+ver, unless the sender
+		 * version is already buffered: a legacy sender sends magic+ver at once.
+		 * Both sides can then answer a legacy peer with version 2, on the same connection.
+		 * A legacy sender whose magic and version arrive separately is answered with our version,
+		 * and fails on it (4 bytes on a fresh connection are not split in practice).
+		 */
+		if (status == WaitingForHandshake) {
+			if (socket->bytesAvailable () < serialized_info.magic_size)
+				return false;
+			std::remove_const<decltype (Const::protocol_magic)>::type magic;
+			stream >> magic;
+			if (!check_stream ())
+				return false;
+			if (magic != Const::protocol_magic) {
+				protocol_error ("Magic check failed");
+				return false;
+			}
+			status = WaitingForVersion;
+		}
+		if (status == WaitingForVersion) {
+			if (socket->bytesAvailable () < serialized_info.version_size) {
+				// Sender waits for our version
+				if (accepted && !version_sent)
+					send_version ();
+				return false;
+			}
+			std::remove_const<decltype (Const::protocol_version)>::type version;
+			stream >> version;
+			if (!check_stream ())
+				return false;
+			if (version == Const::legacy_protocol_version && !version_sent)
+				return start_legacy ();
+			if (version != Const::protocol_version) {
+				failure (tr ("Protocol version mismatch: %1 vs %2")
+				             .arg (version)
+				             .arg (Const::protocol_version));
+				return false;
+			}
+			if (!version_sent && !send_version ())
+				return false;
+			status = WaitingForCapabilities;
+		}
+		// Capabilities of a peer with the same version
+		if (socket->bytesAvailable () < serialized_info.capabilities_size)
+			return false;
+		Message::Capabilities peer_capabilities;
+		stream >> peer_capabilities;
+		if (!check_stream ())
+			return false;
+		payload.set_hash_algorithm (Payload::select_hash_algorithm (peer_capabilities.hash_algorithms));
+		same_host = peer_capabilities.host_id != 0 && peer_capabilities.host_id == host_id ();
+		payload.set_compression_algorithm (
+		    Payload::select_compression_algorithm (peer_capabilities.compression_algorithms));
+		status = WaitingForCode;
+		on_handshake_completed ();
+		return true;
+	}
+	bool start_legacy (void) {
+		// Peer of protocol version 2: no capabilities, whole file MD5 checksums, no compression
+		legacy = true;
+		if (!send_version ())
+			return false;
+		payload.set_hash_algorithm (Payload::HashAlgorithm::Md5);
+		payload.set_compression_algorithm (Payload::CompressionAlgorithm::None);
+		payload.set_legacy_peer (true);
 		status = WaitingForCode;
 		on_handshake_completed ();
 		return true;
 	}
 
 	template <typename Msg> bool send_content_message (Message::Code code, const Msg & msg) {
-		auto size = serialized_info.compute_size (msg);
-		Q_ASSERT (size < Message::max_size);
-		stream << Message::CodeType (code) << Message::SizePrefixType (size) << msg;
+		if (!message_writer.serialize (wire_code (code), msg)) {
+			// Only an offer of a huge payload could reach this
+			failure (tr ("Message is too large to be sent"));
+			return false;
+		}
+		message_writer.write_to (stream);
 		return check_stream ();
 	}
+	bool receive_messages (const Scheduler::Quantum & quantum) {
+		// Task: returns true if stopped by the quantum
+		if (status < WaitingForCode && !receive_handshake ())
+			return false;
+		bool stopped = false;
+		while (receive_message ()) {
+			if (payload.is_hashing_behind ())
+				break; // Woken by on_hash_queue_drained ()
+			if (quantum.expired ()) {
+				stopped = true;
+				break;
+			}
+		}
+		if (read_buffer_limit > 0)
+			notifier.record_buffered_memory (receive_buffered_size ());
+		return stopped;
+	}
 	bool receive_message (void) {
 		// Returns true if can continue to receive stuff
 		if (status == WaitingForCode) {
@@ -501,21 +1667,40 @@ private:
 			stream >> next_msg_code;
 			if (!check_stream ())
 				return false;
+			if (legacy)
+				next_msg_code = Message::from_legacy_code (next_msg_code);
 			switch (next_msg_code) {
+			case Message::Accept:
+				if (legacy)
+					return on_receive_accept (); // No content
+				status = WaitingForSize;
+				break;
 			// After: get size
 			case Message::Error:
 			case Message::Offer:
 			case Message::Chunk:
 			case Message::Checksums:
+			case Message::Retransmit:
+			case Message::BlockData:
+			case Message::Copy:
+			case Message::Join:
+			case Message::Data:
+			case Message::CompressedChunk:
+			case Message::FileList:
+			case Message::Hole:
+			case Message::LocalProof:
+			case Message::LocalCopy:
 				status = WaitingForSize;
 				break;
 			// After : get next message code
-			case Message::Accept:
-				return on_receive_accept ();
 			case Message::Reject:
 				return on_receive_reject ();
 			case Message::Completed:
 				return on_receive_completed ();
+			case Message::ListRequest:
+				return on_receive_list_request ();
+			case Message::LocalStop:
+				return on_receive_local_stop ();
 			default:
 				protocol_error (QString ("Unknown message type: %1").arg (next_msg_code, 0, 16));
 				return false;
@@ -534,8 +1719,14 @@ private:
 			status = WaitingForContent;
 		}
 		if (status == WaitingForContent) {
-			if (socket->bytesAvailable () < next_msg_size)
+			if (next_msg_code == Message::Chunk)
+				return receive_chunk_part ();
+			if (socket->bytesAvailable () < next_msg_size) {
+				fit_read_buffer ();
 				return false;
+			}
+			if (read_buffer_limit > 0 && socket->readBufferSize () != read_buffer_limit)
+				socket->setReadBufferSize (read_buffer_limit);
 			switch (next_msg_code) {
 			case Message::Error: {
 				// After : nothing
@@ -549,12 +1740,42 @@ private:
 			case Message::Offer:
 				status = WaitingForCode;
 				return on_receive_offer ();
-			case Message::Chunk:
+			case Message::Accept:
 				status = WaitingForCode;
-				return on_receive_chunk ();
+				return on_receive_accept ();
 			case Message::Checksums:
 				status = WaitingForCode;
 				return on_receive_checksums ();
+			case Message::Retransmit:
+				status = WaitingForCode;
+				return on_receive_retransmit ();
+			case Message::BlockData:
+				status = WaitingForCode;
+				return on_receive_block_data ();
+			case Message::Copy:
+				status = WaitingForCode;
+				return on_receive_copy ();
+			case Message::Join:
+				status = WaitingForCode;
+				return on_receive_join ();
+			case Message::Data:
+				status = WaitingForCode;
+				return receive_sequenced (stream, next_msg_size, nullptr);
+			case Message::CompressedChunk:
+				status = WaitingForCode;
+				return on_receive_compressed_chunk ();
+			case Message::FileList:
+				status = WaitingForCode;
+				return on_receive_file_list ();
+			case Message::Hole:
+				status = WaitingForCode;
+				return on_receive_hole ();
+			case Message::LocalProof:
+				status = WaitingForCode;
+				return on_receive_local_proof ();
+			case Message::LocalCopy:
+				status = WaitingForCode;
+				return on_receive_local_copy ();
 			default:
 				Q_UNREACHABLE ();
 				return false;
@@ -567,69 +1788,246 @@ private:
 /* Upload class.
  * Split initialization (start), to allow catching files search errors.
  * Can be displayed from the beginning (after start).
+ * Files are scanned in the background (Scanning status), and payload_ready () is emitted after.
+ * connect () can be called while scanning.
+ * If the scan of a directory is still running after the handshake, the offer is streamed:
+ * files found later are sent in file lists during the transfer.
+ * Content hashes need all files: the connection then starts when the scan is finished.
  */
 class Upload : public Base {
 	Q_OBJECT
 
 public:
-	enum Status { Error, Init, Starting, WaitingForPeerAnswer, Transfering, Completed, Rejected };
+	enum Status {
+		Error,
+		Init,
+		Scanning,
+		Starting,
+		WaitingForPeerAnswer,
+		Transfering,
+		Completed,
+		Rejected
+	};
 
 private:
 	const QString our_username;
 	Status status;
+	std::deque<Payload::BlockId> retransmissions; // Requested blocks to send
+	Scheduler::Task send_task;                     // Fills the send buffers
+
+	Payload::Scanner * scanner{nullptr};
+	bool offer_content_hashes{false};
+	int nb_scanned_files{0};
+	bool connect_requested{false};
+	bool offer_pending{false}; // Handshake completed, waiting for the scan
+	Payload::FileHashing * hashing{nullptr}; // Content hashes of the offer, after the scan (child)
+	bool list_requested{false}; // Streamed offer: the peer waits for files before answering
+
+	bool use_compression{false};
+	int nb_connections{1};
+	QHostAddress peer_address;
+	quint16 peer_port{0};
 
 signals:
 	void status_changed (Status new_status, Status old_status);
+	void scan_progressed (void);
+	void payload_ready (void);
 
 public:
 	Upload (const QString & peer_username, const QString & our_username, QObject * parent = nullptr)
-	    : Base (new QTcpSocket, peer_username, parent), our_username (our_username), status (Init) {
+	    : Base (new QTcpSocket, peer_username, parent),
+	      our_username (our_username),
+	      status (Init),
+	      send_task (work_group,
+	                 [this](const Scheduler::Quantum & q) { return refill_send_buffer (q); }) {
 		QObject::connect (this, &Base::failed, [this] { set_status (Error); });
+		QObject::connect (payload.get_hash_progress (), &Payload::HashProgress::drained, this,
+		                  [this] { send_task.wake (); });
+		update_summary ();
 	}
 
-	bool set_payload (const QString & file_path_to_send, bool send_hidden_files) {
+	bool set_payload (const QString & file_path_to_send, bool send_hidden_files,
+	                  bool skip_present_files = false) {
+		// Starts scanning files, returns false if the path is invalid
 		Q_ASSERT (status == Init);
-		if (!payload.from_source_path (file_path_to_send, !send_hidden_files)) {
-			failure (tr ("Cannot get file information: %1").arg (payload.get_last_error ()), AbortMode);
+		scanner = new Payload::Scanner (file_path_to_send, !send_hidden_files, this);
+		if (!scanner->start ()) {
+			failure (tr ("Cannot get file information: %1").arg (scanner->get_error ()), AbortMode);
 			return false;
 		}
+		offer_content_hashes = skip_present_files;
+		QObject::connect (scanner, &Payload::Scanner::progressed, this, &Upload::on_scan_progressed);
+		QObject::connect (scanner, &Payload::Scanner::finished, this, &Upload::on_scan_finished);
+		set_status (Scanning);
 		return true;
 	}
+	void set_connections (int nb) {
+		// Number of parallel connections, if the receiver supports it
+		Q_ASSERT (status == Init || status == Scanning);
+		nb_connections = qBound (1, nb, Const::max_connections);
+	}
+	void set_compression (bool enabled) {
+		// Compress chunks if supported by both peers (stops by itself if not useful)
+		Q_ASSERT (status == Init || status == Scanning);
+		use_compression = enabled;
+	}
+	void set_buffer_budget (qint64 bytes) {
+		// Memory for send buffers, tuned to the connection (fixed small buffers if 0)
+		Q_ASSERT (status == Init || status == Scanning);
+		set_send_buffer_budget (bytes);
+	}
 
 	void connect (const QHostAddress & address, quint16 port) {
-		Q_ASSERT (status == Init);
-		Q_ASSERT (payload.get_type () != Payload::Manager::Invalid);
-		open_connection (address, port);
-		set_status (Starting);
+		Q_ASSERT (status == Scanning || status == Error);
+		if (status != Scanning)
+			return; // Scan failed
+		peer_address = address;
+		peer_port = port;
+		connect_requested = true;
+		if ((scanner == nullptr && hashing == nullptr) || !offer_content_hashes)
+			start_connection ();
 	}
 
 	Status get_status (void) const { return status; }
+	int get_nb_scanned_files (void) const { return nb_scanned_files; }
 
 private:
 	void set_status (Status new_status) {
 		auto old = status;
 		status = new_status;
+		update_summary ();
 		emit status_changed (new_status, old);
 	}
-	bool refill_send_buffer (void) {
-		QElapsedTimer timer;
-		timer.start ();
-		while (write_buffer_size () < Const::write_buffer_size &&
-		       payload.get_total_transfered_size () < payload.get_total_size ()) {
-			if (!send_next_chunk ())
-				return false;
-			if (timer.elapsed () > Const::max_work_msec)
-				return true; // Return to event loop
+	void fill_summary (Summary & s) const Q_DECL_OVERRIDE {
+		s.status = status;
+		s.nb_scanned_files = nb_scanned_files;
+	}
+	bool is_offer_streamed (void) const {
+		return payload.get_type () != Payload::Manager::Invalid && !payload.is_file_list_complete ();
+	}
+	void on_scan_progressed (int nb_files) {
+		nb_scanned_files = nb_files;
+		update_summary ();
+		emit scan_progressed ();
+		if (is_offer_streamed () && status != Error) {
+			if (!payload.append_files (scanner->take_new_files ())) {
+				failure (tr ("Cannot get file information: %1").arg (payload.get_last_error ()),
+				         AbortMode);
+				return;
+			}
+			if (status == Transfering && send_file_lists ())
+				send_task.wake ();
+			else if (status == WaitingForPeerAnswer && list_requested)
+				send_file_lists ();
 		}
-		return true;
+	}
+	void on_scan_finished (void) {
+		bool ok;
+		auto streamed = is_offer_streamed ();
+		if (streamed) {
+			ok = payload.append_files (scanner->take_new_files ()) && payload.complete_file_list ();
+		} else {
+			ok = payload.from_scan (*scanner);
+		}
+		scanner->deleteLater ();
+		scanner = nullptr;
+		if (status == Error)
+			return; // Failed while scanning
+		if (!ok) {
+			failure (tr ("Cannot get file information: %1").arg (payload.get_last_error ()), AbortMode);
+			return;
+		}
+		if (!streamed && offer_content_hashes) {
+			// The offer is ready when content hashes are (see on_hashing_finished ())
+			hashing = payload.compute_content_hashes (this);
+			QObject::connect (hashing, &Payload::FileHashing::finished, this,
+			                  &Upload::on_hashing_finished);
+			return;
+		}
+		payload_ready_to_offer (streamed);
+	}
+	void on_hashing_finished (void) {
+		payload.take_content_hashes (*hashing);
+		hashing->deleteLater ();
+		hashing = nullptr;
+		if (status != Error)
+			payload_ready_to_offer (false);
+	}
+	void payload_ready_to_offer (bool streamed) {
+		update_summary ();
+		emit payload_ready ();
+		if (streamed) {
+			// Last file list, then checksums of the last files if all data has been sent
+			if (status == Transfering && send_file_lists () && send_pending_checksums ())
+				send_task.wake ();
+			else if (status == WaitingForPeerAnswer && list_requested)
+				send_file_lists ();
+		} else if (offer_pending) {
+			offer_pending = false;
+			if (send_offer (our_username))
+				set_status (WaitingForPeerAnswer);
+		} else if (status == Scanning && connect_requested) {
+			start_connection ();
+		}
+	}
+	void start_connection (void) {
+		open_connection (peer_address, peer_port);
+		set_status (Starting);
+	}
+	bool refill_send_buffer (const Scheduler::Quantum & quantum) {
+		// Task: returns true if stopped by the quantum
+		if (status != Transfering)
+			return false;
+		tune_send_window ();
+		while (can_send_more ()) {
+			if (!zero_copy_blocked () && !retransmissions.empty ()) {
+				// Retransmissions first, but not in the middle of a chunk
+				if (!send_block_data (retransmissions.front ()))
+					return false;
+				retransmissions.pop_front ();
+			} else if (payload.get_total_transfered_size () < payload.get_total_size ()) {
+				if (!payload.is_next_data_ready ())
+					return false; // Wait for file reads (see connect_async_io ())
+				if (payload.is_hashing_behind ())
+					return false; // Woken by HashProgress::drained ()
+				if (!send_next_chunk ())
+					return false;
+				if (zero_copy_blocked ())
+					return false; // Wait for socket
+			} else {
+				return false; // Nothing to send
+			}
+			if (quantum.expired ())
+				return true;
+		}
+		return false;
+	}
+	void connect_async_io (void) {
+		// Data read ahead of the socket is sent when the read completes
+		if (auto io = payload.get_async_io ())
+			QObject::connect (io, &Payload::AsyncIo::completed, this, [this] { send_task.wake (); });
 	}
 	void on_data_written (void) Q_DECL_OVERRIDE {
-		if (status == Transfering)
-			refill_send_buffer ();
+		if (status == Transfering) {
+			compression_refill ();
+			send_task.wake ();
+		}
 	}
 
 	void on_handshake_completed (void) Q_DECL_OVERRIDE {
 		Q_ASSERT (status == Starting);
+		if (scanner != nullptr) {
+			if (scanner->get_payload_root () == "." || legacy) {
+				// Single file, or a legacy peer (not streamed): sent by on_scan_finished ()
+				offer_pending = true;
+				return;
+			}
+			if (!payload.start_file_list (*scanner)) {
+				failure (tr ("Cannot get file information: %1").arg (payload.get_last_error ()),
+				         AbortMode);
+				return;
+			}
+		}
 		if (send_offer (our_username))
 			set_status (WaitingForPeerAnswer);
 	}
@@ -638,10 +2036,41 @@ private:
 			protocol_error ("Accept when not WaitingForPeerAnswer");
 			return false;
 		}
-		payload.start_transfer (Payload::Manager::Sending);
+		Payload::ResumePoint resume_point;
+		quint64 stripe_token = 0;
+		QString local_challenge;
+		// The Accept of a legacy peer has no content
+		if (!legacy && !receive_accept (resume_point, stripe_token, local_challenge))
+			return false;
+		if (!payload.start_transfer (Payload::Manager::Sending, resume_point)) {
+			failure (tr ("Unable to start transfer: %1").arg (payload.get_last_error ()));
+			return false;
+		}
+		// Same host: the peer reads the data from our files if we can read its challenge file
+		// (not if the peer has already completed, with all files present)
+		QByteArray local_proof;
+		auto data_left = payload.get_total_transfered_size () < payload.get_total_size () ||
+		                 !payload.is_file_list_complete ();
+		if (same_host && data_left && !local_challenge.isEmpty () &&
+		    read_local_challenge (local_challenge, local_proof)) {
+			if (!send_local_proof (local_proof))
+				return false;
+			payload.set_local_copy (true);
+		}
+		if (stripe_token != 0 && nb_connections > 1)
+			open_stripes (peer_address, peer_port, stripe_token, nb_connections - 1);
+		connect_async_io ();
+		enable_compression (use_compression);
 		notifier.transfer_start ();
 		set_status (Transfering);
-		return refill_send_buffer ();
+		// Files found while waiting for the answer, if streamed
+		if (!send_file_lists ())
+			return false;
+		// Resuming may leave the checksum of a complete file to send
+		if (!send_pending_checksums ())
+			return false;
+		send_task.wake ();
+		return true;
 	}
 	bool on_receive_reject (void) Q_DECL_OVERRIDE {
 		if (status != WaitingForPeerAnswer) {
@@ -652,6 +2081,25 @@ private:
 		set_status (Rejected);
 		return false;
 	}
+	bool on_receive_list_request (void) Q_DECL_OVERRIDE {
+		if (status != WaitingForPeerAnswer || !is_offer_streamed ()) {
+			protocol_error ("List request when not WaitingForPeerAnswer with a streamed offer");
+			return false;
+		}
+		// Files found until now, then as the scan progresses (see on_scan_progressed ())
+		list_requested = true;
+		return send_file_lists ();
+	}
+	bool on_receive_local_stop (void) Q_DECL_OVERRIDE {
+		if (status != Transfering) {
+			protocol_error ("Local stop when not Transfering");
+			return false;
+		}
+		// The rest is sent as chunks (the payload is Closed if all data was already sent)
+		if (payload.is_local_copy ())
+			payload.set_local_copy (false);
+		return true;
+	}
 	bool on_receive_completed (void) Q_DECL_OVERRIDE {
 		if (status != Transfering) {
 			protocol_error ("Completed when not Transfering");
@@ -670,7 +2118,7 @@ private:
 		protocol_error ("Offer in Upload");
 		return false;
 	}
-	bool on_receive_chunk (void) Q_DECL_OVERRIDE {
+	bool on_receive_chunk (qint64) Q_DECL_OVERRIDE {
 		protocol_error ("Chunk in Upload");
 		return false;
 	}
@@ -678,12 +2126,64 @@ private:
 		protocol_error ("Checksums in Upload");
 		return false;
 	}
+	bool on_receive_retransmit (void) Q_DECL_OVERRIDE {
+		if (status != Transfering) {
+			protocol_error ("Retransmit when not Transfering");
+			return false;
+		}
+		Payload::BlockId block;
+		if (!receive_retransmission_request (block))
+			return false;
+		retransmissions.push_back (block);
+		send_task.wake ();
+		return true;
+	}
+	bool on_receive_block_data (void) Q_DECL_OVERRIDE {
+		protocol_error ("Block data in Upload");
+		return false;
+	}
+	bool on_receive_copy (void) Q_DECL_OVERRIDE {
+		protocol_error ("Copy in Upload");
+		return false;
+	}
+	bool on_receive_compressed_chunk (void) Q_DECL_OVERRIDE {
+		protocol_error ("Compressed chunk in Upload");
+		return false;
+	}
+	bool on_receive_file_list (void) Q_DECL_OVERRIDE {
+		protocol_error ("File list in Upload");
+		return false;
+	}
+	bool on_receive_hole (void) Q_DECL_OVERRIDE {
+		protocol_error ("Hole in Upload");
+		return false;
+	}
+	bool on_receive_join (void) Q_DECL_OVERRIDE {
+		protocol_error ("Join in Upload");
+		return false;
+	}
+	bool on_receive_local_proof (void) Q_DECL_OVERRIDE {
+		protocol_error ("Local proof in Upload");
+		return false;
+	}
+	bool on_receive_local_copy (void) Q_DECL_OVERRIDE {
+		protocol_error ("Local copy in Upload");
+		return false;
+	}
+	bool on_receive_sequenced (Message::Code, QDataStream &, qint64) Q_DECL_OVERRIDE {
+		protocol_error ("Data in Upload");
+		return false;
+	}
 };
 
 /* Download class.
  * Cannot be displayed at first due to incomplete data.
  * Can be displayed when status goes to WaitingForUserChoice.
  * Automatic download should be supported externally.
+ *
+ * Additional connections of the sender (stripes) start as Downloads of the Server, which give
+ * their socket to the Download with the token of their Join message (see join_stripe ()).
+ * Accepted Downloads are registered by token, so that this works with Downloads of any thread.
  */
 class Download : public Base {
 	Q_OBJECT
@@ -702,15 +2202,45 @@ public:
 
 private:
 	Status status;
+	bool delta_enabled{false};
+	bool accept_pending{false}; // Accepted, waiting for files of the resume journal or hashing
+	Payload::FileHashing * hashing{nullptr}; // Present files and delta basis (child)
+	Payload::ResumePoint accepted_resume_point;
+	bool accepted_local_copy{false}; // The offer has a local source: challenge the sender
+	quint64 stripe_token{0}; // Identifies additional connections of the sender
+	std::unique_ptr<QTemporaryFile> local_challenge; // Until the local proof
+	QByteArray local_challenge_data;
+	bool local_stop_sent{false};
+
+	// Accepted downloads by stripe token, shared by all threads
+	struct StripeRegistry {
+		QMutex mutex;
+		std::map<quint64, Download *> downloads;
+	};
+	static StripeRegistry & stripe_registry (void) {
+		static StripeRegistry registry;
+		return registry;
+	}
 
 signals:
 	void status_changed (Status new_status, Status old_status);
+	void join_requested (quint64 token); // This connection is a stripe of another Download
 
 public:
 	Download (QAbstractSocket * socket, QObject * parent = nullptr)
 	    : Base (socket, parent), status (Starting) {
-		on_socket_connected ();
-		connect (this, &Base::failed, [this] { set_status (Error); });
+		on_socket_accepted ();
+		connect (this, &Base::failed, [this] {
+			local_challenge.reset ();
+			set_status (Error);
+		});
+	}
+	~Download () {
+		if (stripe_token != 0) {
+			auto & registry = stripe_registry ();
+			QMutexLocker lock (&registry.mutex);
+			registry.downloads.erase (stripe_token);
+		}
 	}
 
 	Status get_status (void) const { return status; }
@@ -718,28 +2248,158 @@ public:
 	void set_target_dir (const QString & path) {
 		Q_ASSERT (status == WaitingForUserChoice);
 		payload.set_root_dir (path);
+		update_summary ();
+	}
+	void set_delta (bool enabled) {
+		// Reuse data of existing files in the target dir (the sender only sends differences)
+		Q_ASSERT (status == WaitingForUserChoice);
+		delta_enabled = enabled;
+	}
+	static bool join_stripe (quint64 token, Download & joining) {
+		// Gives the connection of joining to the Download with this token (from joining thread)
+		auto & registry = stripe_registry ();
+		QMutexLocker lock (&registry.mutex); // The target cannot be destroyed meanwhile
+		auto it = registry.downloads.find (token);
+		if (token == 0 || it == registry.downloads.end ())
+			return false;
+		auto target = it->second;
+		auto socket = joining.take_socket ();
+		if (target->thread () == joining.thread ()) {
+			target->add_stripe (socket);
+		} else {
+			socket->moveToThread (target->thread ());
+			QMetaObject::invokeMethod (target, "add_stripe", Qt::QueuedConnection,
+			                           Q_ARG (QAbstractSocket *, socket));
+		}
+		return true;
 	}
 	void give_user_choice (UserChoice choice) {
 		Q_ASSERT (status == WaitingForUserChoice);
 		if (choice == Accept) {
-			if (!send_code_message (Message::Accept))
+			if (accept_pending)
 				return;
-			payload.start_transfer (Payload::Manager::Receiving);
-			notifier.transfer_start ();
-			set_status (Transfering);
+			if (!legacy && !payload.can_load_resume_point ()) {
+				// Accept when the files of the journal are known (see on_receive_file_list ())
+				if (send_code_message (Message::ListRequest))
+					accept_pending = true;
+				return;
+			}
+			if (legacy) {
+				// A legacy peer cannot resume, skip nor use a basis (its Accept has no content)
+				start_transfer (Payload::ResumePoint (), QBitArray (), Payload::SignatureList ());
+				return;
+			}
+			// Accept when present files and the basis are hashed (see on_hashing_finished ())
+			accept_pending = true;
+			accepted_resume_point = payload.load_resume_point ();
+			accepted_local_copy = !peer_local_source.isEmpty ();
+			hashing = payload.hash_local_files (accepted_resume_point,
+			                                    delta_enabled && !accepted_local_copy, this);
+			connect (hashing, &Payload::FileHashing::finished, this, &Download::on_hashing_finished);
 		} else {
+			delete hashing; // Cancelled
+			hashing = nullptr;
 			send_code_message (Message::Reject);
 			close_connection ();
 			set_status (Rejected);
 		}
 	}
 
+public slots:
+	// Queued calls from other threads: the transfer may have changed meanwhile
+	void accept (void) {
+		if (status == WaitingForUserChoice)
+			give_user_choice (Accept);
+	}
+	void add_stripe (QAbstractSocket * stripe_socket) {
+		// See join_stripe ()
+		if (status != Transfering || get_nb_stripes () + 1 >= Const::max_connections) {
+			delete stripe_socket;
+			return;
+		}
+		attach_stripe (stripe_socket);
+	}
+
 private:
 	void set_status (Status new_status) {
 		auto old = status;
 		status = new_status;
+		update_summary ();
 		emit status_changed (new_status, old);
 	}
+	void fill_summary (Summary & s) const Q_DECL_OVERRIDE { s.status = status; }
+
+	void on_hashing_finished (void) {
+		auto skipped_files = payload.take_present_files (*hashing);
+		auto signatures = payload.take_basis_signatures (*hashing);
+		hashing->deleteLater ();
+		hashing = nullptr;
+		accept_pending = false;
+		if (status != WaitingForUserChoice)
+			return; // Failed meanwhile
+		start_transfer (accepted_resume_point, skipped_files, signatures);
+	}
+	void start_transfer (const Payload::ResumePoint & resume_point,
+	                     const QBitArray & skipped_files,
+	                     const Payload::SignatureList & signatures) {
+		// A local copy is only used after the local proof, on this connection (no stripes)
+		QString challenge_path;
+		if (accepted_local_copy && create_local_challenge ()) {
+			challenge_path = local_challenge->fileName ();
+		} else if (!legacy) {
+			std::random_device seed;
+			std::mt19937_64 generator (seed ());
+			do {
+				stripe_token = generator ();
+			} while (stripe_token == 0); // 0 means no striping
+			auto & registry = stripe_registry ();
+			QMutexLocker lock (&registry.mutex);
+			registry.downloads.emplace (stripe_token, this);
+		}
+		if (legacy ? !send_code_message (Message::Accept)
+		           : !send_accept (resume_point, skipped_files, signatures, stripe_token,
+		                           challenge_path))
+			return;
+		if (!payload.start_transfer (Payload::Manager::Receiving, resume_point)) {
+			failure (tr ("Unable to start transfer: %1").arg (payload.get_last_error ()));
+			return;
+		}
+		enable_direct_receive ();
+		limit_read_buffer (Const::receive_buffer_size);
+		notifier.transfer_start ();
+		set_status (Transfering);
+		check_completed (); // If all files are present
+	}
+
+	bool create_local_challenge (void) {
+		// Random data in a file that only our user can read (0600): a sender that reads it is on
+		// this host, and can read what we can (so we may read its files)
+		local_challenge.reset (new QTemporaryFile (
+		    QDir (QDir::tempPath ()).filePath (local_challenge_prefix () + "XXXXXX")));
+		std::random_device random;
+		local_challenge_data.clear ();
+		while (local_challenge_data.size () < Const::local_challenge_size) {
+			auto value = quint32 (random ());
+			local_challenge_data.append (reinterpret_cast<const char *> (&value), sizeof (value));
+		}
+		local_challenge_data.resize (Const::local_challenge_size);
+		if (!local_challenge->open () ||
+		    local_challenge->write (local_challenge_data) != local_challenge_data.size () ||
+		    !local_challenge->flush ()) {
+			qWarning ("Unable to create local challenge: %s",
+			          qUtf8Printable (local_challenge->errorString ()));
+			local_challenge.reset ();
+			return false;
+		}
+		return true;
+	}
+	bool check_local_source (void) {
+		// Falls back to chunks for the rest if the sender files are missing, or differ
+		if (!payload.is_local_copy () || !payload.has_local_source_failed () || local_stop_sent)
+			return true;
+		local_stop_sent = true;
+		return send_code_message (Message::LocalStop);
+	}
 
 	void on_handshake_completed (void) Q_DECL_OVERRIDE {
 		Q_ASSERT (status == Starting);
@@ -757,6 +2417,14 @@ private:
 		protocol_error ("Completed in Download");
 		return false;
 	}
+	bool on_receive_list_request (void) Q_DECL_OVERRIDE {
+		protocol_error ("List request in Download");
+		return false;
+	}
+	bool on_receive_local_stop (void) Q_DECL_OVERRIDE {
+		protocol_error ("Local stop in Download");
+		return false;
+	}
 	bool on_receive_offer (void) Q_DECL_OVERRIDE {
 		if (status != WaitingForOffer) {
 			protocol_error ("Offer msg while not WaitingForOffer");
@@ -767,21 +2435,144 @@ private:
 		set_status (WaitingForUserChoice);
 		return true;
 	}
-	bool on_receive_chunk (void) Q_DECL_OVERRIDE {
+	bool on_receive_chunk (qint64 size) Q_DECL_OVERRIDE {
 		if (status != Transfering) {
 			protocol_error ("Chunk while not Transfering");
 			return false;
 		}
-		return receive_next_chunk ();
+		return receive_next_chunk (size);
 	}
 	bool on_receive_checksums (void) Q_DECL_OVERRIDE {
 		if (status != Transfering) {
 			protocol_error ("Checksums while not Transfering");
 			return false;
 		}
-		if (!receive_checksums ())
+		if (!receive_checksums () || !check_local_source ())
+			return false;
+		return check_completed ();
+	}
+	bool on_receive_retransmit (void) Q_DECL_OVERRIDE {
+		protocol_error ("Retransmit in Download");
+		return false;
+	}
+	bool on_receive_block_data (void) Q_DECL_OVERRIDE {
+		if (status != Transfering) {
+			protocol_error ("Block data while not Transfering");
+			return false;
+		}
+		if (!receive_block_data ())
+			return false;
+		return check_completed ();
+	}
+	bool on_receive_copy (void) Q_DECL_OVERRIDE {
+		if (status != Transfering) {
+			protocol_error ("Copy while not Transfering");
+			return false;
+		}
+		return receive_copy ();
+	}
+	bool on_receive_compressed_chunk (void) Q_DECL_OVERRIDE {
+		if (status != Transfering) {
+			protocol_error ("Compressed chunk while not Transfering");
 			return false;
+		}
+		return receive_compressed_chunk ();
+	}
+	bool on_receive_hole (void) Q_DECL_OVERRIDE {
+		if (status != Transfering) {
+			protocol_error ("Hole while not Transfering");
+			return false;
+		}
+		return receive_hole ();
+	}
+	bool on_receive_file_list (void) Q_DECL_OVERRIDE {
+		if (status == WaitingForUserChoice && accept_pending) {
+			if (!receive_file_list ())
+				return false;
+			if (hashing == nullptr && payload.can_load_resume_point ()) {
+				accept_pending = false;
+				give_user_choice (Accept);
+			}
+			return status == WaitingForUserChoice || status == Transfering;
+		}
+		if (status != Transfering) {
+			protocol_error ("File list while not Transfering");
+			return false;
+		}
+		if (!receive_file_list ())
+			return false;
+		return check_completed ();
+	}
+	bool on_receive_join (void) Q_DECL_OVERRIDE {
+		if (status != WaitingForOffer) {
+			protocol_error ("Join msg while not WaitingForOffer");
+			return false;
+		}
+		quint64 token;
+		if (!receive_join (token))
+			return false;
+		emit join_requested (token);
+		return false; // The socket may have been taken
+	}
+	bool on_receive_local_proof (void) Q_DECL_OVERRIDE {
+		if (status != Transfering) {
+			protocol_error ("Local proof while not Transfering");
+			return false;
+		}
+		QByteArray proof;
+		if (!receive_local_proof (proof))
+			return false;
+		if (local_challenge == nullptr || proof != local_challenge_data) {
+			protocol_error ("Invalid local proof");
+			return false;
+		}
+		local_challenge.reset (); // Removes the file
+		payload.set_local_source (peer_local_source);
+		return check_local_source ();
+	}
+	bool on_receive_local_copy (void) Q_DECL_OVERRIDE {
+		if (status != Transfering) {
+			protocol_error ("Local copy while not Transfering");
+			return false;
+		}
+		if (!receive_local_copy ())
+			return false;
+		return check_local_source ();
+	}
+	bool on_receive_sequenced (Message::Code code, QDataStream & in,
+	                           qint64 size) Q_DECL_OVERRIDE {
+		if (status != Transfering) {
+			protocol_error ("Data while not Transfering");
+			return false;
+		}
+		switch (code) {
+		case Message::Chunk:
+			return receive_next_chunk (in, size);
+		case Message::Copy:
+			return receive_copy (in);
+		case Message::CompressedChunk:
+			return receive_compressed_chunk (in);
+		case Message::FileList:
+			if (!receive_file_list (in))
+				return false;
+			return check_completed ();
+		case Message::Hole:
+			return receive_hole (in);
+		case Message::LocalCopy:
+			return receive_local_copy (in) && check_local_source ();
+		case Message::Checksums:
+			if (!receive_checksums (in) || !check_local_source ())
+				return false;
+			return check_completed ();
+		default:
+			protocol_error ("Invalid code in Data msg");
+			return false;
+		}
+	}
+
+	bool check_completed (void) {
 		if (payload.is_transfer_complete ()) {
+			local_challenge.reset (); // Unanswered
 			if (!send_code_message (Message::Completed))
 				return false;
 			notifier.transfer_end ();
@@ -793,4 +2584,8 @@ private:
 };
 }
 
+// Status signals may be queued (see Workers)
+Q_DECLARE_METATYPE (Transfer::Upload::Status)
+Q_DECLARE_METATYPE (Transfer::Download::Status)
+
 #endif
@@ -0,0 +1,105 @@
+/* Localshare - Small file sharing application for the local network.
+ * Copyright (C) 2016 Francois Gindraud
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CORE_WORKERS_H
+#define CORE_WORKERS_H
+
+#include <QMetaObject>
+#include <QObject>
+#include <QThread>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+#include "core_localshare.h"
+#include "core_transfer.h"
+
+namespace Transfer {
+
+/* Owner of the transfers of a worker thread (see Workers).
+ * It lives in its thread, and deletes the remaining transfers there when the thread finishes.
+ */
+class Worker : public QObject {
+	Q_OBJECT
+
+public slots:
+	void take (QObject * transfer) { transfer->setParent (this); }
+};
+
+/* Worker threads running transfers, so that they do not run on the GUI thread.
+ *
+ * Each thread runs its own event loop and Scheduler, for the transfers it has been given.
+ * adopt () moves a transfer, with its socket, stripes and timers, to the thread with the fewest
+ * transfers. The GUI does it when the heavy work starts: when an Upload is asked to connect, or
+ * when a Download is accepted.
+ * The transfer must then only be used with queued calls and get_summary () (see Base).
+ * It can be deleted from any thread with deleteLater (), or is deleted when the threads stop.
+ * Hashing and scanning still use their own thread pools.
+ *
+ * The destructor stops the threads and waits for them.
+ */
+class Workers : public QObject {
+	Q_OBJECT
+
+private:
+	std::vector<QThread *> threads;
+	std::vector<Worker *> workers; // Living in threads
+	std::vector<int> nb_transfers;
+
+public:
+	Workers (QObject * parent = nullptr) : QObject (parent) {
+		// Types of queued signals and calls
+		qRegisterMetaType<Upload::Status> ();
+		qRegisterMetaType<Download::Status> ();
+		qRegisterMetaType<QAbstractSocket *> ();
+
+		auto nb_threads = qBound (1, QThread::idealThreadCount (), Const::max_transfer_threads);
+		for (int i = 0; i < nb_threads; ++i) {
+			auto thread = new QThread (this);
+			auto worker = new Worker;
+			worker->moveToThread (thread);
+			connect (thread, &QThread::finished, worker, &QObject::deleteLater);
+			thread->start ();
+			threads.push_back (thread);
+			workers.push_back (worker);
+			nb_transfers.push_back (0);
+		}
+	}
+	~Workers () {
+		for (auto thread : threads)
+			thread->quit ();
+		for (auto thread : threads)
+			thread->wait ();
+	}
+
+	void adopt (Base * transfer) {
+		// From the thread of transfer, which must not have a parent
+		if (transfer->thread () != thread ())
+			return; // Already adopted
+		Q_ASSERT (transfer->parent () == nullptr);
+		auto i = std::distance (nb_transfers.begin (),
+		                        std::min_element (nb_transfers.begin (), nb_transfers.end ()));
+		++nb_transfers[i];
+		connect (transfer, &QObject::destroyed, this, [this, i] { --nb_transfers[i]; });
+		transfer->moveToThread (threads[i]);
+		QMetaObject::invokeMethod (workers[i], "take", Qt::QueuedConnection,
+		                           Q_ARG (QObject *, transfer));
+	}
+};
+}
+
+#endif
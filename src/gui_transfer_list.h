@@ -21,6 +21,7 @@
 #include <QApplication>
 #include <QFlags>
 #include <QHeaderView>
+#include <QPointer>
 #include <QStyle>
 #include <QStyleOptionProgressBar>
 #include <QStyledItemDelegate>
@@ -40,6 +41,9 @@ namespace TransferList {
 	 * It will take ownership of a transfer object.
 	 * This object is used as a Transfer::Base to show common stuff.
 	 * It also manages the delete button.
+	 *
+	 * The transfer may run in a worker thread (see Transfer::Workers): it is not a child of the
+	 * item, and its state is read from its summary (updated before its signals).
 	 */
 	class Item : public StructItem {
 		Q_OBJECT
@@ -69,16 +73,24 @@ namespace TransferList {
 
 	private:
 		QString rate;
-		Transfer::Base * base;
-		const Payload::Manager & payload;
+		QPointer<Transfer::Base> base;
 
 	public:
 		Item (Transfer::Base * transfer, QObject * parent = nullptr)
-		    : StructItem (NbFields, parent), base (transfer), payload (transfer->get_payload ()) {
-			base->setParent (this);
+		    : StructItem (NbFields, parent), base (transfer) {
+			base->setParent (nullptr); // Can be moved to a worker thread
 			connect (base->get_notifier (), &Transfer::Notifier::instant_rate, this, &Item::set_rate);
 			connect (base->get_notifier (), &Transfer::Notifier::progressed, this, &Item::progressed);
 		}
+		~Item () {
+			// A transfer moved to a worker thread is deleted by that thread
+			if (base && base->thread () == thread ())
+				delete base.data ();
+			else if (base)
+				base->deleteLater ();
+		}
+
+		Transfer::Summary get_summary (void) const { return base->get_summary (); }
 
 		QVariant data (int field, int role) const Q_DECL_OVERRIDE {
 			switch (field) {
@@ -86,43 +98,45 @@ namespace TransferList {
 				// Transfer name, (in subclass:) local path, transfer type icon.
 				switch (role) {
 				case Qt::DisplayRole:
-					return payload.get_payload_name ();
+					return get_summary ().payload_name;
 				}
 			} break;
 			case PeerField: {
 				// Peer username, network info.
 				switch (role) {
 				case Qt::DisplayRole:
-					return base->get_peer_username ();
+					return get_summary ().peer_username;
 				case Qt::StatusTipRole:
 				case Qt::ToolTipRole:
-					return base->get_connection_info ();
+					return get_summary ().connection_info;
 				}
 			} break;
 			case SizeField: {
 				// Transfer size (human readable and detailed).
+				auto summary = get_summary ();
 				switch (role) {
 				case Qt::DisplayRole:
-					return size_to_string (payload.get_total_size ());
+					return size_to_string (summary.total_size);
 				case Qt::StatusTipRole:
 				case Qt::ToolTipRole:
-					return tr ("%1B in %2 files")
-					    .arg (payload.get_total_size ())
-					    .arg (payload.get_nb_files ());
+					return tr ("%1B in %2 files").arg (summary.total_size).arg (summary.nb_files);
 				}
 			} break;
 			case ProgressField: {
 				// Progress bar, and details.
+				auto summary = get_summary ();
 				switch (role) {
 				case Qt::DisplayRole:
-					return int((100 * payload.get_total_transfered_size ()) / payload.get_total_size ());
+					if (summary.total_size == 0)
+						return 0; // Empty, or files not scanned yet
+					return int((100 * summary.total_transfered) / summary.total_size);
 				case Qt::StatusTipRole:
 				case Qt::ToolTipRole:
 					return tr ("%1/%2 (files: %3/%4)")
-					    .arg (size_to_string (payload.get_total_transfered_size ()),
-					          size_to_string (payload.get_total_size ()))
-					    .arg (payload.get_nb_files_transfered ())
-					    .arg (payload.get_nb_files ());
+					    .arg (size_to_string (summary.total_transfered),
+					          size_to_string (summary.total_size))
+					    .arg (summary.nb_files_transfered)
+					    .arg (summary.nb_files);
 				}
 			} break;
 			case RateField: {
@@ -141,7 +155,7 @@ namespace TransferList {
 		QVariant compare_data (int field) const Q_DECL_OVERRIDE {
 			switch (field) {
 			case SizeField:
-				return payload.get_total_size ();
+				return get_summary ().total_size;
 			default:
 				return StructItem::compare_data (field);
 			}
@@ -162,7 +176,8 @@ namespace TransferList {
 			emit data_changed (RateField, RateField, QVector<int>{Qt::DisplayRole});
 		}
 		void progressed (void) {
-			emit data_changed (ProgressField, ProgressField,
+			// Size grows with the file list of a streamed offer
+			emit data_changed (SizeField, ProgressField,
 			                   QVector<int>{Qt::DisplayRole, Qt::StatusTipRole, Qt::ToolTipRole});
 		}
 	};
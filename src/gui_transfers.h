@@ -19,9 +19,11 @@
 #define GUI_TRANSFER_H
 
 #include <QFileDialog>
+#include <QTimer>
 
 #include "core_settings.h"
 #include "core_transfer.h"
+#include "core_workers.h"
 #include "gui_style.h"
 #include "gui_transfer_list.h"
 
@@ -32,23 +34,26 @@ namespace TransferList {
 	 *
 	 * Each download/upload class mirrors the Transfer::* class that implements the protocol.
 	 * They do not need to catch the signal failed() as it emits a status_changed(Error) anyway.
+	 * Transfers are moved to worker threads when they start (see Transfer::Workers): they are then
+	 * only read through their summary, and commands are queued.
 	 */
 
 	/* Upload class.
 	 * Created before metadata is set (call of set_payload).
-	 * But only added to transfer list after that, so everything is constant (except status).
+	 * Added to transfer list while files are scanned: all fields are updated at payload_ready.
+	 * After that, everything is constant (except status).
 	 */
 	class Upload : public Item {
 		Q_OBJECT
 
 	private:
 		using Status = Transfer::Upload::Status;
-		Transfer::Upload * upload;
 
 	public:
-		Upload (Transfer::Upload * transfer, QObject * parent = nullptr)
-		    : Item (transfer, parent), upload (transfer) {
+		Upload (Transfer::Upload * transfer, QObject * parent = nullptr) : Item (transfer, parent) {
 			connect (transfer, &Transfer::Upload::status_changed, this, &Upload::status_changed);
+			connect (transfer, &Transfer::Upload::scan_progressed, this, &Upload::scan_progressed);
+			connect (transfer, &Transfer::Upload::payload_ready, this, &Upload::payload_ready);
 		}
 
 	private:
@@ -59,7 +64,7 @@ namespace TransferList {
 				switch (role) {
 				case Qt::StatusTipRole:
 				case Qt::ToolTipRole:
-					return tr ("Uploading %1").arg (upload->get_payload ().get_payload_dir_display ());
+					return tr ("Uploading %1").arg (get_summary ().payload_dir_display);
 				case Qt::DecorationRole:
 					return Icon::upload ();
 				}
@@ -67,11 +72,14 @@ namespace TransferList {
 			case StatusField: {
 				// Status message
 				if (role == Qt::DisplayRole) {
-					switch (upload->get_status ()) {
+					auto summary = get_summary ();
+					switch (Status (summary.status)) {
 					case Status::Error:
-						return upload->get_error ();
+						return summary.error;
 					case Status::Init:
 						return tr ("Initializing");
+					case Status::Scanning:
+						return tr ("Listing files (%1)").arg (summary.nb_scanned_files);
 					case Status::Starting:
 						return tr ("Connecting");
 					case Status::WaitingForPeerAnswer:
@@ -79,8 +87,7 @@ namespace TransferList {
 					case Status::Transfering:
 						return tr ("Transfering");
 					case Status::Completed:
-						return tr ("Completed in %1")
-						    .arg (msec_to_string (upload->get_notifier ()->get_transfer_time ()));
+						return tr ("Completed in %1").arg (msec_to_string (summary.transfer_time));
 					case Status::Rejected:
 						return tr ("Rejected by peer");
 					}
@@ -93,7 +100,7 @@ namespace TransferList {
 		QVariant compare_data (int field) const Q_DECL_OVERRIDE {
 			switch (field) {
 			case StatusField:
-				return int(upload->get_status ());
+				return get_summary ().status;
 			default:
 				return Item::compare_data (field);
 			};
@@ -103,10 +110,15 @@ namespace TransferList {
 		void status_changed (Status new_status) {
 			if (new_status == Status::Completed) {
 				// Replace instant rate by average
-				set_rate (upload->get_notifier ()->get_average_rate ());
+				set_rate (get_summary ().average_rate);
 			}
 			emit data_changed (StatusField, StatusField, QVector<int>{Qt::DisplayRole});
 		}
+		void scan_progressed (void) {
+			// Size also changes if the offer is streamed
+			emit data_changed (SizeField, StatusField);
+		}
+		void payload_ready (void) { emit data_changed (FilenameField, StatusField); }
 	};
 
 	/* Download.
@@ -119,14 +131,19 @@ namespace TransferList {
 	private:
 		using Status = Transfer::Download::Status;
 		Transfer::Download * download;
+		Transfer::Workers * workers;
+		bool choice_given{false};
 
 	public:
-		Download (Transfer::Download * transfer, QObject * parent = nullptr)
-		    : Item (transfer, parent), download (transfer) {
+		Download (Transfer::Download * transfer, Transfer::Workers * workers,
+		          QObject * parent = nullptr)
+		    : Item (transfer, parent), download (transfer), workers (workers) {
 			transfer->set_target_dir (Settings::DownloadPath ().get ());
+			transfer->set_delta (Settings::DownloadDelta ().get ());
+			transfer->set_drop_cache (Settings::TransferDropCache ().get ());
 			connect (transfer, &Transfer::Download::status_changed, this, &Download::status_changed);
 			if (Settings::DownloadAuto ().get ())
-				transfer->give_user_choice (Transfer::Download::Accept);
+				give_user_choice (Transfer::Download::Accept);
 		}
 
 	private:
@@ -138,12 +155,11 @@ namespace TransferList {
 				case Qt::StatusTipRole:
 				case Qt::ToolTipRole:
 					return tr ("Downloading %1 to %2")
-					    .arg (download->get_payload ().get_payload_name (),
-					          download->get_payload ().get_payload_dir_display ());
+					    .arg (get_summary ().payload_name, get_summary ().payload_dir_display);
 				case Qt::DecorationRole:
 					return Icon::download ();
 				case Item::ButtonRole:
-					if (download->get_status () == Status::WaitingForUserChoice)
+					if (get_summary ().status == Status::WaitingForUserChoice)
 						return int(Item::ChangeDownloadPathButton);
 					break;
 				}
@@ -152,9 +168,10 @@ namespace TransferList {
 				// Status message
 				switch (role) {
 				case Qt::DisplayRole: {
-					switch (download->get_status ()) {
+					auto summary = get_summary ();
+					switch (Status (summary.status)) {
 					case Status::Error:
-						return download->get_error ();
+						return summary.error;
 					case Status::Starting:
 					case Status::WaitingForOffer:
 						Q_UNREACHABLE (); // Server gives us download objects in WaitingUserChoice
@@ -164,15 +181,14 @@ namespace TransferList {
 					case Status::Transfering:
 						return tr ("Transfering");
 					case Status::Completed:
-						return tr ("Completed in %1")
-						    .arg (msec_to_string (download->get_notifier ()->get_transfer_time ()));
+						return tr ("Completed in %1").arg (msec_to_string (summary.transfer_time));
 					case Status::Rejected:
 						return tr ("Rejected");
 					}
 				} break;
 				case Item::ButtonRole: {
 					auto btns = Item::Buttons (Item::data (field, role).toInt ());
-					if (download->get_status () == Status::WaitingForUserChoice)
+					if (get_summary ().status == Status::WaitingForUserChoice)
 						btns |= Item::AcceptButton | Item::CancelButton;
 					return int(btns);
 				} break;
@@ -185,27 +201,28 @@ namespace TransferList {
 		QVariant compare_data (int field) const Q_DECL_OVERRIDE {
 			switch (field) {
 			case StatusField:
-				return int(download->get_status ());
+				return get_summary ().status;
 			default:
 				return Item::compare_data (field);
 			};
 		}
 
 		bool button_clicked (int field, Button btn) Q_DECL_OVERRIDE {
-			switch (download->get_status ()) {
+			switch (Status (get_summary ().status)) {
 			case Status::WaitingForUserChoice: {
+				if (choice_given)
+					break; // Status not updated yet
 				switch (btn) {
 				case AcceptButton:
-					download->give_user_choice (Transfer::Download::Accept);
+					give_user_choice (Transfer::Download::Accept);
 					return true;
 				case CancelButton:
-					download->give_user_choice (Transfer::Download::Reject);
+					give_user_choice (Transfer::Download::Reject);
 					return true;
 				case ChangeDownloadPathButton: {
 					// This button change the destination directory (like the default download path)
 					QString path = QFileDialog::getExistingDirectory (
-					    nullptr, tr ("Select download destination directory"),
-					    download->get_payload ().get_root_dir ().path ());
+					    nullptr, tr ("Select download destination directory"), get_summary ().root_dir);
 					if (!path.isEmpty ()) {
 						download->set_target_dir (path);
 						emit data_changed (FilenameField, FilenameField,
@@ -223,11 +240,22 @@ namespace TransferList {
 			return Item::button_clicked (field, btn);
 		}
 
+		void give_user_choice (Transfer::Download::UserChoice choice) {
+			// Accepted transfers run in a worker thread
+			choice_given = true;
+			if (choice == Transfer::Download::Accept) {
+				workers->adopt (download);
+				QTimer::singleShot (0, download, SLOT (accept ()));
+			} else {
+				download->give_user_choice (choice);
+			}
+		}
+
 	private slots:
 		void status_changed (Status new_status, Status old) {
 			if (new_status == Status::Completed) {
 				// Replace instant rate by average
-				set_rate (download->get_notifier ()->get_average_rate ());
+				set_rate (get_summary ().average_rate);
 			}
 			if (old == Status::WaitingForUserChoice) {
 				// Clean buttons
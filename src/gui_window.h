@@ -39,6 +39,7 @@
 #include "core_localshare.h"
 #include "core_server.h"
 #include "core_settings.h"
+#include "core_workers.h"
 #include "gui_discovery_subsystem.h"
 #include "gui_peer_list.h"
 #include "gui_style.h"
@@ -55,6 +56,7 @@ namespace Gui {
  * visibility. Application can be closed by tray menu -> quit.
  *
  * The Transfer Server should be alive for the lifetime of Window.
+ * Transfers run in worker threads once started, so that they do not slow down the interface.
  */
 class Window : public QMainWindow {
 	Q_OBJECT
@@ -65,6 +67,8 @@ private:
 
 	QSystemTrayIcon * tray{nullptr};
 
+	Transfer::Workers * workers{nullptr};
+
 	QAbstractItemView * peer_list_view{nullptr};
 	PeerList::Model * peer_list_model{nullptr};
 	TransferList::Model * transfer_list_model{nullptr};
@@ -72,7 +76,8 @@ private:
 public:
 	Window (QWidget * parent = nullptr) : QMainWindow (parent) {
 		{
-			// Start Server
+			// Start Server, and threads for transfers
+			workers = new Transfer::Workers (this);
 			auto server = new Transfer::Server (this);
 			connect (server, &Transfer::Server::download_ready, this, &Window::new_download);
 
@@ -191,6 +196,47 @@ public:
 			connect (send_hidden_files, &QAction::triggered,
 			         [=](bool checked) { Settings::UploadHidden ().set (checked); });
 
+			auto skip_present = new QAction (tr ("&Skip files the peer already has"), pref);
+			skip_present->setCheckable (true);
+			skip_present->setChecked (Settings::UploadSkipPresent ().get ());
+			skip_present->setStatusTip (
+			    tr ("Hash files before sending, so that identical files of the peer are not sent."));
+			connect (skip_present, &QAction::triggered,
+			         [=](bool checked) { Settings::UploadSkipPresent ().set (checked); });
+
+			auto compression = new QAction (tr ("C&ompress sent data"), pref);
+			compression->setCheckable (true);
+			compression->setChecked (Settings::UploadCompression ().get ());
+			compression->setStatusTip (
+			    tr ("Compress sent data if the peer supports it, and if it is faster this way."));
+			connect (compression, &QAction::triggered,
+			         [=](bool checked) { Settings::UploadCompression ().set (checked); });
+
+			auto connections = new QAction (tr ("Set number of &connections..."), pref);
+			connections->setStatusTip (
+			    tr ("Sets the number of parallel connections used to send files (fast networks)."));
+			connect (connections, &QAction::triggered, [=](void) {
+				Settings::UploadConnections setting;
+				bool ok = false;
+				auto nb = QInputDialog::getInt (this, tr ("Set number of connections"),
+				                                tr ("Connections:"), setting.get (), 1,
+				                                Const::max_connections, 1, &ok);
+				if (ok)
+					setting.set (nb);
+			});
+
+			auto buffer_budget = new QAction (tr ("Set send &buffer size..."), pref);
+			buffer_budget->setStatusTip (
+			    tr ("Sets the maximum memory used to buffer sent data (0 for small fixed buffers)."));
+			connect (buffer_budget, &QAction::triggered, [=](void) {
+				Settings::UploadBufferBudget setting;
+				bool ok = false;
+				auto mib = QInputDialog::getInt (this, tr ("Set send buffer size"), tr ("Size (MiB):"),
+				                                 setting.get (), 0, 1024, 1, &ok);
+				if (ok)
+					setting.set (mib);
+			});
+
 			auto download_path =
 			    new QAction (Icon::change_download_path (), tr ("Set default download &path..."), pref);
 			download_path->setStatusTip (tr ("Sets the path used by default to store downloaded files."));
@@ -210,6 +256,22 @@ public:
 			connect (download_auto, &QAction::triggered,
 			         [=](bool checked) { Settings::DownloadAuto ().set (checked); });
 
+			auto download_delta = new QAction (tr ("Reuse &existing files"), pref);
+			download_delta->setCheckable (true);
+			download_delta->setChecked (Settings::DownloadDelta ().get ());
+			download_delta->setStatusTip (
+			    tr ("Only download differences with existing files of the same name."));
+			connect (download_delta, &QAction::triggered,
+			         [=](bool checked) { Settings::DownloadDelta ().set (checked); });
+
+			auto drop_cache = new QAction (tr ("Spare the system &file cache"), pref);
+			drop_cache->setCheckable (true);
+			drop_cache->setChecked (Settings::TransferDropCache ().get ());
+			drop_cache->setStatusTip (
+			    tr ("Drop transferred data from the system file cache (for shared machines)."));
+			connect (drop_cache, &QAction::triggered,
+			         [=](bool checked) { Settings::TransferDropCache ().set (checked); });
+
 			auto change_username =
 			    new QAction (Icon::change_username (), tr ("Change &username..."), pref);
 			change_username->setStatusTip ("Set a new username in settings and discovery");
@@ -224,8 +286,14 @@ public:
 			pref->addAction (use_tray);
 			pref->addSeparator ();
 			pref->addAction (send_hidden_files);
+			pref->addAction (skip_present);
+			pref->addAction (compression);
+			pref->addAction (connections);
+			pref->addAction (buffer_budget);
 			pref->addAction (download_path);
 			pref->addAction (download_auto);
+			pref->addAction (download_delta);
+			pref->addAction (drop_cache);
 			pref->addSeparator ();
 			pref->addAction (change_username);
 		}
@@ -333,19 +401,24 @@ private slots:
 	// Transfer creation
 
 	void request_upload (const Peer & peer, const QString & filepath) {
-		// TODO move to a more event-like management (for file list building) ?
 		auto upload = new Transfer::Upload (peer.username, local_peer->get_username ());
-		// Link to item to catch any error, then load files
+		// Link to item to catch any error, then start listing files
 		auto item = new TransferList::Upload (upload, this);
-		if (!upload->set_payload (filepath, Settings::UploadHidden ().get ()))
+		if (!upload->set_payload (filepath, Settings::UploadHidden ().get (),
+		                          Settings::UploadSkipPresent ().get ()))
 			return;
-		// Only then connect and show the item
+		upload->set_compression (Settings::UploadCompression ().get ());
+		upload->set_connections (Settings::UploadConnections ().get ());
+		upload->set_buffer_budget (qint64 (Settings::UploadBufferBudget ().get ()) << 20);
+		upload->set_drop_cache (Settings::TransferDropCache ().get ());
+		// Show the item while listing, connection starts after
 		upload->connect (peer.address, peer.port);
+		workers->adopt (upload);
 		transfer_list_model->append (item);
 	}
 
 	void new_download (Transfer::Download * download) {
-		auto item = new TransferList::Download (download, this);
+		auto item = new TransferList::Download (download, workers, this);
 		transfer_list_model->append (item);
 	}
 
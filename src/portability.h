@@ -20,16 +20,31 @@
 
 // Abstracts os specific stuff in a portable way
 
-// Terminal size
+#include <QtGlobal>
+
+// Terminal size, file and socket system calls
 #ifdef Q_OS_UNIX
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #endif
+#ifdef Q_OS_LINUX
+#include <linux/fs.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
 #ifdef Q_OS_WIN
 #include <windows.h>
 #endif
 
-int terminal_width (void) {
+inline int terminal_width (void) {
 	int size = 80; // Default
 #ifdef Q_OS_UNIX
 	struct winsize sz;
@@ -44,4 +59,371 @@ int terminal_width (void) {
 	return size;
 }
 
+/* Send file data directly to a socket, without copying it to user space.
+ * Sends at most bytes from file_fd (starting at offset) to the non-blocking socket_fd.
+ * Returns the number of bytes sent, 0 if the socket would block, or -1 on error (see errno).
+ * has_zero_copy_send() tells if it is implemented on this system.
+ * After an error, zero_copy_send_unsupported() tells if it failed due to the file or socket type,
+ * and zero_copy_send_file_ended() if the file ended before offset (truncated since opened).
+ */
+inline bool has_zero_copy_send (void) {
+#ifdef Q_OS_LINUX
+	return true;
+#else
+	return false;
+#endif
+}
+inline qint64 zero_copy_send (int socket_fd, int file_fd, qint64 offset, qint64 bytes) {
+#ifdef Q_OS_LINUX
+	off_t off = offset;
+	auto r = ::sendfile (socket_fd, file_fd, &off, static_cast<size_t> (bytes));
+	if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (r == 0 && bytes > 0) {
+		errno = ENODATA; // Not a full socket: end of file
+		return -1;
+	}
+	return r;
+#else
+	Q_UNUSED (socket_fd);
+	Q_UNUSED (file_fd);
+	Q_UNUSED (offset);
+	Q_UNUSED (bytes);
+	return -1;
+#endif
+}
+inline bool zero_copy_send_unsupported (void) {
+#ifdef Q_OS_LINUX
+	return errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP;
+#else
+	return true;
+#endif
+}
+inline bool zero_copy_send_file_ended (void) {
+#ifdef Q_OS_LINUX
+	return errno == ENODATA;
+#else
+	return false;
+#endif
+}
+
+/* List a directory with one system call per entry (no path resolution, no QFileInfo).
+ * Calls f (const DirectoryEntry &) for each subdirectory and readable regular file.
+ * Other entries (symbolic links, special files) and ".", ".." are ignored.
+ * Returns false if the directory cannot be opened.
+ * has_directory_listing() tells if it is implemented on this system (else use QDir).
+ */
+struct DirectoryEntry {
+	const char * name;
+	bool is_dir;
+	qint64 size;
+	qint64 last_modified_msec; // Since epoch
+};
+inline bool has_directory_listing (void) {
+#ifdef Q_OS_UNIX
+	return true;
+#else
+	return false;
+#endif
+}
+template <typename F> inline bool list_directory (const char * path, F f) {
+#ifdef Q_OS_UNIX
+	auto dir = ::opendir (path);
+	if (dir == nullptr)
+		return false;
+	auto fd = ::dirfd (dir);
+	while (auto e = ::readdir (dir)) {
+		auto name = e->d_name;
+		if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+			continue;
+		if (e->d_type == DT_DIR) {
+			f (DirectoryEntry{name, true, 0, 0});
+			continue;
+		}
+		if (e->d_type != DT_REG && e->d_type != DT_UNKNOWN)
+			continue; // Symbolic links, special files
+		struct stat st;
+		if (::fstatat (fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+			continue;
+		if (S_ISDIR (st.st_mode)) {
+			f (DirectoryEntry{name, true, 0, 0});
+		} else if (S_ISREG (st.st_mode) && ::faccessat (fd, name, R_OK, 0) == 0) {
+#if defined(Q_OS_LINUX)
+			auto msec = qint64 (st.st_mtim.tv_sec) * 1000 + st.st_mtim.tv_nsec / 1000000;
+#elif defined(Q_OS_MAC)
+			auto msec = qint64 (st.st_mtimespec.tv_sec) * 1000 + st.st_mtimespec.tv_nsec / 1000000;
+#else
+			auto msec = qint64 (st.st_mtime) * 1000;
+#endif
+			f (DirectoryEntry{name, false, qint64 (st.st_size), msec});
+		}
+	}
+	::closedir (dir);
+	return true;
+#else
+	Q_UNUSED (path);
+	Q_UNUSED (f);
+	return false;
+#endif
+}
+
+/* Smoothed round trip time of a TCP connection, as estimated by the system.
+ * Returns it in microseconds, or -1 if unavailable.
+ */
+inline qint64 socket_rtt_usec (int socket_fd) {
+#ifdef Q_OS_LINUX
+	struct tcp_info info;
+	socklen_t size = sizeof (info);
+	if (::getsockopt (socket_fd, IPPROTO_TCP, TCP_INFO, &info, &size) == -1 || info.tcpi_rtt == 0)
+		return -1;
+	return info.tcpi_rtt;
+#else
+	Q_UNUSED (socket_fd);
+	return -1;
+#endif
+}
+
+/* Positional writes to a file descriptor.
+ * positional_write writes all bytes at offset (retrying partial writes).
+ * It returns false on error (see errno).
+ * has_positional_write() tells if it is implemented on this system.
+ */
+inline bool has_positional_write (void) {
+#ifdef Q_OS_UNIX
+	return true;
+#else
+	return false;
+#endif
+}
+inline bool positional_write (int fd, const char * data, qint64 bytes, qint64 offset) {
+#ifdef Q_OS_UNIX
+	while (bytes > 0) {
+		auto r = ::pwrite (fd, data, static_cast<size_t> (bytes), static_cast<off_t> (offset));
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += r;
+		bytes -= r;
+		offset += r;
+	}
+	return true;
+#else
+	Q_UNUSED (fd);
+	Q_UNUSED (data);
+	Q_UNUSED (bytes);
+	Q_UNUSED (offset);
+	return false;
+#endif
+}
+
+/* Receive data from a socket fd without blocking, bypassing the QAbstractSocket buffer.
+ * It must only be used when the QAbstractSocket buffer is empty, to keep the data in order.
+ * socket_receive returns bytes received, 0 if no data is available, or -1 on error (see errno).
+ * The peer closing the connection is an error (ECONNRESET), as the caller expects data.
+ * has_direct_receive() tells if it is implemented on this system.
+ */
+inline bool has_direct_receive (void) {
+#ifdef Q_OS_UNIX
+	return true;
+#else
+	return false;
+#endif
+}
+inline qint64 socket_receive (int socket_fd, char * data, qint64 bytes) {
+#ifdef Q_OS_UNIX
+	while (true) {
+		auto r = ::recv (socket_fd, data, static_cast<size_t> (bytes), MSG_DONTWAIT);
+		if (r > 0)
+			return r;
+		if (r == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		return -1;
+	}
+#else
+	Q_UNUSED (socket_fd);
+	Q_UNUSED (data);
+	Q_UNUSED (bytes);
+	return -1;
+#endif
+}
+
+/* Tell the system that a file mapping will be accessed sequentially.
+ * Pages are read ahead more aggressively, and can be freed soon after being accessed.
+ */
+inline void advise_sequential (void * addr, qint64 bytes) {
+#if defined(Q_OS_UNIX) && defined(POSIX_MADV_SEQUENTIAL)
+	::posix_madvise (addr, static_cast<size_t> (bytes), POSIX_MADV_SEQUENTIAL);
+#else
+	Q_UNUSED (addr);
+	Q_UNUSED (bytes);
+#endif
+}
+
+/* Page cache hints for a file range (noop if not supported).
+ * drop_cached_data tells that the data will not be used again: clean pages are freed, dirty
+ * pages start being written back. Pages that are still mapped are not freed.
+ * prefetch_data tells that the data will be used soon: it is read ahead in the background.
+ */
+inline void drop_cached_data (int fd, qint64 offset, qint64 bytes) {
+#if defined(Q_OS_UNIX) && defined(POSIX_FADV_DONTNEED)
+	if (bytes > 0)
+		::posix_fadvise (fd, offset, bytes, POSIX_FADV_DONTNEED);
+#else
+	Q_UNUSED (fd);
+	Q_UNUSED (offset);
+	Q_UNUSED (bytes);
+#endif
+}
+inline void prefetch_data (int fd, qint64 offset, qint64 bytes) {
+#if defined(Q_OS_UNIX) && defined(POSIX_FADV_WILLNEED)
+	if (bytes > 0)
+		::posix_fadvise (fd, offset, bytes, POSIX_FADV_WILLNEED);
+#else
+	Q_UNUSED (fd);
+	Q_UNUSED (offset);
+	Q_UNUSED (bytes);
+#endif
+}
+
+/* Holes of sparse files.
+ * file_allocated_size returns the bytes allocated on disk for a file, or -1 if unknown.
+ * A file is only worth scanning for holes if it is smaller than its size.
+ * find_data returns the start of the next data at or after offset, find_hole the next hole
+ * (the end of file counts as a hole). Both return -1 if there is none.
+ * Without support (or on error), find_data returns offset and find_hole -1: no holes.
+ */
+inline qint64 file_allocated_size (int fd) {
+#ifdef Q_OS_UNIX
+	struct stat info;
+	if (::fstat (fd, &info) == -1)
+		return -1;
+	return qint64 (info.st_blocks) * 512;
+#else
+	Q_UNUSED (fd);
+	return -1;
+#endif
+}
+inline qint64 find_data (int fd, qint64 offset) {
+#if defined(Q_OS_UNIX) && defined(SEEK_DATA)
+	auto r = ::lseek (fd, static_cast<off_t> (offset), SEEK_DATA);
+	if (r == -1 && errno != ENXIO)
+		return offset; // Not supported by the file system: all data
+	return r;
+#else
+	Q_UNUSED (fd);
+	return offset;
+#endif
+}
+inline qint64 find_hole (int fd, qint64 offset) {
+#if defined(Q_OS_UNIX) && defined(SEEK_HOLE)
+	return ::lseek (fd, static_cast<off_t> (offset), SEEK_HOLE);
+#else
+	Q_UNUSED (fd);
+	Q_UNUSED (offset);
+	return -1;
+#endif
+}
+
+/* Identity of the running system, to detect peers on the same host (0 if unknown).
+ * On Linux, it is a hash of the boot id: containers of the same kernel share it.
+ */
+inline quint64 host_id (void) {
+#ifdef Q_OS_LINUX
+	static const quint64 id = [] {
+		char buffer[64];
+		auto fd = ::open ("/proc/sys/kernel/random/boot_id", O_RDONLY);
+		if (fd == -1)
+			return quint64 (0);
+		auto r = ::read (fd, buffer, sizeof (buffer));
+		::close (fd);
+		quint64 hash = 14695981039346656037ULL; // FNV-1a
+		for (ssize_t i = 0; i < r; ++i) {
+			hash ^= quint8 (buffer[i]);
+			hash *= 1099511628211ULL;
+		}
+		return r > 0 ? hash : quint64 (0);
+	}();
+	return id;
+#else
+	return 0;
+#endif
+}
+
+/* Same host file copies, without going through user space.
+ * clone_file makes out_fd share the data of in_fd (reflink, copy on write).
+ * It returns false if not supported (file system, or files on different file systems).
+ * copy_file_data copies bytes at offset of in_fd to the same offset of out_fd in the kernel.
+ * It returns bytes copied (may be less, 0 at the end of in_fd), or -1 on error (see errno).
+ * If copy_file_unsupported () after an error, data must be copied through user space.
+ */
+inline bool clone_file (int in_fd, int out_fd) {
+#if defined(Q_OS_LINUX) && defined(FICLONE)
+	return ::ioctl (out_fd, FICLONE, in_fd) == 0;
+#else
+	Q_UNUSED (in_fd);
+	Q_UNUSED (out_fd);
+	return false;
+#endif
+}
+inline qint64 copy_file_data (int in_fd, int out_fd, qint64 offset, qint64 bytes) {
+#if defined(Q_OS_LINUX) && defined(__NR_copy_file_range)
+	loff_t in_offset = offset;
+	loff_t out_offset = offset;
+	while (true) {
+		auto r = ::syscall (__NR_copy_file_range, in_fd, &in_offset, out_fd, &out_offset,
+		                    static_cast<size_t> (bytes), 0u);
+		if (r != -1 || errno != EINTR)
+			return r;
+	}
+#else
+	Q_UNUSED (in_fd);
+	Q_UNUSED (out_fd);
+	Q_UNUSED (offset);
+	Q_UNUSED (bytes);
+	return -1;
+#endif
+}
+inline bool copy_file_unsupported (void) {
+#ifdef Q_OS_LINUX
+	return errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP;
+#else
+	return true;
+#endif
+}
+
+/* Writeback control of a file range (noop if not supported).
+ * start_writeback starts writing dirty pages to disk, without waiting.
+ * wait_writeback waits until the pages are written to disk.
+ * Together they bound the amount of dirty page cache of a large sequential write.
+ */
+inline void start_writeback (int fd, qint64 offset, qint64 bytes) {
+#ifdef Q_OS_LINUX
+	if (bytes > 0)
+		::sync_file_range (fd, offset, bytes, SYNC_FILE_RANGE_WRITE);
+#else
+	Q_UNUSED (fd);
+	Q_UNUSED (offset);
+	Q_UNUSED (bytes);
+#endif
+}
+inline void wait_writeback (int fd, qint64 offset, qint64 bytes) {
+#ifdef Q_OS_LINUX
+	if (bytes > 0)
+		::sync_file_range (fd, offset, bytes, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+		                                          SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+	Q_UNUSED (fd);
+	Q_UNUSED (offset);
+	Q_UNUSED (bytes);
+#endif
+}
+
 #endif